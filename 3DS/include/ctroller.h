@@ -4,6 +4,7 @@
 #include <stddef.h>
 
 #include "hid.h"
+#include "protocol.h"
 
 #define _STRINGIFY(a) #a
 #define STRINGIFY(a) _STRINGIFY(a)
@@ -51,6 +52,14 @@
  **/
 #define CFG_PORT "15708"
 
+/** Number of earlier key edges repeated in every packet
+ *
+ * Wi-Fi tends to drop several packets in a row; repeating the last few
+ * button presses and releases lets the server replay a tap even if every
+ * packet that carried it was lost. Set to 0 to turn this off.
+ **/
+#define CFG_EDGE_RECORDS 4
+
 /** Initialize the ctroller client
  **/
 Result ctrollerInit(void);
@@ -74,33 +83,70 @@ int ctrollerReadServerIP(char *ipstr, size_t len, const char *path);
  **/
 #define PACKET_MAGIC 0x3d5c
 
+/** Protocol revision of the packets sent by this client
+ *
+ * Revision 1 adds a sequence number after the version field, which lets the
+ * server drop reordered and duplicated packets.
+ **/
+#define PACKET_REVISION 1
+
 /** Constant identifying a packet version
  *
- * This value is represented in a BCD (binary-coded decimal) format.
- * I.e. '0x0123' stands for version 1.2.3
+ * The lower twelve bits are represented in a BCD (binary-coded decimal)
+ * format, i.e. '0x0123' stands for version 1.2.3. The top four bits hold the
+ * protocol revision.
  **/
-#define PACKET_VERSION MAKEBCDVER(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH)
+#define PACKET_VERSION                                                         \
+    (PACKET_REVISION << 12 |                                                   \
+     MAKEBCDVER(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH))
 
 /** Minimum number of bytes per package
  *
- * A package consists of metadata (magic value + version info) and the
- * contents of a hidinfo structure encoded in network byte order.
+ * A package consists of metadata (magic value, version info and sequence
+ * number) and the contents of a hidinfo structure encoded in network byte
+ * order.
  **/
-#define PACKET_SIZE (2 * sizeof(uint16_t) + sizeof(struct hidInfo))
+#define PACKET_SIZE                                                            \
+    (2 * sizeof(uint16_t) + sizeof(uint32_t) + sizeof(struct hidInfo))
 
-/** A network packet that can hold all HID information collected
+/** A network packet that can hold all HID information collected, in either
+ * revision
  **/
-typedef uint8_t packet_hid_t[PACKET_SIZE];
+typedef uint8_t packet_hid_t[PACKET_SIZE > PROTOCOL_STATE_SIZE_MAX
+                                 ? PACKET_SIZE
+                                 : PROTOCOL_STATE_SIZE_MAX];
 
 struct hidInfo;
 /** Write HID info into a packet ready to be sent
  *
  * @param packet Buffer to pack HID info into
  * @param hidinfo HID info collected from the system
+ * @param sequence Sequence number of the packet, incremented for every packet
+ *
+ * @returns Number of bytes written to packet
+ **/
+int ctrollerPackHIDInfo(packet_hid_t packet,
+                        const struct hidInfo *hid,
+                        uint32_t sequence);
+
+/** Write HID info into a revision 2 packet
+ *
+ * Only fields that changed since the newest state the server acknowledged
+ * are written, restricted to the sensors agreed on in the handshake.
+ *
+ * @param packet Buffer to pack HID info into
+ * @param hidinfo HID info collected from the system
+ * @param sequence Sequence number of the packet, incremented for every packet
  *
  * @returns Number of bytes written to packet
  **/
-int ctrollerPackHIDInfo(packet_hid_t packet, const struct hidInfo *hid);
+int ctrollerPackHIDState(uint8_t *packet,
+                         const struct hidInfo *hid,
+                         uint32_t sequence);
+
+/** Handle welcome and ack packets the server sent since the last call
+ **/
+void ctrollerReceive(void);
 
 /** Send data to the server
  *
@@ -0,0 +1,121 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+
+/** Revision 2 wire format
+ *
+ * Instead of all fields at a fixed size, a revision 2 state packet only
+ * carries the fields that changed since a state the server acknowledged,
+ * as variable length integers. Before sending those, the client says hello
+ * and the server answers with the sensors it wants; a server that does not
+ * answer only ever sees revision 1 packets.
+ *
+ * Header:  u16 magic, u16 version, u32 sequence, u8 type
+ * Hello:   header, u8 sensors offered
+ * Welcome: header echoing the hello's sequence, u8 sensors accepted
+ * State:   header, u8 base distance, u16 field bitmap, varint per field
+ * Ack:     header whose sequence is the acknowledged state
+ *
+ * Bit 15 of the field bitmap announces a trailer of key edges sent in
+ * earlier packets, oldest first, so the server can make up for lost ones:
+ *
+ *   u8 count, then per record: u8 distance, varint down, varint up
+ **/
+#define PROTOCOL_REVISION 2
+
+#define PROTOCOL_HEADER_SIZE 9
+#define PROTOCOL_HELLO_SIZE (PROTOCOL_HEADER_SIZE + 1)
+
+/** Most edge records the server accepts in a single packet
+ **/
+#define PROTOCOL_EDGE_RECORDS_MAX 8
+
+/** Largest state packet: three 32 bit key masks, twelve 16 bit axes and a
+ * full trailer of edge records
+ **/
+#define PROTOCOL_STATE_SIZE_MAX                                                \
+    (PROTOCOL_HEADER_SIZE + 3 + 3 * 5 + 12 * 3 + 1 +                           \
+     PROTOCOL_EDGE_RECORDS_MAX * (1 + 2 * 5))
+
+#define PROTOCOL_EDGE_RECORDS (1 << 15)
+
+/** Number of sent states kept to encode new ones against
+ *
+ * States acknowledged longer ago than this are not used as a base; the client
+ * falls back to encoding against the all-zero state instead.
+ **/
+#define PROTOCOL_HISTORY 16
+
+enum {
+    PROTOCOL_HELLO   = 1,
+    PROTOCOL_WELCOME = 2,
+    PROTOCOL_STATE   = 3,
+    PROTOCOL_ACK     = 4,
+};
+
+/** Sensor groups negotiated in the handshake; keys are always sent
+ **/
+enum {
+    PROTOCOL_SENSOR_CIRCLEPAD     = 1 << 0,
+    PROTOCOL_SENSOR_CSTICK        = 1 << 1,
+    PROTOCOL_SENSOR_TOUCHSCREEN   = 1 << 2,
+    PROTOCOL_SENSOR_GYROSCOPE     = 1 << 3,
+    PROTOCOL_SENSOR_ACCELEROMETER = 1 << 4,
+
+    PROTOCOL_SENSOR_ALL = (1 << 5) - 1,
+};
+
+/** Key edges of an earlier packet
+ **/
+struct protocolEdge {
+    uint32_t sequence;
+    uint32_t down;
+    uint32_t up;
+};
+
+struct protocolHeader {
+    uint16_t version;
+    uint32_t sequence;
+    uint8_t type;
+};
+
+/** Write a packet header
+ *
+ * @returns Number of bytes written to buf
+ **/
+int protocolPackHeader(uint8_t *buf, const struct protocolHeader *header);
+
+/** Read a packet header
+ *
+ * @returns Number of bytes read from buf
+ * @returns < 0 if buf is too short or not a ctroller packet
+ **/
+int protocolUnpackHeader(const uint8_t *buf,
+                         size_t len,
+                         struct protocolHeader *header);
+
+/** Encode the fields of a state that differ from base
+ *
+ * @param buf      Buffer following the base distance of a state packet
+ * @param hid      State to encode
+ * @param base     State the server has acknowledged, or all zeros
+ * @param sensors  Sensors the server accepted in the handshake
+ * @param edges    Edges of earlier packets to repeat, oldest first
+ * @param count    Number of records in edges
+ * @param sequence Sequence number of the packet
+ *
+ * @returns Number of bytes written to buf
+ **/
+int protocolEncodeState(uint8_t *buf,
+                        const struct hidInfo *hid,
+                        const struct hidInfo *base,
+                        unsigned sensors,
+                        const struct protocolEdge *edges,
+                        unsigned count,
+                        uint32_t sequence);
+
+#endif /* ----- #ifndef PROTOCOL_H  ----- */
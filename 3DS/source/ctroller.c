@@ -2,6 +2,7 @@
 
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
@@ -11,15 +12,42 @@
 
 #include "util.h"
 #include "hid.h"
+#include "protocol.h"
+
+/** Number of frames between two hellos while the server has not answered
+ **/
+#define HELLO_INTERVAL 60
 
 struct peer {
     int socket;
     struct addrinfo *addr_list;
     struct addrinfo *addr;
+    uint32_t sequence;
+
+    // Negotiated in the handshake; revision 1 until the server welcomes us
+    int revision;
+    unsigned sensors;
+
+    // Newest state the server acknowledged, and the states it may refer to
+    int acked;
+    uint32_t ack;
+    struct hidInfo history[PROTOCOL_HISTORY];
+
+    // Most recent key edges, oldest first; one spare entry keeps the array
+    // valid with CFG_EDGE_RECORDS set to 0
+    struct protocolEdge edges[CFG_EDGE_RECORDS + 1];
+    unsigned edgeCount;
 };
 
+_Static_assert(CFG_EDGE_RECORDS <= PROTOCOL_EDGE_RECORDS_MAX,
+               "the server does not accept that many edge records");
+
 static struct peer SERVER = {
-    .socket = -1, .addr_list = NULL, .addr = NULL,
+    .socket    = -1,
+    .addr_list = NULL,
+    .addr      = NULL,
+    .sequence  = 0,
+    .revision  = PACKET_REVISION,
 };
 
 // static int isNew3DS = 0;
@@ -84,6 +112,11 @@ Result ctrollerInit(void)
     }
     SERVER.addr = inf;
 
+    // Answers of the server are picked up between frames, never waited for
+    fcntl(SERVER.socket,
+          F_SETFL,
+          fcntl(SERVER.socket, F_GETFL, 0) | O_NONBLOCK);
+
     return SERVER.socket;
 }
 
@@ -120,6 +153,104 @@ int ctrollerSend(const void *buf, size_t len)
                   SERVER.addr->ai_addrlen);
 }
 
+static int ctrollerSendHello(void)
+{
+    uint8_t packet[PROTOCOL_HELLO_SIZE];
+    struct protocolHeader header = {
+        .version  = PROTOCOL_REVISION << 12 | (PACKET_VERSION & 0x0fff),
+        .sequence = SERVER.sequence,
+        .type     = PROTOCOL_HELLO,
+    };
+
+    int len      = protocolPackHeader(packet, &header);
+    packet[len++] = PROTOCOL_SENSOR_ALL;
+
+    return ctrollerSend(packet, len);
+}
+
+void ctrollerReceive(void)
+{
+    uint8_t packet[PROTOCOL_HELLO_SIZE];
+    struct protocolHeader header;
+    int len;
+
+    while ((len = recv(SERVER.socket, packet, sizeof(packet), 0)) > 0) {
+        int offset = protocolUnpackHeader(packet, len, &header);
+        if (offset < 0) {
+            continue;
+        }
+
+        switch (header.type) {
+        case PROTOCOL_WELCOME:
+            if (len < PROTOCOL_HELLO_SIZE || SERVER.revision >= 2) {
+                break;
+            }
+            SERVER.revision = PROTOCOL_REVISION;
+            SERVER.sensors  = packet[offset];
+            SERVER.acked    = 0;
+            util_debug_printf("Server speaks revision %d, sensors %#x.\n",
+                              PROTOCOL_REVISION,
+                              SERVER.sensors);
+            break;
+        case PROTOCOL_ACK:
+            // Acks may arrive out of order; only ever move forward
+            if (!SERVER.acked || (int32_t)(header.sequence - SERVER.ack) > 0) {
+                SERVER.ack   = header.sequence;
+                SERVER.acked = 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+int ctrollerPackHIDState(uint8_t *packet,
+                         const struct hidInfo *hid,
+                         uint32_t sequence)
+{
+    static const struct hidInfo neutral;
+    const struct hidInfo *base = &neutral;
+    uint8_t distance           = 0;
+
+    if (SERVER.acked && sequence - SERVER.ack < PROTOCOL_HISTORY) {
+        base     = &SERVER.history[SERVER.ack % PROTOCOL_HISTORY];
+        distance = sequence - SERVER.ack;
+    }
+
+    struct protocolHeader header = {
+        .version  = PROTOCOL_REVISION << 12 | (PACKET_VERSION & 0x0fff),
+        .sequence = sequence,
+        .type     = PROTOCOL_STATE,
+    };
+
+    uint8_t *bufptr = packet + protocolPackHeader(packet, &header);
+    *bufptr++       = distance;
+    bufptr += protocolEncodeState(bufptr,
+                                  hid,
+                                  base,
+                                  SERVER.sensors,
+                                  SERVER.edges,
+                                  SERVER.edgeCount,
+                                  sequence);
+
+    SERVER.history[sequence % PROTOCOL_HISTORY] = *hid;
+
+    if (CFG_EDGE_RECORDS > 0 && (hid->keys.down || hid->keys.up)) {
+        if (SERVER.edgeCount == CFG_EDGE_RECORDS) {
+            memmove(&SERVER.edges[0],
+                    &SERVER.edges[1],
+                    (CFG_EDGE_RECORDS - 1) * sizeof(SERVER.edges[0]));
+            SERVER.edgeCount--;
+        }
+        SERVER.edges[SERVER.edgeCount++] = (struct protocolEdge){
+            .sequence = sequence, .down = hid->keys.down, .up = hid->keys.up,
+        };
+    }
+
+    return bufptr - packet;
+}
+
 int ctrollerSendHIDInfo(void)
 {
     int res = 0;
@@ -130,10 +261,21 @@ int ctrollerSendHIDInfo(void)
         return res;
     }
 
+    ctrollerReceive();
+    if (SERVER.revision < PROTOCOL_REVISION &&
+        SERVER.sequence % HELLO_INTERVAL == 0) {
+        ctrollerSendHello();
+    }
+
     packet_hid_t packet;
-    ctrollerPackHIDInfo(packet, &hid);
+    int len;
+    if (SERVER.revision >= PROTOCOL_REVISION) {
+        len = ctrollerPackHIDState(packet, &hid, SERVER.sequence++);
+    } else {
+        len = ctrollerPackHIDInfo(packet, &hid, SERVER.sequence++);
+    }
 
-    res = ctrollerSend(packet, PACKET_SIZE);
+    res = ctrollerSend(packet, len);
     // ctrollerSend returns a negative value on error
     return (res > 0) ? 0 : res;
 }
@@ -152,12 +294,15 @@ CTROLLER_PACK_DEFINE(uint32_t, htonl);
 
 #undef CTROLLER_PACK_DEFINE
 
-int ctrollerPackHIDInfo(packet_hid_t packet, const struct hidInfo *hid)
+int ctrollerPackHIDInfo(packet_hid_t packet,
+                        const struct hidInfo *hid,
+                        uint32_t sequence)
 {
     uint8_t *bufptr = packet;
 
     bufptr = pack_uint16_t(bufptr, PACKET_MAGIC);
     bufptr = pack_uint16_t(bufptr, PACKET_VERSION);
+    bufptr = pack_uint32_t(bufptr, sequence);
 
     bufptr = pack_uint32_t(bufptr, hid->keys.up);
     bufptr = pack_uint32_t(bufptr, hid->keys.down);
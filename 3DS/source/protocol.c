@@ -0,0 +1,129 @@
+#include "protocol.h"
+
+#include "ctroller.h"
+
+/* LEB128: seven bits per byte, least significant group first */
+static uint8_t *putVarint(uint8_t *buf, uint32_t val)
+{
+    while (val >= 0x80) {
+        *buf++ = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    *buf++ = val;
+    return buf;
+}
+
+/* Difference of two 16 bit values, zigzag encoded so that small negative
+ * differences stay short as well
+ */
+static inline uint32_t zigzag(uint16_t val, uint16_t base)
+{
+    int16_t diff = (int16_t)(uint16_t)(val - base);
+    return ((uint32_t) diff << 1) ^ (uint32_t)(diff >> 15);
+}
+
+int protocolPackHeader(uint8_t *buf, const struct protocolHeader *header)
+{
+    buf[0] = PACKET_MAGIC >> 8;
+    buf[1] = PACKET_MAGIC & 0xff;
+    buf[2] = header->version >> 8;
+    buf[3] = header->version & 0xff;
+    buf[4] = header->sequence >> 24;
+    buf[5] = header->sequence >> 16;
+    buf[6] = header->sequence >> 8;
+    buf[7] = header->sequence;
+    buf[8] = header->type;
+
+    return PROTOCOL_HEADER_SIZE;
+}
+
+int protocolUnpackHeader(const uint8_t *buf,
+                         size_t len,
+                         struct protocolHeader *header)
+{
+    if (len < PROTOCOL_HEADER_SIZE || buf[0] != PACKET_MAGIC >> 8 ||
+        buf[1] != (PACKET_MAGIC & 0xff)) {
+        return -1;
+    }
+
+    header->version  = buf[2] << 8 | buf[3];
+    header->sequence = (uint32_t) buf[4] << 24 | (uint32_t) buf[5] << 16 |
+                       (uint32_t) buf[6] << 8 | buf[7];
+    header->type     = buf[8];
+
+    return PROTOCOL_HEADER_SIZE;
+}
+
+int protocolEncodeState(uint8_t *buf,
+                        const struct hidInfo *hid,
+                        const struct hidInfo *base,
+                        unsigned sensors,
+                        const struct protocolEdge *edges,
+                        unsigned count,
+                        uint32_t sequence)
+{
+    uint16_t bitmap = 0;
+    uint8_t *bufptr = buf + sizeof(bitmap);
+    unsigned field  = 0;
+
+/* Fields are numbered in wire order; the server expects exactly this one */
+#define ENCODE(cond, val)                                                      \
+    do {                                                                       \
+        if (cond) {                                                            \
+            bitmap |= 1 << field;                                              \
+            bufptr = putVarint(bufptr, (val));                                 \
+        }                                                                      \
+        field++;                                                               \
+    } while (0)
+
+#define ENCODE_AXIS(sensor, member)                                            \
+    ENCODE((sensors & (sensor)) && hid->member != base->member,              \
+           zigzag(hid->member, base->member))
+
+    ENCODE(hid->keys.up != 0, hid->keys.up);
+    ENCODE(hid->keys.down != 0, hid->keys.down);
+    ENCODE(hid->keys.held != base->keys.held,
+           hid->keys.held ^ base->keys.held);
+
+    ENCODE_AXIS(PROTOCOL_SENSOR_TOUCHSCREEN, touchscreen.px);
+    ENCODE_AXIS(PROTOCOL_SENSOR_TOUCHSCREEN, touchscreen.py);
+    ENCODE_AXIS(PROTOCOL_SENSOR_CIRCLEPAD, circlepad.dx);
+    ENCODE_AXIS(PROTOCOL_SENSOR_CIRCLEPAD, circlepad.dy);
+    ENCODE_AXIS(PROTOCOL_SENSOR_CSTICK, cstick.dx);
+    ENCODE_AXIS(PROTOCOL_SENSOR_CSTICK, cstick.dy);
+    ENCODE_AXIS(PROTOCOL_SENSOR_GYROSCOPE, gyro.x);
+    ENCODE_AXIS(PROTOCOL_SENSOR_GYROSCOPE, gyro.y);
+    ENCODE_AXIS(PROTOCOL_SENSOR_GYROSCOPE, gyro.z);
+    ENCODE_AXIS(PROTOCOL_SENSOR_ACCELEROMETER, accel.x);
+    ENCODE_AXIS(PROTOCOL_SENSOR_ACCELEROMETER, accel.y);
+    ENCODE_AXIS(PROTOCOL_SENSOR_ACCELEROMETER, accel.z);
+
+#undef ENCODE_AXIS
+#undef ENCODE
+
+    if (count > PROTOCOL_EDGE_RECORDS_MAX) {
+        edges += count - PROTOCOL_EDGE_RECORDS_MAX;
+        count = PROTOCOL_EDGE_RECORDS_MAX;
+    }
+
+    // Skip records that are too old to express as a distance
+    while (count > 0 && sequence - edges->sequence > 0xff) {
+        edges++;
+        count--;
+    }
+
+    if (count > 0) {
+        bitmap |= PROTOCOL_EDGE_RECORDS;
+        *bufptr++ = count;
+        for (unsigned i = 0; i < count; i++) {
+            *bufptr++ = sequence - edges[i].sequence;
+            bufptr    = putVarint(bufptr, edges[i].down);
+            bufptr    = putVarint(bufptr, edges[i].up);
+        }
+    }
+
+    buf[0] = bitmap >> 8;
+    buf[1] = bitmap & 0xff;
+
+    return bufptr - buf;
+}
@@ -7,7 +7,11 @@
 
 #include <stddef.h>
 
+#include <sys/socket.h>
+
+#include "devices.h"
 #include "hid.h"
+#include "protocol.h"
 
 #define _STRINGIFY(a) #a
 #define STRINGIFY(a) _STRINGIFY(a)
@@ -40,24 +44,222 @@
 #define CTROLLER_VERSION MAKEBCDVER(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH)
 
 #define PACKET_MAGIC 0x3d5c
-#define PACKET_SIZE (2 * sizeof(uint16_t) + sizeof(struct hidinfo))
+
+/** The top nibble of the version field is the protocol revision; the lower
+ * twelve bits are the client version in BCD, as built by MAKEBCDVER().
+ *
+ * Revision 0: magic, version, packed hidinfo fields
+ * Revision 1: magic, version, sequence number, packed hidinfo fields
+ * Revision 2: variable length, delta encoded; see protocol.h
+ **/
+#define PACKET_REVISION(version) (((version) >> 12) & 0xf)
+#define PACKET_VERSION_BCD(version) ((version) & 0x0fff)
+
+/** Number of bytes a client puts on the wire for each revision
+ **/
+#define PACKET_REV0_SIZE 40
+#define PACKET_REV1_SIZE (PACKET_REV0_SIZE + sizeof(uint32_t))
+
+/** Size of the receive buffers, large enough for a packet of any revision
+ **/
+#define PACKET_SIZE PACKET_REV2_SIZE_MAX
+
+/** Version field of the packets the server sends back to revision 2 clients
+ **/
+#define CTROLLER_PACKET_VERSION (2 << 12 | CTROLLER_VERSION)
+
+/** Number of packets ctroller_poll_hid_batch() drains per receive call, and
+ * ctroller_poll_hid_uring() per pass over the completions
+ **/
+#define CTROLLER_BATCH_SIZE 32
+
+/** Time without packets after which a 3DS counts as gone, and its buttons and
+ * sticks are released; see ctroller_set_idle_teardown() for its devices
+ **/
+#define CTROLLER_IDLE_TIMEOUT_MS 500
+
+/** Longest a change of the analog values is spread over with upsampling,
+ * should a packet come late
+ **/
+#define CTROLLER_UPSAMPLE_SPAN_MAX_MS 50
+
+/** Highest output rate ctroller_set_output_rate() accepts
+ **/
+#define CTROLLER_OUTPUT_RATE_MAX 1000
+
+/** How long a socket with CTROLLER_BUSY_POLL spins on the device queue
+ **/
+#define CTROLLER_BUSY_POLL_US 50
+
+/** Number of log2 buckets of the latency histogram; bucket i counts latencies
+ * below 2^i microseconds that did not fit into bucket i - 1
+ **/
+#define CTROLLER_LATENCY_BUCKETS 24
 
 #define UINPUT_DEFAULT_DEVICE "/dev/uinput"
 #define PORT_DEFAULT "15708"
 
 typedef unsigned char packet_hid_t[PACKET_SIZE];
-typedef unsigned device_mask_t;
 
-int ctroller_init(const char *uinput_device, const char *port, device_mask_t device_mask);
-int ctroller_listener_init(const char *port);
+struct ctroller_stats {
+    unsigned long packets;
+    /// Calls to recvmsg() or recvmmsg(); the io_uring receiver makes none,
+    /// and counts the times it woke up to new completions instead
+    unsigned long recv_calls;
+    unsigned long coalesced;
+    unsigned long malformed;
+    unsigned long late;
+    unsigned long duplicate;
+    unsigned long unresolved;
+    unsigned long recovered;
+    unsigned long released;
+    unsigned long removed;
+    unsigned long interpolated;
+    unsigned long latency[CTROLLER_LATENCY_BUCKETS];
+};
+
+/* Counters of the calling thread */
+extern __thread struct ctroller_stats ctroller_stats;
+
+/** Flags for ctroller_init() and ctroller_listener_init()
+ **/
+enum {
+    /// Bind with SO_REUSEPORT, so that every worker thread can open its own
+    /// socket on the same port
+    CTROLLER_REUSEPORT = BIT(0),
+    /// Busy-poll the device queue for CTROLLER_BUSY_POLL_US before sleeping
+    CTROLLER_BUSY_POLL = BIT(1),
+    /// Have the kernel timestamp packets and record how long they took from
+    /// arrival until their state was written to the devices
+    CTROLLER_LATENCY = BIT(2),
+};
+
+/** Set up listener and devices for the calling thread
+ **/
+int ctroller_init(const char *uinput_device,
+                  const char *port,
+                  device_mask_t device_mask,
+                  unsigned flags);
+int ctroller_listener_init(const char *port, unsigned flags);
 int ctroller_uinput_init(const char *uinput_device, device_mask_t device_mask);
 
 void ctroller_exit(void);
+void ctroller_print_stats(void);
+
+/** Make the poll functions of every thread return CTROLLER_POLL_EXIT once fd
+ * becomes readable
+ *
+ * Meant for a signalfd shared by all workers; it is watched, but never read.
+ * Must be called before ctroller_init().
+ **/
+void ctroller_set_signal_fd(int fd);
+
+/** Remove the devices of a 3DS this many seconds after its inputs were
+ * released; they are created again once it sends a new state. 0, the default,
+ * keeps them until the server exits.
+ *
+ * Must be called before ctroller_init().
+ **/
+void ctroller_set_idle_teardown(unsigned seconds);
+
+/** Write the circle pad, C-stick and touch position this many times per
+ * second, interpolated between the packets of a 3DS, which only sends one
+ * per frame. Key edges and the motion sensors are written as they arrive;
+ * the interpolated values trail them by up to a packet interval. 0, the
+ * default, writes every state as it is.
+ *
+ * Must be called before ctroller_init().
+ **/
+void ctroller_set_output_rate(unsigned hz);
+
+/** Extrapolate the circle pad, C-stick and gyroscope this many ms ahead of
+ * the packets of a 3DS, to make up for the time they spend on the way, and
+ * keep extrapolating for a while when they stop coming; see predict.h. 0,
+ * the default, writes the values as they arrive.
+ *
+ * Must be called before ctroller_init().
+ **/
+void ctroller_set_prediction(unsigned ms);
+
+/** Keep this many sets of devices around for each thread, created up front,
+ * so that a 3DS connecting gets its devices without waiting for uinput and
+ * udev; a 3DS that leaves hands its set back after releasing everything it
+ * held. 0, the default, creates devices as they are needed.
+ *
+ * Must be called before ctroller_init().
+ **/
+void ctroller_set_pool(unsigned size);
+
+/** Take over the sockets passed by a service manager (LISTEN_PID and
+ * LISTEN_FDS, as in systemd socket activation); ctroller_listener_init() then
+ * uses one of them per thread instead of binding its own
+ *
+ * Must be called once, before any thread calls ctroller_init().
+ *
+ * @returns number of passed sockets, 0 if there are none
+ * @returns < 0 if one of them is not a datagram socket
+ **/
+int ctroller_listen_fds(void);
+
+/** Fault in every buffer the receive loop and the device writes of the
+ * calling thread use, so that none of them page faults on the first packet
+ * after mlockall()
+ **/
+void ctroller_prefault(void);
+
+int ctroller_recv(void *buf,
+                  size_t len,
+                  struct sockaddr *from,
+                  socklen_t *from_len);
+
+/** Wait for packets and write them to the devices of their sender's session
+ *
+ * @returns number of packets consumed from the socket
+ * @returns 0 if only idle sessions were handled
+ * @returns CTROLLER_POLL_EXIT if the signal fd became readable
+ * @returns < 0 on error
+ **/
+typedef int ctroller_call_poll(void);
+
+#define CTROLLER_POLL_EXIT (-2)
+
+int ctroller_poll_hid_info(void);
+
+/** Drain all pending packets with a single recvmmsg() call
+ *
+ * Packets carrying key edges are written to the devices right away; analog
+ * state of the remaining packets of a session is coalesced into its newest
+ * one.
+ **/
+int ctroller_poll_hid_batch(void);
+
+/** Set up the io_uring receiver used by ctroller_poll_hid_uring()
+ *
+ * @returns 0 on success
+ * @returns < 0 if io_uring, multishot receive or provided buffer rings are
+ *          not supported by the running kernel
+ **/
+int ctroller_uring_init(void);
+void ctroller_uring_exit(void);
 
-int ctroller_recv(void *buf, size_t len);
+/** Same as ctroller_poll_hid_batch(), but reaps packets from an io_uring
+ * multishot receive instead of calling recvmmsg()
+ **/
+int ctroller_poll_hid_uring(void);
 
-int ctroller_poll_hid_info(struct hidinfo *);
-int ctroller_unpack_hid_info(unsigned char *sendbuf, struct hidinfo *hid);
-int ctroller_write_hid_info(struct hidinfo *hid);
+/** Write device events of the calling thread through io_uring: the writes to
+ * all devices of a session are submitted with a single io_uring_enter(), and
+ * their completions are reaped along with later submissions
+ *
+ * @returns 0 on success
+ * @returns < 0 if io_uring is not supported by the running kernel
+ **/
+int ctroller_output_uring_init(void);
+void ctroller_output_uring_exit(void);
+int ctroller_unpack_hid_info(unsigned char *sendbuf,
+                             size_t len,
+                             struct hidinfo *hid);
+struct session;
+int ctroller_write_hid_info(struct session *session);
 
 #endif /* ----- #ifndef CTROLLER_H  ----- */
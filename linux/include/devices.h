@@ -5,13 +5,20 @@
 #include <devices/touchscreen.h>
 #include <devices/gyroscope.h>
 #include <devices/accelerometer.h>
+#include <devices/orientation.h>
+#include <devices/composite.h>
+#include <devices/uhid.h>
 
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
+#include <linux/input.h>
+
 #define arrsize(a) (sizeof(a) / sizeof(a[0]))
 
+typedef unsigned device_mask_t;
+
 int device_open(const char *uinput_device);
 
 ssize_t
@@ -24,29 +31,174 @@ ssize_t device_register_absaxis(const int uinputfd,
 struct uinput_user_dev;
 int device_create(int uinputfd, const struct uinput_user_dev *dev);
 
-typedef int device_call_create(const char *uinput_device);
+struct device_context;
+typedef int device_call_create(struct device_context *dev,
+                               const char *uinput_device);
 
 struct hidinfo;
-typedef int device_call_write(int uinputfd, struct hidinfo *hid);
+typedef int device_call_write(struct device_context *dev, struct hidinfo *hid);
+
+enum DEVICE_ID {
+    DEVICE_GAMEPAD,
+    DEVICE_TOUCHSCREEN,
+    DEVICE_GYROSCOPE,
+    DEVICE_ACCELEROMETER,
+    DEVICE_ORIENTATION,
+};
 
+#define DEVICES_COUNT 5
+
+/* Upper bound of events a single device write emits, SYN_REPORT included */
+#define DEVICE_EVENTS_MAX 64
+
+/* The device_* definitions below are templates; every session copies them
+ * into its own device set, so that each set owns its event buffer.
+ *
+ * Each event a device can emit has a fixed slot. The value last written to a
+ * slot is kept as a shadow copy; device_emit() drops events that would not
+ * change it, and device_flush() skips the write altogether if none are left.
+ * A fresh copy of a template has no valid slots, so the first write of a
+ * device reports every value.
+ */
 struct device_context {
     int fd;
     device_call_write *write;
     device_call_create *create;
+    struct input_event events[DEVICE_EVENTS_MAX];
+    size_t count;
+
+    int32_t shadow[DEVICE_EVENTS_MAX];
+    uint64_t shadow_valid;
+
+    /* Parts a composite device writes, see device_part */
+    device_mask_t parts;
+
+    /* The gamepad layout a device registered its events for, and the one it
+     * reports since the last keymap reload; see gamepad_refresh()
+     */
+    const struct gamepad_layout *layout;
+    const struct gamepad_layout *reported;
+
+    /* Where the device was created, to create it again */
+    const char *uinput_device;
+
+    /* CLOCK_MONOTONIC time in ns until which each motion sensor the device
+     * provides is over its rate; see motion_filter()
+     */
+    uint64_t motion_deadline[DEVICES_COUNT];
+};
+
+/* Counters of the calling thread */
+struct device_stats {
+    unsigned long events;         // events written, SYN_REPORT included
+    unsigned long events_skipped; // events that would not have changed a value
+    unsigned long writes_skipped; // writes of devices with nothing to report
+    unsigned long write_errors;   // failed writes, e.g. EAGAIN
+    unsigned long short_writes;   // writes that only got part of the events in
+    unsigned long split_writes;   // writes cut in two for lack of buffer room
+    unsigned long reports;        // HID reports written, see device_uhid
 };
 
-extern struct device_context device_gamepad;
-extern struct device_context device_touchscreen;
-extern struct device_context device_gyroscope;
-extern struct device_context device_accelerometer;
+extern __thread struct device_stats device_stats;
 
-enum DEVICE_ID {
-    DEVICE_GAMEPAD,
-    DEVICE_TOUCHSCREEN,
-    DEVICE_GYROSCOPE,
-    DEVICE_ACCELEROMETER,
+/** Queue an event for the next device_flush(), unless the value in its slot
+ * is already current
+ **/
+void device_emit(struct device_context *dev,
+                 unsigned slot,
+                 uint16_t type,
+                 uint16_t code,
+                 int32_t value);
+
+/** Queue an event regardless of the shadow copy, e.g. to release a key that
+ * no slot reports any more
+ *
+ * Once the buffer is full, the events queued so far are written right away,
+ * followed by a SYN_REPORT of their own.
+ **/
+void device_queue(struct device_context *dev,
+                  uint16_t type,
+                  uint16_t code,
+                  int32_t value);
+
+/** Write the queued events followed by a SYN_REPORT, or nothing if there are
+ * none
+ *
+ * @returns bytes written, 0 if there was nothing to write, or < 0 on error,
+ *          in which case the shadow copy is discarded
+ **/
+ssize_t device_flush(struct device_context *dev, const char *errmsg);
+
+/** Destroy the device and close its file descriptor, if it has one
+ **/
+void device_destroy(struct device_context *dev);
+
+/** Destroy the device and create it anew, e.g. for events it does not have
+ *
+ * @returns the new file descriptor, or < 0 on error
+ **/
+int device_recreate(struct device_context *dev);
+
+/** Hands the events queued on a device, SYN_REPORT included, to the kernel
+ *
+ * Replaces the write() in device_flush(). The events must be copied, as the
+ * buffer is reused right away; errors reported later should discard the
+ * shadow copy of the device.
+ *
+ * @returns bytes accepted, or < 0 on error
+ **/
+typedef ssize_t device_call_submit(struct device_context *dev,
+                                   const char *errmsg);
+
+/** Route the device writes of the calling thread through submit, or back to
+ * write() if NULL
+ **/
+void device_set_submit(device_call_submit *submit);
+
+extern const struct device_context device_gamepad;
+extern const struct device_context device_touchscreen;
+extern const struct device_context device_gyroscope;
+extern const struct device_context device_accelerometer;
+extern const struct device_context device_orientation;
+extern const struct device_context device_composite;
+extern const struct device_context device_uhid;
+
+/** Emit the events of a device into the slots starting at slot
+ *
+ * @param axis Codes to report the device's axes under, in the order of
+ *             device_part.axis
+ *
+ * @returns the slot following the last one the device uses
+ **/
+typedef unsigned device_call_emit(struct device_context *dev,
+                                  unsigned slot,
+                                  const uint16_t *axis,
+                                  const struct hidinfo *hid);
+
+/* What a device reports and how, so that the composite device can provide
+ * several devices at once. `ranges` describes the axes under their own codes.
+ */
+struct device_part {
+    const uint16_t *keys;
+    size_t keys_count;
+    const uint16_t *axis;
+    size_t axis_count;
+    const struct uinput_user_dev *ranges;
+    device_call_emit *emit;
 };
 
-#define DEVICES_COUNT 4
+extern const struct device_part device_touchscreen_part;
+extern const struct device_part device_gyroscope_part;
+extern const struct device_part device_accelerometer_part;
+extern const struct device_part device_orientation_part;
+
+/* Set in a device mask to provide the selected devices through a single
+ * composite device instead of one device each
+ */
+#define DEVICE_MASK_COMPOSITE (1u << 31)
+
+/* Set in a device mask to provide the gamepad through uhid instead of uinput */
+#define DEVICE_MASK_UHID (1u << 30)
+#define DEVICE_MASK_ALL ((1u << DEVICES_COUNT) - 1)
 
 #endif /* ----- #ifndef DEVICES_H  ----- */
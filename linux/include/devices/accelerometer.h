@@ -1,9 +1,10 @@
 #ifndef ACCELEROMETER_H
 #define ACCELEROMETER_H
 
-int accelerometer_create(const char *uinput_device);
-
 struct hidinfo;
-int accelerometer_write(int uinputfd, struct hidinfo *hid);
+struct device_context;
+
+int accelerometer_create(struct device_context *dev, const char *uinput_device);
+int accelerometer_write(struct device_context *dev, struct hidinfo *hid);
 
 #endif /* ----- #ifndef ACCELEROMETER_H  ----- */
@@ -0,0 +1,13 @@
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+struct hidinfo;
+struct device_context;
+
+/** Create a single device exposing the keys and axes of every device in
+ * dev->parts
+ **/
+int composite_create(struct device_context *dev, const char *uinput_device);
+int composite_write(struct device_context *dev, struct hidinfo *hid);
+
+#endif /* ----- #ifndef COMPOSITE_H  ----- */
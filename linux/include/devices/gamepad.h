@@ -1,9 +1,43 @@
 #ifndef GAMEPAD_H
 #define GAMEPAD_H
 
-int gamepad_create(const char *uinput_device);
-
 struct hidinfo;
-int gamepad_write(int uinputfd, struct hidinfo *hid);
+struct device_context;
+struct device_part;
+struct keymap;
+
+int gamepad_create(struct device_context *dev, const char *uinput_device);
+int gamepad_write(struct device_context *dev, struct hidinfo *hid);
+
+/** Make gamepads report a keymap
+ *
+ * Safe to call while other threads write gamepads: each one switches over on
+ * its next write. The gamepad takes ownership of map, and keeps the maps it
+ * replaces until gamepad_free_keymaps(), as those may still be in use.
+ *
+ * @returns 0, or < 0 if out of memory, in which case map stays with the caller
+ **/
+int gamepad_set_keymap(struct keymap *map);
+
+/** Free every keymap given to gamepad_set_keymap(), once no gamepad is left
+ **/
+void gamepad_free_keymaps(void);
+
+/** The keymap gamepads report, as of the last reload
+ **/
+const struct keymap *gamepad_keymap(void);
+
+/** The keys and axes dev registers as a gamepad. A device that has none yet,
+ * e.g. one being created, takes those of the current keymap.
+ **/
+const struct device_part *gamepad_part(struct device_context *dev);
+
+/** Switch dev over to the current keymap if it was reloaded, releasing the
+ * events the new one does not report
+ *
+ * @returns 0, or 1 if dev lacks events the keymap needs and has to be
+ *          recreated
+ **/
+int gamepad_refresh(struct device_context *dev);
 
 #endif /* ----- #ifndef GAMEPAD_H  ----- */
@@ -1,9 +1,10 @@
 #ifndef GYROSCOPE_H
 #define GYROSCOPE_H
 
-int gyroscope_create(const char *uinput_device);
-
 struct hidinfo;
-int gyroscope_write(int uinputfd, struct hidinfo *hid);
+struct device_context;
+
+int gyroscope_create(struct device_context *dev, const char *uinput_device);
+int gyroscope_write(struct device_context *dev, struct hidinfo *hid);
 
 #endif /* ----- #ifndef GYROSCOPE_H  ----- */
@@ -0,0 +1,10 @@
+#ifndef ORIENTATION_H
+#define ORIENTATION_H
+
+struct hidinfo;
+struct device_context;
+
+int orientation_create(struct device_context *dev, const char *uinput_device);
+int orientation_write(struct device_context *dev, struct hidinfo *hid);
+
+#endif /* ----- #ifndef ORIENTATION_H  ----- */
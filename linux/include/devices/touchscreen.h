@@ -1,9 +1,10 @@
 #ifndef TOUCHSCREEN_H
 #define TOUCHSCREEN_H
 
-int touchscreen_create(const char* uinput_device);
-
 struct hidinfo;
-int touchscreen_write(int uinputfd, struct hidinfo *hid);
+struct device_context;
+
+int touchscreen_create(struct device_context *dev, const char *uinput_device);
+int touchscreen_write(struct device_context *dev, struct hidinfo *hid);
 
 #endif /* ----- #ifndef TOUCHSCREEN_H  ----- */
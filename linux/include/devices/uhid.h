@@ -0,0 +1,17 @@
+#ifndef UHID_H
+#define UHID_H
+
+#define UHID_DEFAULT_DEVICE "/dev/uhid"
+
+struct hidinfo;
+struct device_context;
+
+/** Create the gamepad as a HID device through /dev/uhid instead of uinput
+ *
+ * The device has 15 buttons, a hat switch and the two sticks, and reports a
+ * whole state as a single 11 byte input report.
+ **/
+int uhid_create(struct device_context *dev, const char *uinput_device);
+int uhid_write(struct device_context *dev, struct hidinfo *hid);
+
+#endif /* ----- #ifndef UHID_H  ----- */
@@ -0,0 +1,56 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <stdint.h>
+
+#include "hid.h"
+
+/** Fuses the gyroscope and accelerometer into the orientation of the 3DS
+ *
+ * Each packet steps a Madgwick filter (Madgwick et al., ICORR 2011): the
+ * gyroscope is integrated into a quaternion, and the accelerometer pulls it
+ * towards the tilt at which gravity points the way it measures, by
+ * fusion_beta rad/s at most along the gradient of the difference. That
+ * takes out the drift of the gyroscope in roll and pitch; yaw has no such
+ * reference and starts at 0 with every session.
+ *
+ * Both sensors are taken to share the frame of the gyroscope, with the
+ * accelerometer measuring the reaction to gravity. The angles are those of
+ * that frame, roll about x, then pitch about y, then yaw about z, and are
+ * zero while the accelerometer points straight along z.
+ *
+ * Like predict_update(), the filter steps on the clock of the client: the
+ * time between two packets is taken from their sequence numbers.
+ **/
+
+/* Raw gyroscope units per degree per second */
+#define FUSION_GYRO_SCALE 14.375f
+
+/* Default gain of the accelerometer, in rad/s */
+#define FUSION_BETA_DEFAULT 0.1
+
+/* Highest gain that still leaves the gyroscope something to do */
+#define FUSION_BETA_MAX 10
+
+/* Range of the reported angles, in hundredths of a degree */
+#define FUSION_ANGLE_MAX 18000
+
+/* Only set before any packet is fused */
+extern double fusion_beta;
+
+struct fusion {
+    float q[4]; // w, x, y, z
+    /* CLOCK_MONOTONIC time in ns the last packet arrived at, 0 if none yet */
+    uint64_t last;
+    uint32_t sequence;
+};
+
+/** Feed the motion sensors of a packet received at now into the filter and
+ * set the orientation of hid
+ *
+ * A sequence number going backwards starts over from the tilt the
+ * accelerometer measures.
+ **/
+void fusion_update(struct fusion *fusion, struct hidinfo *hid, uint64_t now);
+
+#endif /* ----- #ifndef FUSION_H  ----- */
@@ -65,8 +65,18 @@ struct accelrate {
     int16_t z;
 };
 
+/// In hundredths of a degree
+struct orientation {
+    int16_t roll;
+    int16_t pitch;
+    int16_t yaw;
+};
+
 struct hidinfo {
     uint16_t version;
+    uint32_t sequence;
+    /// CLOCK_REALTIME time in ns at which the kernel received the packet, or 0
+    uint64_t timestamp;
     struct {
         uint32_t up;
         uint32_t down;
@@ -77,6 +87,8 @@ struct hidinfo {
     struct touchpos touchscreen;
     struct gyrorate gyro;
     struct accelrate accel;
+    /// Fused from gyro and accel by the server, see fusion_update()
+    struct orientation orientation;
 };
 
 #endif /* ----- #ifndef HID_H  ----- */
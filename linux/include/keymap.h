@@ -0,0 +1,182 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include <linux/input.h>
+
+/** Keymap files
+ *
+ * A keymap is a list of rules, one per line, mapping 3DS inputs to events of
+ * the gamepad device:
+ *
+ *   A = BTN_SOUTH            a button
+ *   L+R = KEY_ESC            a chord: all inputs have to be held
+ *   DLEFT = ABS_HAT0X:-1     an axis, and the value it takes while held
+ *
+ * Inputs are named after the 3DS keys (A, DUP, CSTICK_LEFT, CPAD_UP, TOUCH,
+ * ...), outputs after their evdev codes. `#` starts a comment.
+ *
+ * `layer <n> = <input>` selects layer n, 1 to 3, while the input is held, and
+ * the rules following a `[layer <n>]` line only apply while it is selected.
+ * A layer inherits every rule of the base layer whose inputs it does not map
+ * itself; if several layers are selected, the highest one wins.
+ *
+ * While a chord is held, rules whose inputs are a part of it are suppressed.
+ * If several rules drive the same axis, the first one in the file wins.
+ *
+ * Files with a bare button label on each line instead of rules are read as
+ * the keymaps of earlier versions.
+ **/
+
+#define KEYMAP_LAYERS_MAX 4
+#define KEYMAP_OUTPUTS_MAX 64
+#define KEYMAP_CHANNELS_MAX 48
+#define KEYMAP_CHORD_KEYS_MAX 10
+#define KEYMAP_RULES_MAX 256
+#define KEYMAP_DIRECT_BITS 4
+#define KEYMAP_DIRECT_MASK ((1u << KEYMAP_DIRECT_BITS) - 1)
+
+/* Gathers the bits of mask from a key mask into a dense index: bit j of the
+ * index is the j-th lowest bit of mask. With BMI2 a single PEXT, otherwise a
+ * lookup per byte of the key mask.
+ */
+struct keymap_gather {
+    uint32_t mask;
+#ifndef __BMI2__
+    uint16_t table[sizeof(uint32_t)][256];
+#endif
+};
+
+/* An event of the gamepad device, the outputs driving it and the keys of the
+ * base layer that do
+ */
+struct keymap_channel {
+    uint16_t type;
+    uint16_t code;
+    int32_t min;
+    int32_t max;
+    uint64_t outputs;
+    uint32_t keys;
+};
+
+/* An event of a direct keymap looked up by the window of KEYMAP_DIRECT_BITS
+ * of the key mask its keys are in, starting at shift: values holds its value
+ * for every state of the window
+ */
+struct keymap_lookup {
+    uint16_t type;
+    uint16_t code;
+    uint8_t shift;
+    int16_t values[1 << KEYMAP_DIRECT_BITS];
+};
+
+/* The rules of a layer. Each output is a bit of a uint64_t; single keys are
+ * looked up per byte of the key mask, chords by the gathered chord keys.
+ */
+struct keymap_layer {
+    uint64_t single[sizeof(uint32_t)][256];
+    struct keymap_gather chord_keys;
+    struct {
+        uint64_t on;
+        uint64_t off;
+    } chords[1 << KEYMAP_CHORD_KEYS_MAX];
+};
+
+/* A keymap without layers or chords, whose events each take their keys from
+ * a window of the key mask, is direct: its events are looked up rather than
+ * evaluated. Buttons pressed by a single key are tested for it, like the key
+ * table of earlier versions did, and come first; the other events follow.
+ */
+struct keymap {
+    struct keymap_gather layer_keys;
+    uint8_t layer_of[1 << (KEYMAP_LAYERS_MAX - 1)];
+    struct keymap_layer layers[KEYMAP_LAYERS_MAX];
+
+    int32_t values[KEYMAP_OUTPUTS_MAX];
+    unsigned channel_count;
+    struct keymap_channel channels[KEYMAP_CHANNELS_MAX];
+
+    int direct;
+    unsigned direct_buttons;
+    uint16_t direct_codes[KEYMAP_CHANNELS_MAX];
+    uint32_t direct_keys[KEYMAP_CHANNELS_MAX];
+    unsigned direct_lookup_count;
+    struct keymap_lookup direct_lookups[KEYMAP_CHANNELS_MAX];
+};
+
+/** Load and compile a keymap file
+ *
+ * @returns the keymap, to be released with keymap_free(), or NULL if the
+ *          file could not be read or has errors, which are printed
+ **/
+struct keymap *keymap_load(const char *path);
+
+/** The key mask of a 3DS input, as named in keymap files
+ *
+ * @returns 0 if there is no input of that name
+ **/
+uint32_t keymap_parse_input(const char *name);
+
+/** Compile the built-in keymap
+ **/
+struct keymap *keymap_default(void);
+
+void keymap_free(struct keymap *map);
+
+void keymap_gather_init(struct keymap_gather *gather, uint32_t mask);
+
+static inline uint32_t keymap_gather(const struct keymap_gather *gather,
+                                     uint32_t keys)
+{
+#ifdef __BMI2__
+    return _pext_u32(keys, gather->mask);
+#else
+    return gather->table[0][keys & 0xff] |
+           gather->table[1][(keys >> 8) & 0xff] |
+           gather->table[2][(keys >> 16) & 0xff] |
+           gather->table[3][keys >> 24];
+#endif
+}
+
+/** The outputs active for the pressed 3DS keys
+ *
+ * Costs the same handful of lookups however many rules the keymap has.
+ **/
+static inline uint64_t keymap_eval(const struct keymap *map, uint32_t keys)
+{
+    const struct keymap_layer *layer =
+        &map->layers[map->layer_of[keymap_gather(&map->layer_keys, keys)]];
+
+    uint64_t single = layer->single[0][keys & 0xff] |
+                      layer->single[1][(keys >> 8) & 0xff] |
+                      layer->single[2][(keys >> 16) & 0xff] |
+                      layer->single[3][keys >> 24];
+
+    uint32_t chord = keymap_gather(&layer->chord_keys, keys);
+    return (single & ~layer->chords[chord].off) | layer->chords[chord].on;
+}
+
+/** The value of a channel given the active outputs
+ **/
+static inline int32_t keymap_value(const struct keymap *map,
+                                   const struct keymap_channel *channel,
+                                   uint64_t active)
+{
+    uint64_t outputs = active & channel->outputs;
+    if (channel->type == EV_KEY) {
+        return outputs != 0;
+    }
+
+    // Without a branch to mispredict: the top output stands in for none, and
+    // its value is masked off
+    return map->values[__builtin_ctzll(outputs | 1ull << 63)] &
+           -(int32_t) (outputs != 0);
+}
+
+#endif /* ----- #ifndef KEYMAP_H  ----- */
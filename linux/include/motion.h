@@ -0,0 +1,105 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+
+#include "devices.h"
+#include "hid.h"
+
+/** Filters the axes of the motion sensors go through before they are queued,
+ * so that consumers that do not use motion are not flooded with sensor noise
+ *
+ * gate:      3DS keys that have to be held for the sensor to report; without
+ *            them it rests at zero
+ * threshold: hysteresis per axis; a value is only reported once it moved at
+ *            least this far from the one last reported
+ * rate:      most reports per second of each sensor
+ * cutoff:    cutoff frequency in Hz per axis of the One Euro filter at rest,
+ *            see motion_smooth()
+ * beta:      how much that cutoff rises per unit/s the axis moves
+ *
+ * Zero disables a filter; by default all of them are.
+ **/
+struct motion_config {
+    uint32_t gate;
+    int32_t threshold[3];
+    unsigned rate;
+    double cutoff[3];
+    double beta[3];
+};
+
+/* Indexed by DEVICE_ID; only set before any device is written */
+extern struct motion_config motion_config[DEVICES_COUNT];
+
+/* Events of the calling thread each filter kept from being written */
+struct motion_stats {
+    unsigned long gated;
+    unsigned long hysteresis;
+    unsigned long rate;
+};
+
+extern __thread struct motion_stats motion_stats;
+
+/* The axes of the gyroscope and then of the accelerometer, padded to the
+ * width of a vector
+ */
+#define MOTION_LANES 8
+
+/* Fixed point fractional bits of the filtered values and their speeds */
+#define MOTION_VALUE_SHIFT 4
+#define MOTION_SPEED_SHIFT 3
+
+/* Fractional bits of the smoothing factors */
+#define MOTION_ALPHA_SHIFT 10
+
+/* Cutoff frequency of the speed estimate, as in the paper */
+#define MOTION_SPEED_CUTOFF 1.0
+
+/* Highest cutoff and beta motion_config may ask for, to keep the fixed
+ * point from overflowing
+ */
+#define MOTION_CUTOFF_MAX 1000
+#define MOTION_BETA_MAX 100
+
+typedef int32_t motion_lanes
+    __attribute__((vector_size(MOTION_LANES * sizeof(int32_t))));
+
+/* One Euro filter state of a session */
+struct motion_smooth {
+    motion_lanes value; // in 1/(1 << MOTION_VALUE_SHIFT)
+    motion_lanes speed; // per packet, in 1/(1 << MOTION_SPEED_SHIFT)
+    uint32_t sequence;
+    int valid;
+};
+
+/** Compile the cutoffs and betas of motion_config for motion_smooth()
+ *
+ * @returns whether any axis is to be smoothed
+ **/
+int motion_smooth_init(void);
+
+/** Smooth the gyroscope and accelerometer of a packet in place
+ *
+ * Each axis goes through a One Euro filter (Casiez et al., CHI 2012): a
+ * low-pass filter whose cutoff rises with the speed of the axis, so that it
+ * holds still at rest and follows fast motion without lag. All six axes are
+ * filtered at once, in fixed point. Time is counted in packets, one per
+ * frame of the 3DS, by their sequence numbers.
+ **/
+void motion_smooth(struct motion_smooth *smooth, struct hidinfo *hid);
+
+/** Filter the three axes of a motion sensor in place
+ *
+ * @param id     DEVICE_GYROSCOPE, DEVICE_ACCELEROMETER or DEVICE_ORIENTATION
+ * @param slot   Slot of the first axis
+ * @param values Values of the axes, replaced by the ones to report
+ *
+ * @returns 0 if the sensor should not report anything this time
+ **/
+int motion_filter(struct device_context *dev,
+                  enum DEVICE_ID id,
+                  unsigned slot,
+                  const struct hidinfo *hid,
+                  int32_t values[3]);
+
+#endif /* ----- #ifndef MOTION_H  ----- */
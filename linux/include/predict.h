@@ -0,0 +1,85 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stdint.h>
+
+#include "hid.h"
+
+/** Predicts the circle pad, C-stick and gyroscope a little ahead, to make up
+ * for the time their packets spent on the way, and through short gaps in
+ * the packets.
+ *
+ * Each axis runs an alpha-beta filter, the steady state of a constant
+ * velocity Kalman filter: every packet corrects the estimated position by
+ * PREDICT_ALPHA and the velocity by PREDICT_BETA of the difference to the
+ * extrapolated one. All of it is in fixed point: positions in Q16 units,
+ * velocities in Q16 units per ms.
+ *
+ * The filters step on the clock of the client, which sends a packet every
+ * frame: the time between two packets is taken from their sequence numbers,
+ * not from when they arrived, so that jitter on the way neither inflates the
+ * velocity nor shifts the position. That clock is placed on ours by the
+ * packets that took the least time to arrive; a packet that took longer is
+ * extrapolated by the extra time it spent on the way.
+ **/
+
+/* Time between two packets of the client, one per frame of the 3DS */
+#define PREDICT_FRAME_US 16715
+
+#define PREDICT_AXES 7
+
+/* Gains in 1/256; beta = alpha^2 / (2 - alpha), critically damped */
+#define PREDICT_ALPHA 205
+#define PREDICT_BETA 137
+
+/* Longest extrapolation past the last packet; beyond that, the prediction
+ * holds still until the next one
+ */
+#define PREDICT_GAP_MAX_MS 100
+
+/* Packets further apart than this start a new estimate */
+#define PREDICT_RESET_MS 250
+
+/* Fraction of the extra delay of a packet by which the client's clock is
+ * moved towards it
+ */
+#define PREDICT_DRIFT_DIV 64
+
+struct predict_axis {
+    int32_t x;
+    int32_t v;
+};
+
+struct predict {
+    struct predict_axis axes[PREDICT_AXES];
+    /* CLOCK_MONOTONIC time in ns at which the last packet would have arrived
+     * with the least delay seen, 0 if none yet
+     */
+    uint64_t last;
+    uint32_t sequence;
+};
+
+/* Events of the calling thread */
+struct predict_stats {
+    unsigned long updates;
+    unsigned long concealed; // states written in a gap between packets
+};
+
+extern __thread struct predict_stats predict_stats;
+
+/** Feed the values of a packet received at now into the filters
+ *
+ * Packets have to come in order of their sequence numbers; a sequence number
+ * going backwards starts a new estimate.
+ **/
+void predict_update(struct predict *predict,
+                    const struct hidinfo *hid,
+                    uint64_t now);
+
+/** Replace the predicted axes of hid with their extrapolation to at
+ **/
+void predict_apply(const struct predict *predict,
+                   struct hidinfo *hid,
+                   uint64_t at);
+
+#endif /* ----- #ifndef PREDICT_H  ----- */
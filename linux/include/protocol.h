@@ -0,0 +1,144 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+
+/** Revision 2 wire format
+ *
+ * Every revision 2 packet starts with the same header, all in network byte
+ * order:
+ *
+ *   u16 magic, u16 version, u32 sequence, u8 type
+ *
+ * PACKET_HELLO    client -> server  u8 sensors the client can send
+ * PACKET_WELCOME  server -> client  u8 sensors the client should send;
+ *                                   sequence echoes the hello
+ * PACKET_STATE    client -> server  u8 base distance, u16 field bitmap,
+ *                                   one varint per field set in the bitmap
+ * PACKET_ACK      server -> client  sequence is the state acknowledged
+ *
+ * A state is encoded against the state numbered `sequence - distance`, which
+ * the server must have acknowledged before; a distance of 0 encodes against
+ * the all-zero state. Fields missing from the bitmap are unchanged. Key edges
+ * are sent as they are, held keys XORed with the base and all axes as zigzag
+ * encoded 16 bit differences.
+ *
+ * If PROTOCOL_EDGE_RECORDS is set in the bitmap, the fields are followed by
+ * copies of the key edges of earlier packets, so that a tap survives the loss
+ * of the packets carrying it:
+ *
+ *   u8 count, then per record: u8 distance, varint down, varint up
+ *
+ * where the record belongs to the packet numbered `sequence - distance`.
+ **/
+#define PACKET_REV2_HEADER_SIZE 9
+#define PACKET_REV2_HELLO_SIZE (PACKET_REV2_HEADER_SIZE + 1)
+#define PACKET_REV2_STATE_MIN (PACKET_REV2_HEADER_SIZE + 3)
+
+/* Longest varint of a key mask and of a 16 bit axis difference */
+#define PROTOCOL_VARINT32_MAX 5
+#define PROTOCOL_VARINT16_MAX 3
+
+/* Most edge records a single packet may carry */
+#define PROTOCOL_EDGE_RECORDS_MAX 8
+
+#define PACKET_REV2_SIZE_MAX                                                   \
+    (PACKET_REV2_STATE_MIN + 3 * PROTOCOL_VARINT32_MAX +                       \
+     (PROTOCOL_FIELD_COUNT - 3) * PROTOCOL_VARINT16_MAX + 1 +                 \
+     PROTOCOL_EDGE_RECORDS_MAX * (1 + 2 * PROTOCOL_VARINT32_MAX))
+
+/* Number of past states either side keeps to encode against */
+#define PROTOCOL_HISTORY 16
+
+enum packet_type {
+    PACKET_HELLO   = 1,
+    PACKET_WELCOME = 2,
+    PACKET_STATE   = 3,
+    PACKET_ACK     = 4,
+};
+
+/** Sensor groups negotiated in the handshake; keys are always sent
+ **/
+enum {
+    PROTOCOL_SENSOR_CIRCLEPAD     = BIT(0),
+    PROTOCOL_SENSOR_CSTICK        = BIT(1),
+    PROTOCOL_SENSOR_TOUCHSCREEN   = BIT(2),
+    PROTOCOL_SENSOR_GYROSCOPE     = BIT(3),
+    PROTOCOL_SENSOR_ACCELEROMETER = BIT(4),
+
+    PROTOCOL_SENSOR_ALL = BIT(5) - 1,
+};
+
+/** Bits of the field bitmap of a state packet, in wire order
+ **/
+enum protocol_field {
+    PROTOCOL_FIELD_KEYS_UP,
+    PROTOCOL_FIELD_KEYS_DOWN,
+    PROTOCOL_FIELD_KEYS_HELD,
+    PROTOCOL_FIELD_TOUCH_X,
+    PROTOCOL_FIELD_TOUCH_Y,
+    PROTOCOL_FIELD_CIRCLEPAD_X,
+    PROTOCOL_FIELD_CIRCLEPAD_Y,
+    PROTOCOL_FIELD_CSTICK_X,
+    PROTOCOL_FIELD_CSTICK_Y,
+    PROTOCOL_FIELD_GYRO_X,
+    PROTOCOL_FIELD_GYRO_Y,
+    PROTOCOL_FIELD_GYRO_Z,
+    PROTOCOL_FIELD_ACCEL_X,
+    PROTOCOL_FIELD_ACCEL_Y,
+    PROTOCOL_FIELD_ACCEL_Z,
+
+    PROTOCOL_FIELD_COUNT,
+};
+
+/* Bitmap flag announcing a trailer of edge records */
+#define PROTOCOL_EDGE_RECORDS BIT(15)
+
+struct protocol_edges {
+    unsigned count;
+    struct {
+        uint8_t distance;
+        uint32_t down;
+        uint32_t up;
+    } records[PROTOCOL_EDGE_RECORDS_MAX];
+};
+
+struct protocol_header {
+    uint16_t version;
+    uint32_t sequence;
+    uint8_t type;
+};
+
+/** Parse the header of a revision 2 packet
+ *
+ * @returns number of bytes consumed, or < 0 if the packet is too short
+ **/
+int protocol_unpack_header(const unsigned char *buf,
+                           size_t len,
+                           struct protocol_header *header);
+
+/** Write a revision 2 header, returning the number of bytes written
+ **/
+int protocol_pack_header(unsigned char *buf,
+                         const struct protocol_header *header);
+
+/** Decode the body of a state packet
+ *
+ * @param body  Bytes following the header and the base distance
+ * @param base  State the packet was encoded against
+ * @param hid   Receives the decoded state; version and sequence are copied
+ *              from base and left to the caller
+ * @param edges Receives the edge records of the packet, if any
+ *
+ * @returns 0 on success, or < 0 if the body is truncated or has stray bytes
+ **/
+int protocol_decode_state(const unsigned char *body,
+                          size_t len,
+                          const struct hidinfo *base,
+                          struct hidinfo *hid,
+                          struct protocol_edges *edges);
+
+#endif /* ----- #ifndef PROTOCOL_H  ----- */
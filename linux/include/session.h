@@ -0,0 +1,233 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+#include "devices.h"
+#include "fusion.h"
+#include "hid.h"
+#include "motion.h"
+#include "predict.h"
+#include "protocol.h"
+
+/* Number of preallocated session slots; one per 3DS sending to the server */
+#define SESSIONS_MAX 16
+
+/* Size of the open-addressing index, a power of two well above SESSIONS_MAX
+ * to keep probe sequences short.
+ */
+#define SESSION_TABLE_SIZE 64
+
+/* Packets more than this far behind the newest sequence number are taken as
+ * a restarted client rather than as late, and restart the window.
+ */
+#define SESSION_SEQ_RESYNC 256
+
+enum session_seq {
+    SESSION_SEQ_NEW,
+    SESSION_SEQ_LATE,
+    SESSION_SEQ_DUPLICATE,
+    SESSION_SEQ_EXPIRED, // too far behind to tell whether it was seen
+};
+
+/* A session whose devices could not be created tries again with a later
+ * packet, SESSION_RETRY_MIN_MS after the first failure and twice as long after
+ * every further one, up to SESSION_RETRY_MAX_MS
+ */
+#define SESSION_RETRY_MIN_MS 100
+#define SESSION_RETRY_MAX_MS 10000
+
+/* Sliding window over the last SESSION_WINDOW sequence numbers of a session */
+#define SESSION_WINDOW 64
+
+struct session_window {
+    int valid;
+    uint32_t top;
+    uint64_t seen;
+};
+
+/* Recent states of a revision 2 client, which it may encode new ones against.
+ * Slots are indexed by sequence number modulo PROTOCOL_HISTORY.
+ */
+struct session_history {
+    struct hidinfo states[PROTOCOL_HISTORY];
+    uint16_t valid;
+    uint32_t acked;
+};
+
+/* What is left to do for a session that stopped sending */
+enum session_state {
+    SESSION_ACTIVE,   // its inputs are released at the deadline
+    SESSION_RELEASED, // its devices are removed at the deadline
+    SESSION_IDLE,     // nothing, until it sends again
+};
+
+/* Circle pad, C-stick and touch position: the values the output timer moves
+ * in steps from one packet to the next, see ctroller_set_output_rate()
+ */
+#define SESSION_RAMP_AXES 6
+
+struct session_ramp {
+    int32_t from[SESSION_RAMP_AXES];
+    int32_t to[SESSION_RAMP_AXES];
+    uint64_t start;
+    uint64_t span;
+    /* When the last state was written, or 0 to jump straight to the next */
+    uint64_t last;
+    int active;
+};
+
+struct session {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint32_t hash;
+    unsigned long last_seen;
+
+    /* CLOCK_MONOTONIC time in ns at which the session moves on to the next
+     * state
+     */
+    uint64_t deadline;
+    enum session_state state;
+
+    struct session_window window;
+    struct session_history history;
+
+    /* Sensors agreed on in the handshake */
+    unsigned sensors;
+
+    /* Last state written to the devices */
+    struct hidinfo hid;
+
+    /* With upsampling, the state the devices actually got, whose analog
+     * values trail those of hid until the ramp is done
+     */
+    struct hidinfo output;
+    struct session_ramp ramp;
+
+    /* With prediction, the state extrapolated from the packets so far */
+    struct predict predict;
+    struct hidinfo predicted;
+
+    /* Filters of the motion sensors, see motion_smooth() */
+    struct motion_smooth smooth;
+
+    /* Orientation fused from the motion sensors, see fusion_update() */
+    struct fusion fusion;
+
+    /* Newest state of the burst currently being received */
+    struct hidinfo pending;
+    int have_pending;
+
+    /* Created along with the first state that is written, see
+     * session_devices_open()
+     */
+    int devices_open;
+
+    /* After a failure to create them, when to try again and how long the
+     * last wait was, in ms
+     */
+    uint64_t devices_retry;
+    unsigned devices_backoff;
+    struct device_context devices[DEVICES_COUNT];
+};
+
+struct session_table {
+    int16_t index[SESSION_TABLE_SIZE];
+    int16_t free[SESSIONS_MAX];
+    int free_count;
+    unsigned long clock;
+    struct session slots[SESSIONS_MAX];
+
+    /* Device sets without a session, see session_pool_init() */
+    struct device_context (*pool)[DEVICES_COUNT];
+    unsigned pool_size;
+    unsigned pool_count;
+    device_mask_t pool_mask;
+};
+
+void session_table_init(struct session_table *table);
+
+/* Returns the session of the given sender, or NULL if it has none yet. */
+struct session *session_lookup(struct session_table *table,
+                               const struct sockaddr *addr,
+                               socklen_t addr_len);
+
+/* Claims a slot for a new sender. If all slots are in use, the session that
+ * has been quiet the longest is closed to make room.
+ */
+struct session *session_open(struct session_table *table,
+                             const struct sockaddr *addr,
+                             socklen_t addr_len);
+
+void session_close(struct session_table *table, struct session *session);
+
+/* Closes every session and destroys all devices, the pooled ones included. */
+void session_close_all(struct session_table *table);
+
+/* Creates size device sets up front. Sessions take their devices from this
+ * pool, so that they do not wait for uinput and udev to set them up, and hand
+ * them back when they are done, as long as it has room. If a set cannot be
+ * created, the pool starts out with those that were.
+ *
+ * Returns 0, or -1 if the pool could not be allocated.
+ */
+int session_pool_init(struct session_table *table,
+                      unsigned size,
+                      const char *uinput_device,
+                      device_mask_t device_mask);
+
+/* Gives a session that has no virtual devices a set from the pool, or creates
+ * one if the pool is empty. A set that could not be created in full is
+ * destroyed again, and not tried again before the backoff from now ran out.
+ *
+ * Returns 0 if the session has its devices, or -1 if it has none.
+ */
+int session_devices_open(struct session_table *table,
+                         struct session *session,
+                         const char *uinput_device,
+                         device_mask_t device_mask,
+                         uint64_t now);
+
+/* Takes the virtual devices from a session, if it has any. They are reset to
+ * a neutral state and put back into the pool, or destroyed if it is full or
+ * one of them is missing.
+ */
+void session_devices_close(struct session_table *table,
+                           struct session *session);
+
+/* Calls expired() on every session whose deadline has passed and that is not
+ * idle yet; it is expected to move the session on to its next state.
+ *
+ * Returns the earliest deadline among the sessions that are still not idle,
+ * or 0 if there are none.
+ */
+uint64_t session_expire(struct session_table *table,
+                        uint64_t now,
+                        void (*expired)(struct session *session));
+
+/* Classifies a sequence number and records it in the session's window. Only
+ * SESSION_SEQ_NEW packets are newer than everything seen so far.
+ */
+enum session_seq session_check_sequence(struct session *session,
+                                        uint32_t sequence);
+
+/* Forgets the sequence window and state history, e.g. when a client says
+ * hello again after restarting.
+ */
+void session_restart(struct session *session);
+
+/* Records a new state of a revision 2 client. */
+void session_history_push(struct session *session, const struct hidinfo *hid);
+
+/* Returns the recorded state with the given sequence number, or NULL if it has
+ * been overwritten or was never received.
+ */
+const struct hidinfo *session_history_find(const struct session *session,
+                                           uint32_t sequence);
+
+/* Formats the sender address of a session for log messages. */
+const char *session_name(const struct session *session);
+
+#endif /* ----- #ifndef SESSION_H  ----- */
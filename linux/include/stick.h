@@ -0,0 +1,82 @@
+#ifndef STICK_H
+#define STICK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+
+/** Response of the circle pad and C-stick
+ *
+ * The kernel only knows a square deadzone per axis (absflat). Instead, the
+ * distance of a stick from its center is shaped as a whole, keeping its
+ * direction:
+ *
+ * deadzone:      radius, in percent of STICK_RANGE, below which the stick
+ *                rests at the center
+ * anti_deadzone: percent of the full radius the stick jumps to once it
+ *                leaves the deadzone, for games with a deadzone of their own
+ * outer:         radius, in percent of STICK_RANGE, from which on the stick
+ *                is reported fully deflected
+ * curve:         exponent of the response in between; 1 is linear, higher
+ *                ones give more precision around the center
+ *
+ * Each configuration is computed into a table of the shaped position for
+ * every position of one quadrant, so that shaping takes one load per axis.
+ **/
+struct stick_config {
+    unsigned deadzone;
+    unsigned anti_deadzone;
+    unsigned outer;
+    double curve;
+};
+
+enum stick_id {
+    STICK_CIRCLEPAD,
+    STICK_CSTICK,
+    STICKS_COUNT,
+};
+
+/* Deflection of the sticks in each direction, as reported by the devices */
+#define STICK_RANGE 0x9c
+
+/* Shaped position of each position of the positive quadrant */
+struct stick_table {
+    int16_t pos[STICK_RANGE + 1][STICK_RANGE + 1][2];
+};
+
+/* Indexed by stick_id; NULL for sticks reported as they come */
+extern const struct stick_table *stick_tables[STICKS_COUNT];
+
+/** Compute the table of a stick; only called before any device is written
+ *
+ * @returns 0, or < 0 if the configuration makes no sense or the table could
+ *          not be allocated
+ **/
+int stick_configure(enum stick_id id, const struct stick_config *config);
+
+/** Free the tables, once no device is left
+ **/
+void stick_free(void);
+
+static inline struct circlepos stick_shape(enum stick_id id,
+                                           struct circlepos pos)
+{
+    const struct stick_table *table = stick_tables[id];
+    if (table == NULL) {
+        return pos;
+    }
+
+    unsigned x = pos.dx < 0 ? -pos.dx : pos.dx;
+    unsigned y = pos.dy < 0 ? -pos.dy : pos.dy;
+    x          = x < STICK_RANGE ? x : STICK_RANGE;
+    y          = y < STICK_RANGE ? y : STICK_RANGE;
+
+    const int16_t *shaped = table->pos[x][y];
+    return (struct circlepos){
+        .dx = pos.dx < 0 ? -shaped[0] : shaped[0],
+        .dy = pos.dy < 0 ? -shaped[1] : shaped[1],
+    };
+}
+
+#endif /* ----- #ifndef STICK_H  ----- */
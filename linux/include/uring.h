@@ -0,0 +1,77 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper on top of the raw system calls, so the server does
+ * not need liburing on the target system.
+ */
+struct uring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *sq_flags;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/* Ring of provided buffers the kernel picks receive buffers from. */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    size_t size;
+    unsigned entries;
+    uint16_t bgid;
+    uint16_t tail;
+};
+
+/* Set up a ring of 'entries' submissions and 'cq_entries' completions, or
+ * the kernel's default of twice as many completions if 0.
+ */
+int uring_init(struct uring *ring, unsigned entries, unsigned cq_entries);
+void uring_exit(struct uring *ring);
+
+/* Returns 1 if the running kernel supports the opcode, 0 otherwise. */
+int uring_probe(struct uring *ring, unsigned opcode);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Submit all prepared SQEs and wait for at least wait_nr completions. */
+int uring_enter(struct uring *ring, unsigned wait_nr);
+
+/* Returns the oldest unseen completion or NULL. Only enters the kernel to
+ * move over completions it held back while the completion ring was full.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_buf_ring_init(struct uring_buf_ring *buf_ring,
+                        struct uring *ring,
+                        unsigned entries,
+                        uint16_t bgid);
+void uring_buf_ring_exit(struct uring_buf_ring *buf_ring, struct uring *ring);
+
+/* Hand a buffer (back) to the kernel. */
+void uring_buf_ring_add(struct uring_buf_ring *buf_ring,
+                        void *addr,
+                        unsigned len,
+                        uint16_t bid);
+
+#endif /* ----- #ifndef URING_H  ----- */
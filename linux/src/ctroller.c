@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
 #include "ctroller.h"
 #include "devices.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
 
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -15,35 +20,321 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
 #include <linux/uinput.h>
 #include <linux/input.h>
 
+#include "fusion.h"
 #include "hid.h"
+#include "motion.h"
+#include "predict.h"
+#include "protocol.h"
+#include "session.h"
+#include "uring.h"
 
-static struct {
+/* All receive and session state is per thread: with several workers, each one
+ * owns a listener socket and the sessions of the clients the kernel steers to
+ * it.
+ */
+static __thread struct {
     int socket;
-    struct device_context *devices[DEVICES_COUNT];
+    unsigned flags;
+    const char *uinput_device;
+    device_mask_t device_mask;
+    struct session_table sessions;
+
+    /* Sessions with a pending state in the burst being received; each packet
+     * of a batch adds at most one
+     */
+    struct session *burst[CTROLLER_BATCH_SIZE];
+    size_t burst_count;
+
+    /* Event loop: packets, the idle timer, the output timer and the
+     * shutdown signal
+     */
+    int epoll;
+    int timer;
+    int timer_armed;
+    int ticker;
+    int ticker_armed;
+    uint64_t now;
 } ctroller = {
     .socket = -1,
-    .devices =
-        {
-            [DEVICE_GAMEPAD]       = &device_gamepad,
-            [DEVICE_TOUCHSCREEN]   = &device_touchscreen,
-            [DEVICE_GYROSCOPE]     = &device_gyroscope,
-            [DEVICE_ACCELEROMETER] = &device_accelerometer,
-        },
+    .epoll  = -1,
+    .timer  = -1,
+    .ticker = -1,
+};
+
+/* Stack ctroller_prefault() makes sure is backed by memory */
+#define CTROLLER_PREFAULT_STACK (256 * 1024)
+
+/* Shared by all threads; see ctroller_set_signal_fd() */
+static int ctroller_signal_fd = -1;
+
+/* See ctroller_set_idle_teardown(), in ns */
+static uint64_t ctroller_idle_teardown;
+
+/* See ctroller_set_pool() */
+static unsigned ctroller_pool_size;
+
+/* See ctroller_set_output_rate(), in ns */
+static uint64_t ctroller_output_period;
+
+/* See ctroller_set_prediction(), in ns */
+static uint64_t ctroller_horizon;
+
+/* Sockets passed by the service manager, see ctroller_listen_fds(), and the
+ * next one a worker takes over
+ */
+#define CTROLLER_LISTEN_FDS_START 3
+static unsigned ctroller_listen_count;
+static unsigned ctroller_listen_next;
+
+enum ctroller_event {
+    CTROLLER_EVENT_PACKETS,
+    CTROLLER_EVENT_TIMER,
+    CTROLLER_EVENT_TICK,
+    CTROLLER_EVENT_SIGNAL,
+};
+
+/* Room for the receive timestamp of a packet */
+#define CTROLLER_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+
+/* Preallocated ring that recvmmsg() drains the socket into. */
+static __thread struct {
+    packet_hid_t packets[CTROLLER_BATCH_SIZE]
+        __attribute__((aligned(sizeof(uint32_t))));
+    struct sockaddr_storage addrs[CTROLLER_BATCH_SIZE];
+    unsigned char control[CTROLLER_BATCH_SIZE][CTROLLER_CONTROL_SIZE]
+        __attribute__((aligned(sizeof(size_t))));
+    struct iovec iov[CTROLLER_BATCH_SIZE];
+    struct mmsghdr msgs[CTROLLER_BATCH_SIZE];
+} batch;
+
+__thread struct ctroller_stats ctroller_stats;
+
+/* Classic BPF program run by the kernel on every datagram before it is queued
+ * on the socket. For UDP sockets the packet starts at the UDP header, so the
+ * payload is at offset 8. Anything that is not a well-formed ctroller packet
+ * is dropped without waking the server.
+ */
+#define UDP_HEADER_SIZE 8
+
+_Static_assert(PACKET_SIZE >= PACKET_REV0_SIZE &&
+                   PACKET_SIZE >= PACKET_REV1_SIZE,
+               "packet buffers must hold every revision");
+
+static const struct sock_filter ctroller_filter_code[] = {
+    // X = datagram length
+    BPF_STMT(BPF_LDX | BPF_W | BPF_LEN, 0),
+    // Magic
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, UDP_HEADER_SIZE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_MAGIC, 0, 13),
+    // Protocol revision; revisions 0 and 1 have a fixed length, revision 2
+    // packets are anywhere between a bare header and a full state
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, UDP_HEADER_SIZE + sizeof(uint16_t)),
+    BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 12),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2),
+    BPF_STMT(BPF_MISC | BPF_TXA, 0),
+    BPF_JUMP(
+        BPF_JMP | BPF_JEQ | BPF_K, UDP_HEADER_SIZE + PACKET_REV0_SIZE, 7, 8),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 2),
+    BPF_STMT(BPF_MISC | BPF_TXA, 0),
+    BPF_JUMP(
+        BPF_JMP | BPF_JEQ | BPF_K, UDP_HEADER_SIZE + PACKET_REV1_SIZE, 4, 5),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 2, 0, 4),
+    BPF_STMT(BPF_MISC | BPF_TXA, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+             UDP_HEADER_SIZE + PACKET_REV2_HEADER_SIZE,
+             0,
+             2),
+    BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,
+             UDP_HEADER_SIZE + PACKET_REV2_SIZE_MAX,
+             1,
+             0),
+    // Accept
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    // Drop
+    BPF_STMT(BPF_RET | BPF_K, 0),
 };
 
-struct sockaddr listen_addr;
-socklen_t listen_addr_len;
+static int ctroller_filter_attach(int socket)
+{
+    struct sock_fprog prog = {
+        .len    = arrsize(ctroller_filter_code),
+        .filter = (struct sock_filter *) ctroller_filter_code,
+    };
+
+    return setsockopt(
+        socket, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/* Number of datagrams the kernel dropped on this socket. Besides the filter,
+ * this includes datagrams that did not fit into the receive buffer anymore.
+ */
+static unsigned ctroller_filter_drops(void)
+{
+    uint32_t meminfo[SK_MEMINFO_VARS] = {};
+    socklen_t len                     = sizeof(meminfo);
+
+    if (ctroller.socket < 0 ||
+        getsockopt(ctroller.socket, SOL_SOCKET, SO_MEMINFO, meminfo, &len) <
+            0) {
+        return 0;
+    }
+    return meminfo[SK_MEMINFO_DROPS];
+}
+
+static void ctroller_batch_init(void)
+{
+    for (size_t i = 0; i < CTROLLER_BATCH_SIZE; i++) {
+        batch.iov[i].iov_base = batch.packets[i];
+        batch.iov[i].iov_len  = PACKET_SIZE;
+
+        batch.msgs[i].msg_hdr = (struct msghdr){
+            .msg_name       = &batch.addrs[i],
+            .msg_namelen    = sizeof(batch.addrs[i]),
+            .msg_iov        = &batch.iov[i],
+            .msg_iovlen     = 1,
+            .msg_control    = batch.control[i],
+            .msg_controllen = sizeof(batch.control[i]),
+        };
+    }
+}
+
+void ctroller_set_signal_fd(int fd)
+{
+    ctroller_signal_fd = fd;
+}
+
+void ctroller_set_idle_teardown(unsigned seconds)
+{
+    ctroller_idle_teardown = seconds * 1000000000ull;
+}
+
+void ctroller_set_pool(unsigned size)
+{
+    ctroller_pool_size = size;
+}
+
+void ctroller_set_output_rate(unsigned hz)
+{
+    ctroller_output_period = hz != 0 ? 1000000000ull / hz : 0;
+}
+
+void ctroller_set_prediction(unsigned ms)
+{
+    ctroller_horizon = ms * 1000000ull;
+}
+
+int ctroller_listen_fds(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (pid == NULL || fds == NULL || atol(pid) != getpid()) {
+        return 0;
+    }
+
+    int count = atoi(fds);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (int fd = CTROLLER_LISTEN_FDS_START;
+         fd < CTROLLER_LISTEN_FDS_START + count;
+         fd++) {
+        int type;
+        socklen_t len = sizeof(type);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0) {
+            perror("Passed socket");
+            return -1;
+        }
+        if (type != SOCK_DGRAM) {
+            fprintf(stderr, "Passed socket %d is not a datagram socket.\n", fd);
+            return -1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    ctroller_listen_count = count > 0 ? count : 0;
+    return ctroller_listen_count;
+}
+
+/* Port a socket is bound to, formatted into buf */
+static const char *ctroller_socket_port(int socket, char *buf, size_t len)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (getsockname(socket, (struct sockaddr *) &addr, &addr_len) < 0 ||
+        getnameinfo((struct sockaddr *) &addr,
+                    addr_len,
+                    NULL,
+                    0,
+                    buf,
+                    len,
+                    NI_NUMERICSERV) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+static int ctroller_epoll_add(int fd, enum ctroller_event tag)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data   = {.u32 = tag},
+    };
+    return epoll_ctl(ctroller.epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+static int ctroller_loop_init(void)
+{
+    ctroller.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (ctroller.epoll < 0) {
+        return -1;
+    }
+
+    ctroller.timer =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ctroller.timer < 0) {
+        return -1;
+    }
+    ctroller.timer_armed = 0;
+
+    if (ctroller_epoll_add(ctroller.socket, CTROLLER_EVENT_PACKETS) < 0 ||
+        ctroller_epoll_add(ctroller.timer, CTROLLER_EVENT_TIMER) < 0) {
+        return -1;
+    }
+
+    if (ctroller_output_period != 0 || ctroller_horizon != 0) {
+        ctroller.ticker =
+            timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (ctroller.ticker < 0 ||
+            ctroller_epoll_add(ctroller.ticker, CTROLLER_EVENT_TICK) < 0) {
+            return -1;
+        }
+        ctroller.ticker_armed = 0;
+    }
+
+    // Level-triggered and never read, so that every worker sees it
+    if (ctroller_signal_fd >= 0 &&
+        ctroller_epoll_add(ctroller_signal_fd, CTROLLER_EVENT_SIGNAL) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
 
 int ctroller_init(const char *uinput_device,
                   const char *port,
-                  device_mask_t device_mask)
+                  device_mask_t device_mask,
+                  unsigned flags)
 {
     puts("Initializing ctroller-android version " CTROLLER_VERSION_STRING ".");
     int res;
-    if ((res = ctroller_listener_init(port)) < 0) {
+    if ((res = ctroller_listener_init(port, flags)) < 0) {
         fprintf(stderr, "Failed to initialize listener.\n");
         return res;
     }
@@ -53,10 +344,16 @@ int ctroller_init(const char *uinput_device,
         ctroller_exit();
         return res;
     }
+
+    if ((res = ctroller_loop_init()) < 0) {
+        perror("Failed to set up event loop");
+        ctroller_exit();
+        return res;
+    }
     return 0;
 }
 
-int ctroller_listener_init(const char *port)
+static int ctroller_listener_bind(const char *port, unsigned flags)
 {
     int res;
 
@@ -66,10 +363,6 @@ int ctroller_listener_init(const char *port)
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_flags    = AI_PASSIVE;
 
-    if (port == NULL) {
-        port = PORT_DEFAULT;
-    }
-
     struct addrinfo *ctroller_info;
     if ((res = getaddrinfo(NULL, port, &hints, &ctroller_info))) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
@@ -87,6 +380,19 @@ int ctroller_listener_init(const char *port)
             continue;
         }
 
+        if (flags & CTROLLER_REUSEPORT) {
+            int one = 1;
+            if (setsockopt(ctroller.socket,
+                           SOL_SOCKET,
+                           SO_REUSEPORT,
+                           &one,
+                           sizeof(one)) < 0) {
+                close(ctroller.socket);
+                perror("setsockopt(SO_REUSEPORT)");
+                continue;
+            }
+        }
+
         if (bind(ctroller.socket, addr_info->ai_addr, addr_info->ai_addrlen) <
             0) {
             close(ctroller.socket);
@@ -102,12 +408,76 @@ int ctroller_listener_init(const char *port)
         return -1;
     }
 
-    listen_addr     = *addr_info->ai_addr;
-    listen_addr_len = addr_info->ai_addrlen;
-
     freeaddrinfo(ctroller_info);
+    return 0;
+}
+
+int ctroller_listener_init(const char *port, unsigned flags)
+{
+    char service[NI_MAXSERV];
+    unsigned index =
+        __atomic_fetch_add(&ctroller_listen_next, 1, __ATOMIC_RELAXED);
+
+    if (port == NULL) {
+        port = PORT_DEFAULT;
+    }
+
+    if (index < ctroller_listen_count) {
+        // Set up by the service manager, bound and all
+        ctroller.socket = CTROLLER_LISTEN_FDS_START + index;
+        port = ctroller_socket_port(ctroller.socket, service, sizeof(service));
+    } else {
+        // Workers beyond the passed sockets join the first one's port, which
+        // takes a socket with SO_REUSEPORT
+        if (ctroller_listen_count > 0) {
+            port = ctroller_socket_port(
+                CTROLLER_LISTEN_FDS_START, service, sizeof(service));
+            if (port == NULL) {
+                perror("Passed socket");
+                return -1;
+            }
+        }
+        if (ctroller_listener_bind(port, flags) < 0) {
+            return -1;
+        }
+    }
+
+    ctroller.flags = flags;
+
+    // Not fatal: malformed packets are still rejected after receiving them
+    if (ctroller_filter_attach(ctroller.socket) < 0) {
+        perror("Failed to attach socket filter");
+    }
+
+    // Neither is required for receiving; raising the busy poll time above the
+    // net.core.busy_read default needs CAP_NET_ADMIN.
+    if (flags & CTROLLER_BUSY_POLL) {
+        int usecs = CTROLLER_BUSY_POLL_US;
+        if (setsockopt(ctroller.socket,
+                       SOL_SOCKET,
+                       SO_BUSY_POLL,
+                       &usecs,
+                       sizeof(usecs)) < 0) {
+            perror("setsockopt(SO_BUSY_POLL)");
+        }
+    }
+
+    if (flags & CTROLLER_LATENCY) {
+        int one = 1;
+        if (setsockopt(ctroller.socket,
+                       SOL_SOCKET,
+                       SO_TIMESTAMPNS,
+                       &one,
+                       sizeof(one)) < 0) {
+            perror("setsockopt(SO_TIMESTAMPNS)");
+        }
+    }
 
-    printf("Listening on port %s.\n", port);
+    ctroller_batch_init();
+
+    printf("Listening on port %s%s.\n",
+           port != NULL ? port : "unknown",
+           index < ctroller_listen_count ? " (passed socket)" : "");
     return 0;
 }
 
@@ -117,142 +487,1530 @@ int ctroller_uinput_init(const char *uinput_device, device_mask_t device_mask)
         uinput_device = UINPUT_DEFAULT_DEVICE;
     }
 
-    for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
-        if (device_mask & (1 << i)) {
+    // Before anything can fail, as ctroller_exit() closes all sessions
+    session_table_init(&ctroller.sessions);
 
-            fprintf(stderr, "initializing device DEVICE_ID=%zu...\n", i);
+    // Devices are created per session once its first packet arrives; make
+    // sure that is going to work before waiting for one.
+    if (access(uinput_device, W_OK) < 0) {
+        fprintf(stderr,
+                "Error opening uinput device at '%s': %s\n",
+                uinput_device,
+                strerror(errno));
+        return -1;
+    }
 
-            int fd = ctroller.devices[i]->create(uinput_device);
-            if (fd < 0) {
-                for (size_t j = 0; j < i; j++) {
-                    close(ctroller.devices[j]->fd);
-                    ctroller.devices[j]->fd = -1;
-                }
-                return -1;
-            }
-            ctroller.devices[i]->fd = fd;
-        }
+    ctroller.uinput_device = uinput_device;
+    ctroller.device_mask   = device_mask;
+
+    if (ctroller_pool_size > 0) {
+        printf("Creating %u spare device sets...\n", ctroller_pool_size);
+    }
+    return session_pool_init(
+        &ctroller.sessions, ctroller_pool_size, uinput_device, device_mask);
+}
+
+int ctroller_recv(void *buf,
+                  size_t len,
+                  struct sockaddr *from,
+                  socklen_t *from_len)
+{
+    return recvfrom(ctroller.socket, buf, len, 0, from, from_len);
+}
+
+/* Kernel receive time of a packet, if the socket has SO_TIMESTAMPNS set */
+static uint64_t ctroller_rx_time(struct msghdr *msg)
+{
+    if (!(ctroller.flags & CTROLLER_LATENCY)) {
+        return 0;
     }
 
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg                 = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    }
     return 0;
 }
 
-int ctroller_recv(void *buf, size_t len)
+static void ctroller_flush_burst(void);
+
+static struct session *ctroller_session(const struct sockaddr *from,
+                                        socklen_t from_len,
+                                        uint16_t version)
 {
-    return recvfrom(
-        ctroller.socket, buf, len, 0, &listen_addr, &listen_addr_len);
+    struct session *session =
+        session_lookup(&ctroller.sessions, from, from_len);
+    if (session != NULL) {
+        return session;
+    }
+
+    // A session dropped to make room would stay in the burst, and its slot
+    // would join it a second time for the new sender; write the burst first
+    if (ctroller.sessions.free_count == 0) {
+        ctroller_flush_burst();
+    }
+
+    session = session_open(&ctroller.sessions, from, from_len);
+    if (session == NULL) {
+        return NULL;
+    }
+
+    printf("Nintendo 3DS connected from %s. (ctroller version "
+           "%01d.%01d.%01d)\n",
+           session_name(session),
+           (version & 0x0f00) >> 8,
+           (version & 0x00f0) >> 4,
+           (version & 0x000f) >> 0);
+    if (PACKET_VERSION_BCD(version) != CTROLLER_VERSION) {
+        fprintf(stderr,
+                "Server version (%#04x) and client version "
+                "(%#04x) differ.\n",
+                CTROLLER_VERSION,
+                PACKET_VERSION_BCD(version));
+    }
+
+    return session;
 }
 
-int ctroller_poll_hid_info(struct hidinfo *hid)
+/* Sensors backed by one of the enabled devices; there is no point in a client
+ * sending the others.
+ */
+static unsigned ctroller_sensors(void)
 {
-    int res = 0;
-    packet_hid_t packet __attribute__((aligned(sizeof(uint32_t))));
-    struct pollfd ufds;
+    unsigned sensors = 0;
 
-    ufds.fd     = ctroller.socket;
-    ufds.events = POLLIN;
+    if (ctroller.device_mask & BIT(DEVICE_GAMEPAD)) {
+        sensors |= PROTOCOL_SENSOR_CIRCLEPAD | PROTOCOL_SENSOR_CSTICK;
+    }
+    if (ctroller.device_mask & BIT(DEVICE_TOUCHSCREEN)) {
+        sensors |= PROTOCOL_SENSOR_TOUCHSCREEN;
+    }
+    if (ctroller.device_mask & BIT(DEVICE_GYROSCOPE)) {
+        sensors |= PROTOCOL_SENSOR_GYROSCOPE;
+    }
+    if (ctroller.device_mask & BIT(DEVICE_ACCELEROMETER)) {
+        sensors |= PROTOCOL_SENSOR_ACCELEROMETER;
+    }
+    if (ctroller.device_mask & BIT(DEVICE_ORIENTATION)) {
+        sensors |= PROTOCOL_SENSOR_GYROSCOPE | PROTOCOL_SENSOR_ACCELEROMETER;
+    }
 
-    res = poll(&ufds, 1, -1);
-    if (res < 0) {
-        perror("Error polling 3DS");
-        return -1;
-    } else if (res == 0) {
-        // timeout
-        return 0;
+    return sensors;
+}
+
+/* Send a revision 2 control packet back to the client of a session */
+static void ctroller_reply(const struct session *session,
+                           uint8_t type,
+                           uint32_t sequence,
+                           const void *payload,
+                           size_t len)
+{
+    unsigned char packet[PACKET_REV2_HEADER_SIZE + sizeof(uint32_t)];
+    struct protocol_header header = {
+        .version  = CTROLLER_PACKET_VERSION,
+        .sequence = sequence,
+        .type     = type,
+    };
+
+    assert(len <= sizeof(packet) - PACKET_REV2_HEADER_SIZE);
+
+    int size = protocol_pack_header(packet, &header);
+    if (len > 0) {
+        memcpy(packet + size, payload, len);
     }
 
-    if (ufds.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-        fprintf(stderr, "Polling 3DS: revents indicate error\n");
+    if (sendto(ctroller.socket,
+               packet,
+               size + len,
+               MSG_DONTWAIT,
+               (const struct sockaddr *) &session->addr,
+               session->addr_len) < 0) {
+        perror("Error replying to 3DS");
+    }
+}
+
+/* Decode a packet of one protocol revision. Key edges of earlier packets that
+ * the packet carries copies of are returned in edges.
+ *
+ * @returns 1 if hid holds a new state
+ * @returns 0 if the packet was handled but carries no state
+ * @returns < 0 if the packet is malformed
+ */
+typedef int ctroller_call_decode(struct session *session,
+                                 unsigned char *packet,
+                                 size_t len,
+                                 struct hidinfo *hid,
+                                 struct protocol_edges *edges);
+
+/* Called with every state that passed the sequence check */
+typedef void ctroller_call_accept(struct session *session,
+                                  const struct hidinfo *hid);
+
+static int ctroller_decode_fixed(struct session *session,
+                                 unsigned char *packet,
+                                 size_t len,
+                                 struct hidinfo *hid,
+                                 struct protocol_edges *edges)
+{
+    (void) session;
+    edges->count = 0;
+    return (ctroller_unpack_hid_info(packet, len, hid) < 0) ? -1 : 1;
+}
+
+static int ctroller_decode_delta(struct session *session,
+                                 unsigned char *packet,
+                                 size_t len,
+                                 struct hidinfo *hid,
+                                 struct protocol_edges *edges)
+{
+    static const struct hidinfo neutral;
+    struct protocol_header header;
+
+    int offset = protocol_unpack_header(packet, len, &header);
+    if (offset < 0) {
         return -1;
     }
 
-    if (!(ufds.revents & POLLIN)) {
+    switch (header.type) {
+    case PACKET_HELLO: {
+        if (len != PACKET_REV2_HELLO_SIZE) {
+            return -1;
+        }
+
+        // A client saying hello starts counting and encoding from scratch
+        session_restart(session);
+        session->sensors = packet[offset] & ctroller_sensors();
+
+        uint8_t sensors = session->sensors;
+        ctroller_reply(
+            session, PACKET_WELCOME, header.sequence, &sensors, sizeof(sensors));
         return 0;
     }
-    res = ctroller_recv(packet, PACKET_SIZE);
-    if (res < 0) {
-        perror("Error receiving packet");
+    case PACKET_STATE: {
+        if (len < PACKET_REV2_STATE_MIN) {
+            return -1;
+        }
+
+        unsigned distance          = packet[offset++];
+        const struct hidinfo *base = &neutral;
+        if (distance != 0) {
+            base = session_history_find(session, header.sequence - distance);
+            if (base == NULL) {
+                // Encoded against a state we no longer have; the client falls
+                // back to a full state once it stops getting acks.
+                ctroller_stats.unresolved++;
+                return 0;
+            }
+        }
+
+        if (protocol_decode_state(
+                packet + offset, len - offset, base, hid, edges) < 0) {
+            return -1;
+        }
+        hid->version  = header.version;
+        hid->sequence = header.sequence;
+        return 1;
+    }
+    default:
         return -1;
     }
-
-    res = ctroller_unpack_hid_info(packet, hid);
-    return res;
 }
 
-inline void *ctroller_unpack_int16_t(unsigned char *buf, int16_t *val)
+/* Acknowledge every CTROLLER_ACK_INTERVAL-th state. Clients encode against
+ * the newest acknowledged one, so this trades a little upstream compression
+ * for less traffic towards the 3DS.
+ */
+#define CTROLLER_ACK_INTERVAL 4
+
+static void ctroller_accept_delta(struct session *session,
+                                  const struct hidinfo *hid)
 {
-    *val = (int16_t) ntohs(*(uint16_t *) buf);
-    return buf + sizeof(int16_t);
+    struct session_history *history = &session->history;
+    int first                       = (history->valid == 0);
+
+    session_history_push(session, hid);
+
+    if (first || hid->sequence - history->acked >= CTROLLER_ACK_INTERVAL) {
+        history->acked = hid->sequence;
+        ctroller_reply(session, PACKET_ACK, hid->sequence, NULL, 0);
+    }
 }
 
-inline void *ctroller_unpack_uint16_t(unsigned char *buf, uint16_t *val)
+/* Decoders by protocol revision, the top nibble of the version field */
+static const struct {
+    ctroller_call_decode *decode;
+    ctroller_call_accept *accept;
+} ctroller_decoders[] = {
+    [0] = {ctroller_decode_fixed, NULL},
+    [1] = {ctroller_decode_fixed, NULL},
+    [2] = {ctroller_decode_delta, ctroller_accept_delta},
+};
+
+static uint64_t ctroller_clock(void)
 {
-    *val = ntohs(*(uint16_t *) buf);
-    return buf + sizeof(uint16_t);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-inline void *ctroller_unpack_uint32_t(unsigned char *buf, uint32_t *val)
+static void ctroller_arm_timer(uint64_t deadline)
 {
-    *val = ntohl(*(uint32_t *) buf);
-    return buf + sizeof(uint32_t);
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec  = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000,
+        },
+    };
+
+    if (timerfd_settime(ctroller.timer, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("Error arming idle timer");
+        return;
+    }
+    ctroller.timer_armed = 1;
 }
 
-inline int ctroller_unpack_hid_info(unsigned char *sendbuf, struct hidinfo *hid)
+/* Push back the idle deadline of a session that just sent something. The
+ * timer is not moved along with it: when it fires early, it is simply armed
+ * again for the new earliest deadline.
+ */
+static void ctroller_touch(struct session *session)
 {
-    uint16_t magic;
-    unsigned char *unpack = sendbuf;
-    unpack                = ctroller_unpack_uint16_t(unpack, &magic);
-    if (magic != PACKET_MAGIC) {
-        fprintf(stderr, "Invalid package header (%#08x).\n", magic);
-        return -1;
+    session->deadline = ctroller.now + CTROLLER_IDLE_TIMEOUT_MS * 1000000ull;
+    session->state    = SESSION_ACTIVE;
+
+    if (!ctroller.timer_armed) {
+        ctroller_arm_timer(session->deadline);
     }
+}
 
-    unpack = ctroller_unpack_uint16_t(unpack, &hid->version);
+/* Let go of everything a session that went quiet was holding */
+static void ctroller_release(struct session *session)
+{
+    printf("Nintendo 3DS at %s went quiet, releasing its inputs.\n",
+           session_name(session));
 
-    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.up);
-    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.down);
-    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.held);
+    struct hidinfo neutral = {
+        .version  = session->hid.version,
+        .sequence = session->hid.sequence,
+        .keys     = {.up = session->hid.keys.held},
+    };
 
-    unpack = ctroller_unpack_uint16_t(unpack, &hid->touchscreen.px);
-    unpack = ctroller_unpack_uint16_t(unpack, &hid->touchscreen.py);
+    session->hid          = neutral;
+    session->have_pending = 0;
+    session->ramp.last    = 0;
+    session->predict.last = 0;
+    session->smooth.valid = 0;
+    session->fusion.last  = 0;
+    if (session->devices_open) {
+        ctroller_write_hid_info(session);
+    }
+    ctroller_stats.released++;
+}
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->circlepad.dx);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->circlepad.dy);
+/* Move a session whose deadline passed on: release its inputs, then, after
+ * the idle teardown time, remove its devices
+ */
+static void ctroller_expired(struct session *session)
+{
+    switch (session->state) {
+    case SESSION_ACTIVE:
+        ctroller_release(session);
+        if (ctroller_idle_teardown != 0 && session->devices_open) {
+            session->state = SESSION_RELEASED;
+            session->deadline += ctroller_idle_teardown;
+        } else {
+            session->state = SESSION_IDLE;
+        }
+        break;
+    case SESSION_RELEASED:
+        printf("Nintendo 3DS at %s stayed away, removing its devices.\n",
+               session_name(session));
+        session_devices_close(&ctroller.sessions, session);
+        session->state = SESSION_IDLE;
+        ctroller_stats.removed++;
+        break;
+    case SESSION_IDLE:
+        break;
+    }
+}
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->cstick.dx);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->cstick.dy);
+/* Release the sessions whose deadline passed and re-arm the timer for the
+ * next one. Returns the number of sessions that went idle.
+ */
+static int ctroller_expire(void)
+{
+    uint64_t expirations;
+    if (read(ctroller.timer, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+        perror("Error reading idle timer");
+    }
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.x);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.y);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.z);
+    ctroller.timer_armed = 0;
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.x);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.y);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.z);
+    unsigned long released = ctroller_stats.released;
+    uint64_t next =
+        session_expire(&ctroller.sessions, ctroller.now, ctroller_expired);
+    if (next != 0) {
+        ctroller_arm_timer(next);
+    }
 
-    return unpack - sendbuf;
+    return ctroller_stats.released - released;
 }
 
-int ctroller_write_hid_info(struct hidinfo *hid)
+/* Fold one packet of a burst into the session. session->hid holds the last
+ * state written to the devices. Analog values only ever need their newest
+ * sample, so the pending packet is written right away only if it carries a
+ * key edge; otherwise it is superseded by the next one.
+ */
+static void ctroller_coalesce(struct session *session,
+                              const struct hidinfo *next)
 {
-    for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
-        int devfd = ctroller.devices[i]->fd;
-        if (devfd != -1) {
-            ctroller.devices[i]->write(devfd, hid);
+    struct hidinfo *pending = &session->pending;
+
+    if (session->have_pending) {
+        if (pending->keys.down || pending->keys.up ||
+            pending->keys.held != session->hid.keys.held) {
+            session->hid = *pending;
+            ctroller_write_hid_info(session);
+        } else {
+            ctroller_stats.coalesced++;
         }
     }
-    return 0;
+
+    *pending              = *next;
+    session->have_pending = 1;
 }
 
-void ctroller_exit()
+/* Write a state right away, or hold it back until ctroller_flush_burst() */
+static void ctroller_deliver(struct session *session,
+                             const struct hidinfo *hid,
+                             int coalesce)
 {
-    close(ctroller.socket);
-    ctroller.socket = -1;
+    if (!coalesce) {
+        session->hid = *hid;
+        ctroller_write_hid_info(session);
+        return;
+    }
+
+    if (!session->have_pending) {
+        ctroller.burst[ctroller.burst_count++] = session;
+    }
+    ctroller_coalesce(session, hid);
+}
 
-    for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
-        ioctl(ctroller.devices[i]->fd, UI_DEV_DESTROY);
-        ctroller.devices[i]->fd = -1;
+/* Deliver the key edges of lost packets, which a later packet carried copies
+ * of, ahead of that packet's own state. Each record is claimed in the
+ * sequence window, so that neither the lost packet turning up after all nor
+ * the same record in the following packets presses a key twice.
+ */
+static void ctroller_replay_edges(struct session *session,
+                                  const struct hidinfo *hid,
+                                  const struct protocol_edges *edges,
+                                  int coalesce)
+{
+    // Without a window there is no telling which packets went missing
+    if (edges->count == 0 || !session->window.valid) {
+        return;
     }
 
+    struct hidinfo replay =
+        session->have_pending ? session->pending : session->hid;
+
+    for (unsigned i = 0; i < edges->count; i++) {
+        uint32_t sequence = hid->sequence - edges->records[i].distance;
+
+        // Records older than the window would be taken for a restarted client
+        if ((int32_t) (session->window.top - sequence) >= SESSION_WINDOW) {
+            continue;
+        }
+
+        switch (session_check_sequence(session, sequence)) {
+        case SESSION_SEQ_NEW:
+        case SESSION_SEQ_LATE:
+            break;
+        default:
+            continue;
+        }
+
+        replay.sequence  = sequence;
+        replay.timestamp = hid->timestamp;
+        replay.keys.down = edges->records[i].down;
+        replay.keys.up   = edges->records[i].up;
+        replay.keys.held =
+            (replay.keys.held & ~replay.keys.up) | replay.keys.down;
+
+        ctroller_stats.recovered++;
+        ctroller_deliver(session, &replay, coalesce);
+    }
+}
+
+/* Unpack a packet and hand it to the session of its sender. Unless coalescing,
+ * the state is written right away; otherwise it is held back until
+ * ctroller_flush_burst().
+ */
+static int ctroller_ingest(unsigned char *packet,
+                           size_t len,
+                           const struct sockaddr *from,
+                           socklen_t from_len,
+                           uint64_t timestamp,
+                           int coalesce)
+{
+    if (len < 2 * sizeof(uint16_t)) {
+        ctroller_stats.malformed++;
+        return -1;
+    }
+
+    uint16_t magic    = packet[0] << 8 | packet[1];
+    uint16_t version  = packet[2] << 8 | packet[3];
+    unsigned revision = PACKET_REVISION(version);
+    if (magic != PACKET_MAGIC || revision >= arrsize(ctroller_decoders) ||
+        ctroller_decoders[revision].decode == NULL) {
+        ctroller_stats.malformed++;
+        return -1;
+    }
+
+    struct session *session = ctroller_session(from, from_len, version);
+    if (session == NULL) {
+        return -1;
+    }
+    ctroller_touch(session);
+
+    struct hidinfo hid;
+    struct protocol_edges edges;
+    int res = ctroller_decoders[revision].decode(
+        session, packet, len, &hid, &edges);
+    if (res <= 0) {
+        if (res < 0) {
+            ctroller_stats.malformed++;
+        }
+        return res;
+    }
+
+    hid.timestamp = timestamp;
+    ctroller_replay_edges(session, &hid, &edges, coalesce);
+
+    // Drop reordered and duplicated packets before they can move a stick
+    // backwards or re-press a released button.
+    if (revision >= 1) {
+        switch (session_check_sequence(session, hid.sequence)) {
+        case SESSION_SEQ_LATE:
+        case SESSION_SEQ_EXPIRED:
+            ctroller_stats.late++;
+            return -1;
+        case SESSION_SEQ_DUPLICATE:
+            ctroller_stats.duplicate++;
+            return -1;
+        default:
+            break;
+        }
+    }
+
+    if (ctroller_decoders[revision].accept != NULL) {
+        ctroller_decoders[revision].accept(session, &hid);
+    }
+
+    // Deltas refer to the states as received, so only from here on. The
+    // orientation integrates the gyroscope and needs no smoothing of its own.
+    if (ctroller.device_mask & BIT(DEVICE_ORIENTATION)) {
+        fusion_update(&session->fusion, &hid, ctroller.now);
+    }
+    motion_smooth(&session->smooth, &hid);
+
+    if (ctroller_horizon != 0) {
+        predict_update(&session->predict, &hid, ctroller.now);
+    }
+
+    ctroller_deliver(session, &hid, coalesce);
+    return res;
+}
+
+static void ctroller_flush_burst(void)
+{
+    for (size_t i = 0; i < ctroller.burst_count; i++) {
+        struct session *session = ctroller.burst[i];
+        // Skip sessions whose pending state was written or dropped since
+        if (session->have_pending) {
+            session->hid          = session->pending;
+            session->have_pending = 0;
+            ctroller_write_hid_info(session);
+        }
+    }
+    ctroller.burst_count = 0;
+}
+
+static void ctroller_tick(void);
+
+/* Block until packets arrive, a session goes idle or we are told to exit.
+ *
+ * @returns 1 if packets are ready
+ * @returns 0 if only idle sessions were handled
+ * @returns CTROLLER_POLL_EXIT on a termination signal
+ * @returns -1 on error
+ */
+static int ctroller_wait(void)
+{
+    struct epoll_event events[4];
+    int ready    = 0;
+    int released = 0;
+
+    // A timer that fired for a session that has sent something since is not
+    // worth returning for
+    while (!ready && !released) {
+        int count = epoll_wait(ctroller.epoll, events, arrsize(events), -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error polling 3DS");
+            return -1;
+        }
+
+        ctroller.now = ctroller_clock();
+
+        int expired = 0;
+        int tick    = 0;
+        for (int i = 0; i < count; i++) {
+            switch (events[i].data.u32) {
+            case CTROLLER_EVENT_SIGNAL:
+                return CTROLLER_POLL_EXIT;
+            case CTROLLER_EVENT_TIMER:
+                expired = 1;
+                break;
+            case CTROLLER_EVENT_TICK:
+                tick = 1;
+                break;
+            case CTROLLER_EVENT_PACKETS:
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    fprintf(stderr, "Polling 3DS: events indicate error\n");
+                    return -1;
+                }
+                ready = 1;
+                break;
+            }
+        }
+
+        if (tick) {
+            ctroller_tick();
+        }
+        if (expired) {
+            released = ctroller_expire();
+        }
+    }
+
+    return ready;
+}
+
+int ctroller_poll_hid_info(void)
+{
+    int res = 0;
+    packet_hid_t packet __attribute__((aligned(sizeof(uint32_t))));
+    struct sockaddr_storage from;
+    unsigned char control[CTROLLER_CONTROL_SIZE]
+        __attribute__((aligned(sizeof(size_t))));
+    struct iovec iov = {.iov_base = packet, .iov_len = PACKET_SIZE};
+    struct msghdr msg = {
+        .msg_name       = &from,
+        .msg_namelen    = sizeof(from),
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    res = ctroller_wait();
+    if (res <= 0) {
+        return res;
+    }
+
+    res = recvmsg(ctroller.socket, &msg, 0);
+    ctroller_stats.recv_calls++;
+    if (res < 0) {
+        perror("Error receiving packet");
+        return -1;
+    }
+    ctroller_stats.packets++;
+
+    ctroller_ingest(packet,
+                    res,
+                    (struct sockaddr *) &from,
+                    msg.msg_namelen,
+                    ctroller_rx_time(&msg),
+                    0);
+    return 1;
+}
+
+int ctroller_poll_hid_batch(void)
+{
+    int res;
+    int count;
+
+    do {
+        res = ctroller_wait();
+        if (res <= 0) {
+            return res;
+        }
+
+        count = recvmmsg(ctroller.socket,
+                         batch.msgs,
+                         CTROLLER_BATCH_SIZE,
+                         MSG_DONTWAIT,
+                         NULL);
+        ctroller_stats.recv_calls++;
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            perror("Error receiving packets");
+            return -1;
+        }
+        ctroller_stats.packets += count;
+
+        for (int i = 0; i < count; i++) {
+            struct msghdr *msg = &batch.msgs[i].msg_hdr;
+            ctroller_ingest(batch.packets[i],
+                            batch.msgs[i].msg_len,
+                            msg->msg_name,
+                            msg->msg_namelen,
+                            ctroller_rx_time(msg),
+                            1);
+            // recvmmsg() overwrites both lengths with the actual ones
+            msg->msg_namelen    = sizeof(batch.addrs[i]);
+            msg->msg_controllen = CTROLLER_CONTROL_SIZE;
+        }
+    } while (ctroller.burst_count == 0);
+
+    ctroller_flush_burst();
+    return count;
+}
+
+#define URING_ENTRIES 8
+#define URING_BUFFERS 64
+
+/* Every buffer takes one completion, the one ending the request for lack of
+ * buffers another; room for all of them keeps the kernel from holding any
+ * back
+ */
+#define URING_CQ_ENTRIES (2 * URING_BUFFERS)
+#define URING_BGID 0
+#define URING_RECV_TAG 1
+
+/* Each provided buffer receives a recvmsg header, the sender address, the
+ * receive timestamp and the packet itself.
+ */
+#define URING_BUFFER_SIZE                                                      \
+    (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +   \
+     CTROLLER_CONTROL_SIZE + PACKET_SIZE)
+
+/* io_uring receiver: a single multishot recvmsg keeps delivering datagrams
+ * into buffers from a registered buffer ring, so a busy socket is drained
+ * without entering the kernel for every packet.
+ */
+static __thread struct {
+    struct uring ring;
+    struct uring_buf_ring buf_ring;
+    struct msghdr msg;
+    int armed;
+    unsigned char buffers[URING_BUFFERS][URING_BUFFER_SIZE]
+        __attribute__((aligned(sizeof(uint64_t))));
+} rx = {
+    .ring = {.fd = -1},
+};
+
+static int ctroller_uring_arm(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&rx.ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode    = IORING_OP_RECVMSG;
+    sqe->fd        = ctroller.socket;
+    sqe->addr      = (uintptr_t) &rx.msg;
+    sqe->len       = 1;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_RECV_TAG;
+
+    rx.armed = 1;
+    return 0;
+}
+
+int ctroller_uring_init(void)
+{
+    if (uring_init(&rx.ring, URING_ENTRIES, URING_CQ_ENTRIES) < 0) {
+        return -1;
+    }
+
+    if (!uring_probe(&rx.ring, IORING_OP_RECVMSG)) {
+        errno = EOPNOTSUPP;
+        goto failure;
+    }
+
+    if (uring_buf_ring_init(
+            &rx.buf_ring, &rx.ring, URING_BUFFERS, URING_BGID) < 0) {
+        goto failure;
+    }
+
+    for (uint16_t bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_buf_ring_add(
+            &rx.buf_ring, rx.buffers[bid], URING_BUFFER_SIZE, bid);
+    }
+
+    rx.msg = (struct msghdr){
+        .msg_namelen    = sizeof(struct sockaddr_storage),
+        .msg_controllen = CTROLLER_CONTROL_SIZE,
+    };
+
+    if (ctroller_uring_arm() < 0 || uring_enter(&rx.ring, 0) < 0) {
+        goto failure;
+    }
+
+    // Kernels that know recvmsg but not its multishot flavour fail the
+    // request as it is submitted; a completion still to come is a packet
+    struct io_uring_cqe *cqe = uring_peek_cqe(&rx.ring);
+    if (cqe != NULL && cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE)) {
+        errno = -cqe->res;
+        goto failure;
+    }
+
+    // Completions now signal new packets; the socket itself is drained by
+    // the kernel and would only cause spurious wakeups. It is left in until
+    // the ring is, so a failure here leaves recvfrom() with a socket to poll;
+    // closing the ring takes it out of the epoll set again.
+    if (ctroller.epoll >= 0) {
+        if (ctroller_epoll_add(rx.ring.fd, CTROLLER_EVENT_PACKETS) < 0 ||
+            epoll_ctl(ctroller.epoll, EPOLL_CTL_DEL, ctroller.socket, NULL) <
+                0) {
+            goto failure;
+        }
+    }
+
+    return 0;
+
+failure:
+    ctroller_uring_exit();
+    return -1;
+}
+
+void ctroller_uring_exit(void)
+{
+    // The receive holds on to the socket until it completes, and the ring is
+    // torn down in the background; without cancelling it first, the port
+    // would stay bound for a while after the socket is closed
+    struct io_uring_sqe *sqe;
+    if (rx.armed && (sqe = uring_get_sqe(&rx.ring)) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr   = URING_RECV_TAG;
+
+        while (rx.armed && uring_enter(&rx.ring, 1) >= 0) {
+            struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek_cqe(&rx.ring)) != NULL) {
+                if (cqe->user_data == URING_RECV_TAG &&
+                    !(cqe->flags & IORING_CQE_F_MORE)) {
+                    rx.armed = 0;
+                }
+                uring_cqe_seen(&rx.ring);
+            }
+        }
+    }
+
+    uring_buf_ring_exit(&rx.buf_ring, &rx.ring);
+    uring_exit(&rx.ring);
+    rx.armed = 0;
+}
+
+int ctroller_poll_hid_uring(void)
+{
+    int count = 0;
+    struct io_uring_cqe *cqe;
+    unsigned drained;
+
+    do {
+        if (uring_peek_cqe(&rx.ring) == NULL) {
+            // Only enter the kernel once everything queued has been consumed.
+            if (!rx.armed) {
+                if (ctroller_uring_arm() < 0 || uring_enter(&rx.ring, 0) < 0) {
+                    perror("Error re-arming receive");
+                    return -1;
+                }
+            }
+
+            // The ring becomes readable as soon as a completion is posted
+            int res = ctroller_wait();
+            if (res <= 0) {
+                return res;
+            }
+            ctroller_stats.recv_calls++;
+        } else {
+            ctroller.now = ctroller_clock();
+        }
+
+        // A batch at a time, the most the burst has room for
+        for (drained = 0; drained < CTROLLER_BATCH_SIZE &&
+                          (cqe = uring_peek_cqe(&rx.ring)) != NULL;
+             drained++) {
+            int res        = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&rx.ring);
+
+            if (!(flags & IORING_CQE_F_MORE)) {
+                rx.armed = 0;
+            }
+
+            if (res < 0) {
+                // Running out of buffers only ends the multishot request; it
+                // is re-armed once the buffers below have been recycled.
+                if (res != -ENOBUFS) {
+                    fprintf(stderr,
+                            "Error receiving packet: %s\n",
+                            strerror(-res));
+                    return -1;
+                }
+                continue;
+            }
+
+            if (!(flags & IORING_CQE_F_BUFFER)) {
+                continue;
+            }
+
+            uint16_t bid                     = flags >> IORING_CQE_BUFFER_SHIFT;
+            unsigned char *buffer            = rx.buffers[bid];
+            struct io_uring_recvmsg_out *out = (void *) buffer;
+            unsigned char *name              = buffer + sizeof(*out);
+            unsigned char *control           = name + rx.msg.msg_namelen;
+            unsigned char *packet = control + rx.msg.msg_controllen;
+            struct msghdr cmsgs   = {
+                  .msg_control    = control,
+                  .msg_controllen = out->controllen,
+            };
+
+            // payloadlen is that of the whole datagram; a truncated one only
+            // has as much as fit into the buffer, like recvmsg() returns
+            size_t len  = out->payloadlen;
+            size_t room = URING_BUFFER_SIZE - (packet - buffer);
+            if (len > room) {
+                len = room;
+            }
+
+            ctroller_stats.packets++;
+            count++;
+            ctroller_ingest(packet,
+                            len,
+                            (struct sockaddr *) name,
+                            out->namelen,
+                            ctroller_rx_time(&cmsgs),
+                            1);
+            uring_buf_ring_add(&rx.buf_ring, buffer, URING_BUFFER_SIZE, bid);
+        }
+    } while (ctroller.burst_count == 0);
+
+    ctroller_flush_burst();
+    return count;
+}
+
+/* Writes in flight on the output ring. Each one owns a copy of the events,
+ * as the device buffers are refilled by the next state before the kernel
+ * gets around to some writes.
+ */
+#define OUTPUT_SLOTS 64
+
+static __thread struct {
+    struct uring ring;
+    uint64_t free;
+    unsigned queued;
+    struct {
+        struct device_context *dev;
+        const char *errmsg;
+        size_t len;
+        struct input_event events[DEVICE_EVENTS_MAX];
+    } slots[OUTPUT_SLOTS];
+} tx = {
+    .ring = {.fd = -1},
+};
+
+_Static_assert(OUTPUT_SLOTS <= 64, "free slots must fit into a uint64_t");
+
+/* Take in the completions of finished writes, waiting for at least wait_nr */
+static void ctroller_output_reap(unsigned wait_nr)
+{
+    struct io_uring_cqe *cqe;
+
+    if (wait_nr > 0 || tx.queued > 0) {
+        if (uring_enter(&tx.ring, wait_nr) < 0 && errno != EINTR) {
+            perror("Error submitting device writes");
+        }
+        tx.queued = 0;
+    }
+
+    while ((cqe = uring_peek_cqe(&tx.ring)) != NULL) {
+        unsigned index = cqe->user_data;
+        int res        = cqe->res;
+        uring_cqe_seen(&tx.ring);
+
+        struct device_context *dev = tx.slots[index].dev;
+        size_t events = tx.slots[index].len / sizeof(struct input_event);
+        if (res < 0) {
+            fprintf(stderr, "%s: %s\n", tx.slots[index].errmsg, strerror(-res));
+            device_stats.write_errors++;
+            device_stats.events -= events;
+            dev->shadow_valid = 0;
+        } else if ((size_t) res < tx.slots[index].len) {
+            fprintf(stderr,
+                    "%s: short write (%d of %zu bytes)\n",
+                    tx.slots[index].errmsg,
+                    res,
+                    tx.slots[index].len);
+            device_stats.short_writes++;
+            device_stats.events -= events;
+            dev->shadow_valid = 0;
+        }
+
+        tx.free |= 1ull << index;
+    }
+}
+
+/* device_call_submit that prepares a write on the output ring. The writes of
+ * all devices are submitted together by ctroller_output_submit().
+ */
+static ssize_t ctroller_output_queue(struct device_context *dev,
+                                     const char *errmsg)
+{
+    if (tx.free == 0) {
+        ctroller_output_reap(1);
+    }
+
+    unsigned index = __builtin_ctzll(tx.free);
+    size_t len     = dev->count * sizeof(struct input_event);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&tx.ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    tx.free &= ~(1ull << index);
+    tx.slots[index].dev    = dev;
+    tx.slots[index].errmsg = errmsg;
+    tx.slots[index].len    = len;
+    memcpy(tx.slots[index].events, dev->events, len);
+
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = dev->fd;
+    sqe->addr      = (uintptr_t) tx.slots[index].events;
+    sqe->len       = len;
+    sqe->off       = (uint64_t) -1;
+    sqe->user_data = index;
+
+    tx.queued++;
+    return len;
+}
+
+/* Submit the writes prepared for a state in a single kernel entry */
+static void ctroller_output_submit(void)
+{
+    if (tx.queued > 0) {
+        ctroller_output_reap(0);
+    }
+}
+
+int ctroller_output_uring_init(void)
+{
+    // Completions may lag behind by a full set of slots
+    if (uring_init(&tx.ring, OUTPUT_SLOTS, 0) < 0) {
+        return -1;
+    }
+
+    tx.free   = ~0ull >> (64 - OUTPUT_SLOTS);
+    tx.queued = 0;
+    device_set_submit(ctroller_output_queue);
+    return 0;
+}
+
+void ctroller_output_uring_exit(void)
+{
+    if (tx.ring.fd < 0) {
+        return;
+    }
+
+    device_set_submit(NULL);
+
+    // The slots, and the devices they point to, must outlive their writes
+    unsigned inflight = OUTPUT_SLOTS - __builtin_popcountll(tx.free);
+    while (inflight > 0) {
+        ctroller_output_reap(1);
+        inflight = OUTPUT_SLOTS - __builtin_popcountll(tx.free);
+    }
+
+    uring_exit(&tx.ring);
+}
+
+inline void *ctroller_unpack_int16_t(unsigned char *buf, int16_t *val)
+{
+    *val = (int16_t) ntohs(*(uint16_t *) buf);
+    return buf + sizeof(int16_t);
+}
+
+inline void *ctroller_unpack_uint16_t(unsigned char *buf, uint16_t *val)
+{
+    *val = ntohs(*(uint16_t *) buf);
+    return buf + sizeof(uint16_t);
+}
+
+inline void *ctroller_unpack_uint32_t(unsigned char *buf, uint32_t *val)
+{
+    *val = ntohl(*(uint32_t *) buf);
+    return buf + sizeof(uint32_t);
+}
+
+inline int ctroller_unpack_hid_info(unsigned char *sendbuf,
+                                    size_t len,
+                                    struct hidinfo *hid)
+{
+    uint16_t magic;
+    unsigned char *unpack = sendbuf;
+    if (len < PACKET_REV0_SIZE) {
+        return -1;
+    }
+
+    unpack = ctroller_unpack_uint16_t(unpack, &magic);
+    if (magic != PACKET_MAGIC) {
+        fprintf(stderr, "Invalid package header (%#08x).\n", magic);
+        return -1;
+    }
+
+    unpack = ctroller_unpack_uint16_t(unpack, &hid->version);
+
+    switch (PACKET_REVISION(hid->version)) {
+    case 0:
+        hid->sequence = 0;
+        break;
+    case 1:
+        if (len < PACKET_REV1_SIZE) {
+            return -1;
+        }
+        unpack = ctroller_unpack_uint32_t(unpack, &hid->sequence);
+        break;
+    default:
+        return -1;
+    }
+
+    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.up);
+    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.down);
+    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.held);
+
+    unpack = ctroller_unpack_uint16_t(unpack, &hid->touchscreen.px);
+    unpack = ctroller_unpack_uint16_t(unpack, &hid->touchscreen.py);
+
+    unpack = ctroller_unpack_int16_t(unpack, &hid->circlepad.dx);
+    unpack = ctroller_unpack_int16_t(unpack, &hid->circlepad.dy);
+
+    unpack = ctroller_unpack_int16_t(unpack, &hid->cstick.dx);
+    unpack = ctroller_unpack_int16_t(unpack, &hid->cstick.dy);
+
+    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.x);
+    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.y);
+    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.z);
+
+    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.x);
+    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.y);
+    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.z);
+
+    return unpack - sendbuf;
+}
+
+/* Write a state to every device the session has open */
+static void ctroller_write_devices(struct session *session,
+                                   struct hidinfo *hid)
+{
+    for (size_t i = 0; i < arrsize(session->devices); i++) {
+        struct device_context *dev = &session->devices[i];
+        if (dev->fd != -1) {
+            dev->write(dev, hid);
+        }
+    }
+}
+
+static void ctroller_ramp_get(const struct hidinfo *hid,
+                              int32_t values[SESSION_RAMP_AXES])
+{
+    values[0] = hid->circlepad.dx;
+    values[1] = hid->circlepad.dy;
+    values[2] = hid->cstick.dx;
+    values[3] = hid->cstick.dy;
+    values[4] = hid->touchscreen.px;
+    values[5] = hid->touchscreen.py;
+}
+
+static void ctroller_ramp_set(struct hidinfo *hid,
+                              const int32_t values[SESSION_RAMP_AXES])
+{
+    hid->circlepad.dx   = values[0];
+    hid->circlepad.dy   = values[1];
+    hid->cstick.dx      = values[2];
+    hid->cstick.dy      = values[3];
+    hid->touchscreen.px = values[4];
+    hid->touchscreen.py = values[5];
+}
+
+/* Period of the output timer: the output rate, or with only prediction, the
+ * packet interval, to write predicted states into the gaps of lost packets
+ */
+static uint64_t ctroller_tick_period(void)
+{
+    return ctroller_output_period != 0 ? ctroller_output_period
+                                       : PREDICT_FRAME_US * 1000ull;
+}
+
+static void ctroller_arm_ticker(int armed)
+{
+    struct itimerspec spec = {};
+    if (armed) {
+        spec.it_value.tv_sec  = ctroller_tick_period() / 1000000000;
+        spec.it_value.tv_nsec = ctroller_tick_period() % 1000000000;
+        spec.it_interval      = spec.it_value;
+    }
+
+    if (timerfd_settime(ctroller.ticker, 0, &spec, NULL) < 0) {
+        perror("Error arming output timer");
+        return;
+    }
+    ctroller.ticker_armed = armed;
+}
+
+/* Take over a new target state of the session: everything but the analog
+ * values is written as is, those start moving from where the output is
+ * towards the new ones, over about as long as the state took to arrive.
+ */
+static struct hidinfo *ctroller_upsample(struct session *session,
+                                         const struct hidinfo *target)
+{
+    struct session_ramp *ramp = &session->ramp;
+    struct hidinfo *output    = &session->output;
+    int32_t from[SESSION_RAMP_AXES];
+
+    ctroller_ramp_get(output, from);
+    ctroller_ramp_get(target, ramp->to);
+
+    uint64_t span = ctroller.now - ramp->last;
+    if (ramp->last == 0) {
+        // Nothing to start from
+        memcpy(from, ramp->to, sizeof(from));
+    } else if (!(output->keys.held & target->keys.held & HID_KEY_TOUCH)) {
+        // A touch that just started or ended is no movement
+        from[4] = ramp->to[4];
+        from[5] = ramp->to[5];
+    }
+
+    if (span < ctroller_output_period) {
+        span = ctroller_output_period;
+    } else if (span > CTROLLER_UPSAMPLE_SPAN_MAX_MS * 1000000ull) {
+        span = CTROLLER_UPSAMPLE_SPAN_MAX_MS * 1000000ull;
+    }
+
+    memcpy(ramp->from, from, sizeof(from));
+    ramp->start  = ctroller.now;
+    ramp->span   = span;
+    ramp->last   = ctroller.now;
+    ramp->active = memcmp(from, ramp->to, sizeof(from)) != 0;
+
+    *output = *target;
+    ctroller_ramp_set(output, from);
+
+    if (ramp->active && !ctroller.ticker_armed) {
+        ctroller_arm_ticker(1);
+    }
+    return output;
+}
+
+/* Move the analog values of a session with a ramp under way one step on.
+ * Returns whether there are steps left.
+ */
+static int ctroller_step(struct session *session)
+{
+    struct session_ramp *ramp = &session->ramp;
+    int32_t values[SESSION_RAMP_AXES];
+
+    uint64_t elapsed = ctroller.now - ramp->start;
+    if (elapsed >= ramp->span) {
+        memcpy(values, ramp->to, sizeof(values));
+        ramp->active = 0;
+    } else {
+        for (unsigned k = 0; k < SESSION_RAMP_AXES; k++) {
+            int64_t delta = ramp->to[k] - ramp->from[k];
+            values[k]     = ramp->from[k] + delta * (int64_t) elapsed /
+                                            (int64_t) ramp->span;
+        }
+    }
+
+    // Edges went out with the state itself
+    session->output.keys.down = 0;
+    session->output.keys.up   = 0;
+    ctroller_ramp_set(&session->output, values);
+    ctroller_write_devices(session, &session->output);
+    ctroller_stats.interpolated++;
+
+    return ramp->active;
+}
+
+/* Keep extrapolating the predicted axes of a session whose packets stopped
+ * coming, for up to PREDICT_GAP_MAX_MS, then go back to the last state
+ * received. Returns whether it may still need to.
+ */
+static int ctroller_conceal(struct session *session)
+{
+    if (!session->devices_open || session->predict.last == 0) {
+        return 0;
+    }
+
+    uint64_t gap = ctroller.now - session->predict.last;
+    // Half an interval late counts as lost
+    if (gap < PREDICT_FRAME_US * 1500ull) {
+        return 1;
+    }
+
+    struct hidinfo *state = &session->predicted;
+    *state                = session->hid;
+    state->keys.down      = 0;
+    state->keys.up        = 0;
+
+    int concealing =
+        gap <= (PREDICT_GAP_MAX_MS + PREDICT_FRAME_US / 1000) * 1000000ull;
+    if (concealing) {
+        uint64_t at = ctroller.now + ctroller_horizon;
+        predict_apply(&session->predict, state, at);
+        predict_stats.concealed++;
+    } else {
+        // The next packet starts a new estimate
+        session->predict.last = 0;
+    }
+
+    // The next ramp starts from here
+    if (ctroller_output_period != 0) {
+        session->output = *state;
+        state           = &session->output;
+    }
+    ctroller_write_devices(session, state);
+    return concealing;
+}
+
+static void ctroller_tick(void)
+{
+    uint64_t expirations;
+    if (read(ctroller.ticker, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+        perror("Error reading output timer");
+    }
+
+    int active = 0;
+    for (size_t i = 0; i < SESSIONS_MAX; i++) {
+        struct session *session = &ctroller.sessions.slots[i];
+        if (session->ramp.active) {
+            active |= ctroller_step(session);
+        } else if (ctroller_horizon != 0) {
+            active |= ctroller_conceal(session);
+        }
+    }
+    ctroller_output_submit();
+
+    if (!active) {
+        ctroller_arm_ticker(0);
+    }
+}
+
+/* Count the time from the arrival of a packet until now into the histogram */
+static void ctroller_record_latency(uint64_t timestamp)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    uint64_t us  = (now > timestamp) ? (now - timestamp) / 1000 : 0;
+
+    unsigned bucket = 0;
+    while (us != 0 && bucket < CTROLLER_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    ctroller_stats.latency[bucket]++;
+}
+
+int ctroller_write_hid_info(struct session *session)
+{
+    // Not before there is a state to write; a client that only says hello
+    // does not get any devices. Without them, the state waits for the next.
+    if (!session->devices_open &&
+        session_devices_open(&ctroller.sessions,
+                             session,
+                             ctroller.uinput_device,
+                             ctroller.device_mask,
+                             ctroller_clock()) < 0) {
+        return -1;
+    }
+
+    struct hidinfo *state = &session->hid;
+    if (ctroller_horizon != 0) {
+        uint64_t at = ctroller.now + ctroller_horizon;
+
+        session->predicted = session->hid;
+        predict_apply(&session->predict, &session->predicted, at);
+        state = &session->predicted;
+
+        if (!ctroller.ticker_armed) {
+            ctroller_arm_ticker(1);
+        }
+    }
+    if (ctroller_output_period != 0) {
+        state = ctroller_upsample(session, state);
+    }
+    ctroller_write_devices(session, state);
+    ctroller_output_submit();
+
+    if (session->hid.timestamp != 0) {
+        ctroller_record_latency(session->hid.timestamp);
+    }
+    return 0;
+}
+
+/* Upper bound in microseconds of the bucket holding the given share, in
+ * thousandths, of all recorded latencies
+ */
+static unsigned long ctroller_latency_quantile(unsigned long total,
+                                               unsigned permille)
+{
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < CTROLLER_LATENCY_BUCKETS; i++) {
+        seen += ctroller_stats.latency[i];
+        if (seen * 1000 >= total * permille) {
+            return 1ul << i;
+        }
+    }
+    return 1ul << (CTROLLER_LATENCY_BUCKETS - 1);
+}
+
+static void ctroller_print_latency(void)
+{
+    unsigned long total = 0;
+    for (unsigned i = 0; i < CTROLLER_LATENCY_BUCKETS; i++) {
+        total += ctroller_stats.latency[i];
+    }
+    if (total == 0) {
+        return;
+    }
+
+    printf("Receive to write latency of %lu states:\n", total);
+    for (unsigned i = 0; i < CTROLLER_LATENCY_BUCKETS; i++) {
+        if (ctroller_stats.latency[i] != 0) {
+            printf("  < %8lu us: %lu\n", 1ul << i, ctroller_stats.latency[i]);
+        }
+    }
+    printf("  p50 < %lu us, p99 < %lu us, p99.9 < %lu us\n",
+           ctroller_latency_quantile(total, 500),
+           ctroller_latency_quantile(total, 990),
+           ctroller_latency_quantile(total, 999));
+}
+
+void ctroller_print_stats(void)
+{
+    printf("Received %lu packets in %lu receive calls, %lu coalesced, "
+           "%lu malformed, %lu late, %lu duplicate, %lu unresolved, "
+           "%lu recovered, %lu released, %lu removed, %lu interpolated; "
+           "%u dropped in the kernel.\n",
+           ctroller_stats.packets,
+           ctroller_stats.recv_calls,
+           ctroller_stats.coalesced,
+           ctroller_stats.malformed,
+           ctroller_stats.late,
+           ctroller_stats.duplicate,
+           ctroller_stats.unresolved,
+           ctroller_stats.recovered,
+           ctroller_stats.released,
+           ctroller_stats.removed,
+           ctroller_stats.interpolated,
+           ctroller_filter_drops());
+    printf("Wrote %lu input events and %lu HID reports; skipped %lu unchanged "
+           "events and %lu writes without changes; %lu writes failed, %lu "
+           "were short, %lu were split.\n",
+           device_stats.events,
+           device_stats.reports,
+           device_stats.events_skipped,
+           device_stats.writes_skipped,
+           device_stats.write_errors,
+           device_stats.short_writes,
+           device_stats.split_writes);
+    printf("Kept %lu motion events back outside the gate, %lu within the "
+           "threshold and %lu over the rate.\n",
+           motion_stats.gated,
+           motion_stats.hysteresis,
+           motion_stats.rate);
+    printf("Fed %lu packets to the predictor and wrote %lu predicted states "
+           "into gaps.\n",
+           predict_stats.updates,
+           predict_stats.concealed);
+
+    if (ctroller.flags & CTROLLER_LATENCY) {
+        ctroller_print_latency();
+    }
+}
+
+/* Touch every page of a buffer so that it is backed before the first packet */
+static void ctroller_prefault_range(void *buf, size_t len)
+{
+    volatile unsigned char *bytes = buf;
+    long page                     = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < len; i += page) {
+        bytes[i] = bytes[i];
+    }
+    if (len > 0) {
+        bytes[len - 1] = bytes[len - 1];
+    }
+}
+
+void ctroller_prefault(void)
+{
+    unsigned char stack[CTROLLER_PREFAULT_STACK];
+
+    ctroller_prefault_range(&ctroller, sizeof(ctroller));
+    ctroller_prefault_range(&ctroller_stats, sizeof(ctroller_stats));
+    ctroller_prefault_range(&batch, sizeof(batch));
+    ctroller_prefault_range(&rx, sizeof(rx));
+
+    // Grow the stack to what the receive path may need, now rather than on
+    // a page fault in the middle of a packet
+    memset(stack, 0, sizeof(stack));
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+void ctroller_exit()
+{
+    ctroller_output_uring_exit();
+    ctroller_print_stats();
+    ctroller_uring_exit();
+
+    close(ctroller.socket);
+    ctroller.socket = -1;
+
+    if (ctroller.epoll >= 0) {
+        close(ctroller.epoll);
+        ctroller.epoll = -1;
+    }
+    if (ctroller.timer >= 0) {
+        close(ctroller.timer);
+        ctroller.timer = -1;
+    }
+    if (ctroller.ticker >= 0) {
+        close(ctroller.ticker);
+        ctroller.ticker = -1;
+    }
+
+    session_close_all(&ctroller.sessions);
+
     return;
 }
@@ -12,6 +12,17 @@
 #include <linux/input.h>
 #include <linux/uinput.h>
 
+_Static_assert(DEVICE_EVENTS_MAX <= 64, "shadow mask too small");
+
+__thread struct device_stats device_stats;
+
+static __thread device_call_submit *device_submit;
+
+void device_set_submit(device_call_submit *submit)
+{
+    device_submit = submit;
+}
+
 int device_open(const char *uinput_device)
 {
     int uinputfd;
@@ -89,3 +100,103 @@ int device_create(int uinputfd, const struct uinput_user_dev *dev)
     }
     return uinputfd;
 }
+
+void device_emit(struct device_context *dev,
+                 unsigned slot,
+                 uint16_t type,
+                 uint16_t code,
+                 int32_t value)
+{
+    // A slot past the shadow copy is written every time, rather than tracked
+    // out of bounds
+    if (slot >= DEVICE_EVENTS_MAX) {
+        device_queue(dev, type, code, value);
+        return;
+    }
+
+    if ((dev->shadow_valid & (1ull << slot)) && dev->shadow[slot] == value) {
+        device_stats.events_skipped++;
+        return;
+    }
+
+    device_queue(dev, type, code, value);
+
+    dev->shadow[slot] = value;
+    dev->shadow_valid |= 1ull << slot;
+}
+
+void device_queue(struct device_context *dev,
+                  uint16_t type,
+                  uint16_t code,
+                  int32_t value)
+{
+    // Only the SYN_REPORT left room for; write what there is, so that the
+    // rest follows in a report of its own rather than past the buffer
+    if (dev->count >= DEVICE_EVENTS_MAX - 1) {
+        device_stats.split_writes++;
+        device_flush(dev, "Error writing events");
+    }
+
+    struct input_event *event = &dev->events[dev->count++];
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
+}
+
+ssize_t device_flush(struct device_context *dev, const char *errmsg)
+{
+    if (dev->count == 0) {
+        device_stats.writes_skipped++;
+        return 0;
+    }
+
+    struct input_event *event = &dev->events[dev->count++];
+    event->type  = EV_SYN;
+    event->code  = SYN_REPORT;
+    event->value = 0;
+
+    size_t len = dev->count * sizeof(struct input_event);
+    ssize_t res;
+    if (device_submit != NULL) {
+        res = device_submit(dev, errmsg);
+    } else {
+        res = write(dev->fd, dev->events, len);
+    }
+
+    if (res < 0) {
+        perror(errmsg);
+        device_stats.write_errors++;
+        // Whatever did not make it has to be sent again next time
+        dev->shadow_valid = 0;
+    } else if ((size_t) res < len) {
+        device_stats.short_writes++;
+        dev->shadow_valid = 0;
+    } else {
+        device_stats.events += dev->count;
+    }
+
+    dev->count = 0;
+    return res;
+}
+
+void device_destroy(struct device_context *dev)
+{
+    if (dev->fd != -1) {
+        ioctl(dev->fd, UI_DEV_DESTROY);
+        close(dev->fd);
+        dev->fd = -1;
+    }
+}
+
+int device_recreate(struct device_context *dev)
+{
+    device_destroy(dev);
+
+    dev->count        = 0;
+    dev->shadow_valid = 0;
+    dev->layout       = NULL;
+    dev->reported     = NULL;
+
+    dev->fd = dev->create(dev, dev->uinput_device);
+    return dev->fd;
+}
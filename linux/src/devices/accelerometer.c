@@ -1,5 +1,6 @@
 #include "devices.h"
 #include "hid.h"
+#include "motion.h"
 
 #include <stdio.h>
 
@@ -38,14 +39,18 @@ static const uint16_t axis[] = {
 
 #define NUMEVENTS (arrsize(axis) + 1)
 
-struct device_context device_accelerometer = {
-    -1,
-    accelerometer_write,
-    accelerometer_create,
+const struct device_context device_accelerometer = {
+    .fd     = -1,
+    .write  = accelerometer_write,
+    .create = accelerometer_create,
 };
 
-int accelerometer_create(const char *uinput_device)
+_Static_assert(NUMEVENTS <= DEVICE_EVENTS_MAX, "event buffer too small");
+
+int accelerometer_create(struct device_context *dev, const char *uinput_device)
 {
+    (void) dev;
+
     int uinputfd = device_open(uinput_device);
     if (uinputfd < 0) {
         goto failure_noclose;
@@ -71,35 +76,33 @@ failure_noclose:
     return -1;
 }
 
-int accelerometer_write(int uinputfd, struct hidinfo *hid)
+static unsigned accelerometer_emit(struct device_context *dev,
+                                   unsigned slot,
+                                   const uint16_t *axis,
+                                   const struct hidinfo *hid)
 {
-    int res;
-    static struct input_event events[NUMEVENTS];
-    size_t i = 0;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_X;
-    events[i].value = hid->accel.x;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Y;
-    events[i].value = hid->accel.y;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Z;
-    events[i].value = hid->accel.z;
-    i++;
-
-    events[i].type  = EV_SYN;
-    events[i].code  = SYN_REPORT;
-    events[i].value = 0;
-    i++;
-
-    res = write(uinputfd, events, i * sizeof(struct input_event));
-    if (res < 0) {
-        perror("Error writing accelerometer events");
+    int32_t values[3] = {hid->accel.x, hid->accel.y, hid->accel.z};
+
+    if (motion_filter(dev, DEVICE_ACCELEROMETER, slot, hid, values)) {
+        device_emit(dev, slot + 0, EV_ABS, axis[0], values[0]);
+        device_emit(dev, slot + 1, EV_ABS, axis[1], values[1]);
+        device_emit(dev, slot + 2, EV_ABS, axis[2], values[2]);
     }
-    return res;
+
+    return slot + 3;
+}
+
+const struct device_part device_accelerometer_part = {
+    .keys       = NULL,
+    .keys_count = 0,
+    .axis       = axis,
+    .axis_count = arrsize(axis),
+    .ranges     = &accelerometer,
+    .emit       = accelerometer_emit,
+};
+
+int accelerometer_write(struct device_context *dev, struct hidinfo *hid)
+{
+    accelerometer_emit(dev, 0, axis, hid);
+    return device_flush(dev, "Error writing accelerometer events");
 }
@@ -0,0 +1,146 @@
+#include "devices.h"
+#include "hid.h"
+
+#include <stdio.h>
+
+#include <unistd.h>
+
+#include <linux/uinput.h>
+
+/* Codes the axes of each part are reported under. The gamepad keeps its own,
+ * which depend on the keymap; the others, which use ABS_X and friends on
+ * their own devices, move to auxiliary axes the keymap cannot use.
+ *
+ * The gamepad part is described by the keymap; see gamepad_part().
+ */
+static const uint16_t touchscreen_axis[] = {
+    ABS_HAT1X, ABS_HAT1Y,
+};
+
+static const uint16_t gyroscope_axis[] = {
+    ABS_RZ, ABS_THROTTLE, ABS_RUDDER,
+};
+
+static const uint16_t accelerometer_axis[] = {
+    ABS_WHEEL, ABS_GAS, ABS_BRAKE,
+};
+
+static const uint16_t orientation_axis[] = {
+    ABS_TILT_X, ABS_TILT_Y, ABS_VOLUME,
+};
+
+static const struct {
+    const struct device_part *part;
+    const uint16_t *axis;
+} parts[DEVICES_COUNT] = {
+    [DEVICE_GAMEPAD]       = {NULL, NULL},
+    [DEVICE_TOUCHSCREEN]   = {&device_touchscreen_part, touchscreen_axis},
+    [DEVICE_GYROSCOPE]     = {&device_gyroscope_part, gyroscope_axis},
+    [DEVICE_ACCELEROMETER] = {&device_accelerometer_part, accelerometer_axis},
+    [DEVICE_ORIENTATION]   = {&device_orientation_part, orientation_axis},
+};
+
+const struct device_context device_composite = {
+    .fd     = -1,
+    .write  = composite_write,
+    .create = composite_create,
+};
+
+static const struct device_part *composite_part(struct device_context *dev,
+                                                size_t i)
+{
+    return parts[i].part ? parts[i].part : gamepad_part(dev);
+}
+
+int composite_create(struct device_context *dev, const char *uinput_device)
+{
+    struct uinput_user_dev composite = {
+        .name = "Nintendo 3DS",
+        .id =
+            {
+                .vendor  = 0x057e,
+                .product = 0x0400,
+                .version = 1,
+                .bustype = BUS_VIRTUAL,
+            },
+    };
+    size_t slots = 0;
+
+    int uinputfd = device_open(uinput_device);
+    if (uinputfd < 0) {
+        goto failure_noclose;
+    }
+
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        if (!(dev->parts & (1 << i))) {
+            continue;
+        }
+        const struct device_part *part = composite_part(dev, i);
+        const uint16_t *axis = parts[i].axis ? parts[i].axis : part->axis;
+
+        ssize_t res;
+        if (part->keys_count > 0) {
+            res = device_register_keys(uinputfd, part->keys, part->keys_count);
+            if (res != (ssize_t) part->keys_count) {
+                goto failure;
+            }
+        }
+
+        res = device_register_absaxis(uinputfd, axis, part->axis_count);
+        if (res != (ssize_t) part->axis_count) {
+            goto failure;
+        }
+
+        for (size_t k = 0; k < part->axis_count; k++) {
+            uint16_t own               = part->axis[k];
+            composite.absmin[axis[k]]  = part->ranges->absmin[own];
+            composite.absmax[axis[k]]  = part->ranges->absmax[own];
+            composite.absflat[axis[k]] = part->ranges->absflat[own];
+            composite.absfuzz[axis[k]] = part->ranges->absfuzz[own];
+        }
+
+        slots += part->keys_count + part->axis_count;
+    }
+
+    // Every key and axis has a slot, and the SYN_REPORT needs room as well
+    if (slots >= DEVICE_EVENTS_MAX) {
+        fprintf(stderr,
+                "Composite device would report %zu events, at most %d fit "
+                "into a write; leave out a device or map fewer events.\n",
+                slots,
+                DEVICE_EVENTS_MAX - 1);
+        goto failure;
+    }
+
+    if (device_create(uinputfd, &composite) < 0) {
+        goto failure;
+    }
+
+    return uinputfd;
+
+failure:
+    close(uinputfd);
+failure_noclose:
+    fprintf(stderr, "Failed to initialize composite device.\n");
+    return -1;
+}
+
+int composite_write(struct device_context *dev, struct hidinfo *hid)
+{
+    unsigned slot = 0;
+
+    if ((dev->parts & (1 << DEVICE_GAMEPAD)) && gamepad_refresh(dev) > 0 &&
+        device_recreate(dev) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        if (dev->parts & (1 << i)) {
+            const struct device_part *part = composite_part(dev, i);
+            slot = part->emit(
+                dev, slot, parts[i].axis ? parts[i].axis : part->axis, hid);
+        }
+    }
+
+    return device_flush(dev, "Error writing composite events");
+}
@@ -1,12 +1,19 @@
 #include "devices.h"
 #include "hid.h"
+#include "keymap.h"
+#include "stick.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <linux/uinput.h>
 
+/* Ranges of the sticks, see STICK_RANGE; each layout adds those of its
+ * keymap's axes
+ */
 static const struct uinput_user_dev gamepad = {
     .name = "Nintendo 3DS",
     .id =
@@ -38,64 +45,11 @@ static const struct uinput_user_dev gamepad = {
     .absmax[ABS_RY]  = 0x9c,
     .absflat[ABS_RY] = 10,
     .absfuzz[ABS_RY] = 3,
-    
-    // Analogue DPAD
-    .absmin[ABS_HAT0X] = -1,
-    .absmax[ABS_HAT0X] = 1,
-    .absflat[ABS_HAT0X] = 0,
-    .absfuzz[ABS_HAT0X] = 0,
-    
-    .absmin[ABS_HAT0Y] = -1,
-    .absmax[ABS_HAT0Y] = 1,
-    .absflat[ABS_HAT0Y] = 0,
-    .absfuzz[ABS_HAT0Y] = 0,
 };
 
-static uint16_t keys[] = {
-    BTN_SOUTH,
-    BTN_EAST,
-    BTN_NORTH,
-    BTN_WEST,
-    
-    BTN_START,
-    BTN_SELECT,
-
-    BTN_TL,
-    BTN_TR,
-    
-    BTN_TL2,
-    BTN_TR2,
-
-    // We now send analogue dpad signals, instead of digital, due to a bug in android.
-//    BTN_DPAD_UP,
-//    BTN_DPAD_DOWN,
-//    BTN_DPAD_LEFT,
-//    BTN_DPAD_RIGHT,
-};
-
-static const uint32_t keymasks[] = {
-    HID_KEY_A,
-    HID_KEY_B,
-    HID_KEY_X,
-    HID_KEY_Y,
-
-    HID_KEY_START,
-    HID_KEY_SELECT,
-
-    HID_KEY_L,
-    HID_KEY_R,
-    
-    HID_KEY_ZL,
-    HID_KEY_ZR,
-
-    // We now send analogue dpad signals, instead of digital, due to a bug in android.
-//    HID_KEY_DUP,
-//    HID_KEY_DDOWN,
-//    HID_KEY_DLEFT,
-//    HID_KEY_DRIGHT,
-};
+#define STICK_AXES 4
 
-static const uint16_t axis[] = {
+static const uint16_t stick_axis[STICK_AXES] = {
     // Circlepad
     ABS_X,
     ABS_Y,
@@ -103,116 +57,188 @@ static const uint16_t axis[] = {
     // C-Stick
     ABS_RX,
     ABS_RY,
-    
-    // DPAD
-    ABS_HAT0X,
-    ABS_HAT0Y,
 };
 
-#define NUMEVENTS (arrsize(keys) + arrsize(axis) + 1)
+/* What a gamepad registers to report a keymap. A layout never changes once
+ * published; reloading the keymap publishes a new one.
+ */
+struct gamepad_layout {
+    struct keymap *keymap;
+    struct gamepad_layout *replaced;
+
+    struct device_part part;
+    struct uinput_user_dev ranges;
+    uint16_t keys[KEYMAP_CHANNELS_MAX];
+
+    // The sticks come first, followed by the axes the keymap reports
+    uint16_t axis[STICK_AXES + KEYMAP_CHANNELS_MAX];
+};
+
+/* The current layout; read by every thread, only replaced by the one loading
+ * keymaps
+ */
+static struct gamepad_layout *gamepad_layout;
 
-struct device_context device_gamepad = {
-    -1,
-    gamepad_write,
-    gamepad_create,
+const struct device_context device_gamepad = {
+    .fd     = -1,
+    .write  = gamepad_write,
+    .create = gamepad_create,
 };
 
-// This function loads the keymap into memory.
-void load_keymap(const char *keymap_file_path) {
-    printf("Loading keymap from file: %s\n", keymap_file_path);
-    
-    // Opens the specified keymap file and saves the reference in a pointer
-    FILE *keymap_file = fopen(keymap_file_path, "r");
-    
-    // Here we make sure the keymap file actually exists.
-    if(keymap_file == NULL) {
-        fprintf(stderr, "Keymap file does not exist.\nReverting to default keymap.\n\n");
-        return;
+_Static_assert(STICK_AXES + KEYMAP_CHANNELS_MAX < DEVICE_EVENTS_MAX,
+               "event buffer too small");
+
+static unsigned gamepad_emit(struct device_context *dev,
+                             unsigned slot,
+                             const uint16_t *axis,
+                             const struct hidinfo *hid);
+
+int gamepad_set_keymap(struct keymap *map)
+{
+    struct gamepad_layout *layout = calloc(1, sizeof(*layout));
+    if (layout == NULL) {
+        perror("Failed to allocate gamepad layout");
+        return -1;
+    }
+
+    size_t keys_count = 0;
+    size_t axis_count = STICK_AXES;
+
+    layout->ranges = gamepad;
+    memcpy(layout->axis, stick_axis, sizeof(stick_axis));
+
+    // Shaped sticks have their deadzone already, and a round one. Two axes
+    // per stick, in the order of stick_id.
+    for (unsigned i = 0; i < STICK_AXES; i++) {
+        if (stick_tables[i / 2] != NULL) {
+            layout->ranges.absflat[stick_axis[i]] = 0;
+        }
+    }
+
+    for (unsigned i = 0; i < map->channel_count; i++) {
+        const struct keymap_channel *channel = &map->channels[i];
+        if (channel->type == EV_KEY) {
+            layout->keys[keys_count++] = channel->code;
+        } else {
+            layout->axis[axis_count++]           = channel->code;
+            layout->ranges.absmin[channel->code] = channel->min;
+            layout->ranges.absmax[channel->code] = channel->max;
+        }
+    }
+
+    layout->keymap = map;
+    layout->part   = (struct device_part){
+        .keys       = layout->keys,
+        .keys_count = keys_count,
+        .axis       = layout->axis,
+        .axis_count = axis_count,
+        .ranges     = &layout->ranges,
+        .emit       = gamepad_emit,
+    };
+
+    // Devices hold on to the layouts they were created for, so replaced ones
+    // are kept around
+    layout->replaced = gamepad_layout;
+    __atomic_store_n(&gamepad_layout, layout, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void gamepad_free_keymaps(void)
+{
+    struct gamepad_layout *layout = gamepad_layout;
+    gamepad_layout                = NULL;
+
+    while (layout != NULL) {
+        struct gamepad_layout *replaced = layout->replaced;
+        keymap_free(layout->keymap);
+        free(layout);
+        layout = replaced;
+    }
+}
+
+const struct keymap *gamepad_keymap(void)
+{
+    return __atomic_load_n(&gamepad_layout, __ATOMIC_ACQUIRE)->keymap;
+}
+
+const struct device_part *gamepad_part(struct device_context *dev)
+{
+    if (dev->layout == NULL) {
+        dev->layout   = __atomic_load_n(&gamepad_layout, __ATOMIC_ACQUIRE);
+        dev->reported = dev->layout;
     }
-    
-    /* This bit of code counts the amount of lines in the keymap file, and makes sure there are 14.
-     * It checks each character in turn, and increments "count" for every newline.
-     * The loop breaks when it hits an EOF.
-     * The stream postition indicator is then reset to the beginning of the file.
-     */
-    char c;
-    int count = 0;
-    while(1) {
-        c = fgetc(keymap_file);
-        if (c == '\n') count++;
-        if( feof(keymap_file) ) { 
-           break;
+    return &dev->layout->part;
+}
+
+static const struct keymap_channel *
+gamepad_channel(const struct keymap *map, uint16_t type, uint16_t code)
+{
+    for (unsigned i = 0; i < map->channel_count; i++) {
+        if (map->channels[i].type == type && map->channels[i].code == code) {
+            return &map->channels[i];
         }
     }
-    rewind(keymap_file);
-    if (count != arrsize(keys)) {
-    fprintf(stderr, "Keymap file has an invalaid number of lines.\nPlease make sure you have mapped every key.\nReverting to default keymap.\n\n");
-    return;
+    return NULL;
+}
+
+int gamepad_refresh(struct device_context *dev)
+{
+    const struct gamepad_layout *layout =
+        __atomic_load_n(&gamepad_layout, __ATOMIC_ACQUIRE);
+    if (layout == dev->reported) {
+        return 0;
     }
-    
-    /* This is where the keymap is actally loaded from the file into an array.
-     * Using a ton of if statements probably isn't the best way to do it, but
-     * I don't know any other way.
-     * 
-     * The file gets read line by line, and if the line matches any button, that
-     * button gets added to the keys array.
-     * 
-     * Have a look at the gamepad_write function to see why this works.
-     */
-    int i = 0;
-    char buf[8];
-    while (fgets(buf, sizeof(buf), keymap_file) != NULL) {
-        buf[strlen(buf) - 1] = '\0'; // eat the newline fgets() stores
-        
-        printf("%hu -> \0", keys[i]);
-        
-        if (strcmp(buf, "A") == 0) keys[i] = BTN_SOUTH;
-        if (strcmp(buf, "B") == 0) keys[i] = BTN_EAST;
-        if (strcmp(buf, "X") == 0) keys[i] = BTN_NORTH;
-        if (strcmp(buf, "Y") == 0) keys[i] = BTN_WEST;
-        if (strcmp(buf, "START") == 0) keys[i] = BTN_START;
-        if (strcmp(buf, "SELECT") == 0) keys[i] = BTN_SELECT;
-        if (strcmp(buf, "ZL") == 0) keys[i] = BTN_TL2;
-        if (strcmp(buf, "ZR") == 0) keys[i] = BTN_TR2;
-        if (strcmp(buf, "L") == 0) keys[i] = BTN_TL;
-        if (strcmp(buf, "R") == 0) keys[i] = BTN_TR;
-        
-        // We now send analogue dpad signals, instead of digital, due to a bug in android.
-        // This makes it harder to map the dpad buttons, I'll have to think of a way to get around this.
-//        if (strcmp(buf, "UP") == 0) keys[i] = BTN_DPAD_UP;
-//        if (strcmp(buf, "DOWN") == 0) keys[i] = BTN_DPAD_DOWN;
-//        if (strcmp(buf, "LEFT") == 0) keys[i] = BTN_DPAD_LEFT;
-//        if (strcmp(buf, "DRIGHT") == 0) keys[i] = BTN_DPAD_RIGHT;
-        
-        printf("%hu\n", keys[i]);
-        
-        i++;
+
+    const struct keymap *own = dev->layout->keymap;
+    const struct keymap *map = layout->keymap;
+
+    // Every event has to be registered, and axes with a range that fits
+    for (unsigned i = 0; i < map->channel_count; i++) {
+        const struct keymap_channel *channel = &map->channels[i];
+        const struct keymap_channel *registered =
+            gamepad_channel(own, channel->type, channel->code);
+        if (registered == NULL || channel->min < registered->min ||
+            channel->max > registered->max) {
+            printf("Keymap has new events, recreating gamepad.\n");
+            return 1;
+        }
+    }
+
+    for (unsigned i = 0; i < own->channel_count; i++) {
+        const struct keymap_channel *channel = &own->channels[i];
+        if (gamepad_channel(map, channel->type, channel->code) == NULL) {
+            device_queue(dev, channel->type, channel->code, 0);
+        }
     }
-    
-    // Now the keymap file gets closed, we don't need it any more.
-    fclose(keymap_file);
-    printf("Keymap file loaded.\n");
+
+    // Slots follow the channels of the keymap, so report every value anew
+    dev->shadow_valid = 0;
+    dev->reported     = layout;
+    return 0;
 }
 
-int gamepad_create(const char *uinput_device)
+int gamepad_create(struct device_context *dev, const char *uinput_device)
 {
     int uinputfd = device_open(uinput_device);
     if (uinputfd < 0) {
         goto failure_noclose;
     }
 
+    const struct device_part *part = gamepad_part(dev);
     int res;
-    res = device_register_keys(uinputfd, keys, arrsize(keys));
-    if (res != arrsize(keys)) {
-        goto failure;
+    if (part->keys_count > 0) {
+        res = device_register_keys(uinputfd, part->keys, part->keys_count);
+        if (res != (int) part->keys_count) {
+            goto failure;
+        }
     }
 
-    res = device_register_absaxis(uinputfd, axis, arrsize(axis));
-    if (res != arrsize(axis)) {
+    res = device_register_absaxis(uinputfd, part->axis, part->axis_count);
+    if (res != (int) part->axis_count) {
         goto failure;
     }
 
-    res = device_create(uinputfd, &gamepad);
+    res = device_create(uinputfd, part->ranges);
     if (res < 0) {
         goto failure;
     }
@@ -226,80 +252,61 @@ failure_noclose:
     return -1;
 }
 
-int gamepad_write(int uinputfd, struct hidinfo *hid)
+static unsigned gamepad_emit(struct device_context *dev,
+                             unsigned slot,
+                             const uint16_t *axis,
+                             const struct hidinfo *hid)
 {
-    int res;
-    static struct input_event events[NUMEVENTS];
-
-    /* The uinput code written is in the same index as the 3DS event code recieved
-    *  (the 3ds event codes are in the keymasks array, and the uinput ones in keys.)
-    *  This is how the keymapping can be changed from a configuration file - the
-    *  order of the keys array is changed accordingly.
-    */
-    size_t i = 0;
-    for (; i < arrsize(keys); i++) {
-        events[i].type = EV_KEY;
-        events[i].code = keys[i];
-        events[i].value =
-            HID_HAS_KEY(hid->keys.held | hid->keys.down, keymasks[i]);
-    }
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_X;
-    events[i].value = hid->circlepad.dx;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Y;
-    events[i].value = -hid->circlepad.dy;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_RX;
-    events[i].value = hid->cstick.dx;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_RY;
-    events[i].value = -hid->cstick.dy;
-    i++;
-    
-    // Here, we check if a dpad key is down, and send the corresponding analogue signal.
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_HAT0X;
-    if (HID_HAS_KEY(hid->keys.held | hid->keys.down, HID_KEY_DLEFT)) {
-        events[i].value = -1;
-    } else {
-        if (HID_HAS_KEY(hid->keys.held | hid->keys.down, HID_KEY_DRIGHT)) {
-            events[i].value = 1;
-        } else {
-            events[i].value = 0;
+    const struct keymap *keymap = dev->reported->keymap;
+    uint32_t keys                = hid->keys.held | hid->keys.down;
+
+    if (keymap->direct) {
+        // One test or lookup per event, by the keys it takes
+        for (unsigned i = 0; i < keymap->direct_buttons; i++) {
+            device_emit(dev,
+                        slot++,
+                        EV_KEY,
+                        keymap->direct_codes[i],
+                        (keys & keymap->direct_keys[i]) != 0);
+        }
+        for (unsigned i = 0; i < keymap->direct_lookup_count; i++) {
+            const struct keymap_lookup *lookup = &keymap->direct_lookups[i];
+            uint32_t state                     = keys >> lookup->shift;
+            device_emit(dev,
+                        slot++,
+                        lookup->type,
+                        lookup->code,
+                        lookup->values[state & KEYMAP_DIRECT_MASK]);
         }
-    }
-    i++;
-    
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_HAT0Y;
-    if (HID_HAS_KEY(hid->keys.held | hid->keys.down, HID_KEY_DUP)) {
-        events[i].value = -1;
     } else {
-        if (HID_HAS_KEY(hid->keys.held | hid->keys.down, HID_KEY_DDOWN)) {
-            events[i].value = 1;
-        } else {
-            events[i].value = 0;
+        uint64_t active = keymap_eval(keymap, keys);
+        for (unsigned i = 0; i < keymap->channel_count; i++) {
+            const struct keymap_channel *channel = &keymap->channels[i];
+            device_emit(dev,
+                        slot++,
+                        channel->type,
+                        channel->code,
+                        keymap_value(keymap, channel, active));
         }
     }
-    i++;
 
-    events[i].type  = EV_SYN;
-    events[i].code  = SYN_REPORT;
-    events[i].value = 0;
-    i++;
+    struct circlepos circlepad = stick_shape(STICK_CIRCLEPAD, hid->circlepad);
+    struct circlepos cstick    = stick_shape(STICK_CSTICK, hid->cstick);
 
-    res = write(uinputfd, events, i * sizeof(struct input_event));
-    if (res < 0) {
-        perror("Error writing key events");
-    }
-    return res;
+    device_emit(dev, slot++, EV_ABS, axis[0], circlepad.dx);
+    device_emit(dev, slot++, EV_ABS, axis[1], -circlepad.dy);
+    device_emit(dev, slot++, EV_ABS, axis[2], cstick.dx);
+    device_emit(dev, slot++, EV_ABS, axis[3], -cstick.dy);
+
+    return slot;
 }
 
+int gamepad_write(struct device_context *dev, struct hidinfo *hid)
+{
+    if (gamepad_refresh(dev) > 0 && device_recreate(dev) < 0) {
+        return -1;
+    }
+
+    gamepad_emit(dev, 0, stick_axis, hid);
+    return device_flush(dev, "Error writing key events");
+}
@@ -0,0 +1,115 @@
+#include "devices.h"
+#include "fusion.h"
+#include "hid.h"
+#include "motion.h"
+
+#include <stdio.h>
+
+#include <unistd.h>
+
+#include <linux/uinput.h>
+
+/* Roll, pitch and yaw in hundredths of a degree, see fusion_update() */
+static const struct uinput_user_dev orientation = {
+    .name = "Nintendo 3DS Orientation",
+    .id =
+        {
+            .vendor  = 0x057e,
+            .product = 0x0405,
+            .version = 1,
+            .bustype = BUS_VIRTUAL,
+        },
+
+    .absmin[ABS_X]  = -FUSION_ANGLE_MAX,
+    .absmax[ABS_X]  = FUSION_ANGLE_MAX,
+    .absflat[ABS_X] = 0,
+    .absfuzz[ABS_X] = 0,
+
+    .absmin[ABS_Y]  = -FUSION_ANGLE_MAX / 2,
+    .absmax[ABS_Y]  = FUSION_ANGLE_MAX / 2,
+    .absflat[ABS_Y] = 0,
+    .absfuzz[ABS_Y] = 0,
+
+    .absmin[ABS_Z]  = -FUSION_ANGLE_MAX,
+    .absmax[ABS_Z]  = FUSION_ANGLE_MAX,
+    .absflat[ABS_Z] = 0,
+    .absfuzz[ABS_Z] = 0,
+};
+
+static const uint16_t axis[] = {
+    ABS_X, ABS_Y, ABS_Z,
+};
+
+#define NUMEVENTS (arrsize(axis) + 1)
+
+const struct device_context device_orientation = {
+    .fd     = -1,
+    .write  = orientation_write,
+    .create = orientation_create,
+};
+
+_Static_assert(NUMEVENTS <= DEVICE_EVENTS_MAX, "event buffer too small");
+
+int orientation_create(struct device_context *dev, const char *uinput_device)
+{
+    (void) dev;
+
+    int uinputfd = device_open(uinput_device);
+    if (uinputfd < 0) {
+        goto failure_noclose;
+    }
+
+    int res;
+    res = device_register_absaxis(uinputfd, axis, arrsize(axis));
+    if (res != arrsize(axis)) {
+        goto failure;
+    }
+
+    res = device_create(uinputfd, &orientation);
+    if (res < 0) {
+        goto failure;
+    }
+
+    return uinputfd;
+
+failure:
+    close(uinputfd);
+failure_noclose:
+    fprintf(stderr, "Failed to initialize orientation.\n");
+    return -1;
+}
+
+static unsigned orientation_emit(struct device_context *dev,
+                                 unsigned slot,
+                                 const uint16_t *axis,
+                                 const struct hidinfo *hid)
+{
+    int32_t values[3] = {
+        hid->orientation.roll,
+        hid->orientation.pitch,
+        hid->orientation.yaw,
+    };
+
+    if (motion_filter(dev, DEVICE_ORIENTATION, slot, hid, values)) {
+        device_emit(dev, slot + 0, EV_ABS, axis[0], values[0]);
+        device_emit(dev, slot + 1, EV_ABS, axis[1], values[1]);
+        device_emit(dev, slot + 2, EV_ABS, axis[2], values[2]);
+    }
+
+    return slot + 3;
+}
+
+const struct device_part device_orientation_part = {
+    .keys       = NULL,
+    .keys_count = 0,
+    .axis       = axis,
+    .axis_count = arrsize(axis),
+    .ranges     = &orientation,
+    .emit       = orientation_emit,
+};
+
+int orientation_write(struct device_context *dev, struct hidinfo *hid)
+{
+    orientation_emit(dev, 0, axis, hid);
+    return device_flush(dev, "Error writing orientation events");
+}
@@ -37,14 +37,18 @@ static const uint16_t axis[] = {
 
 #define NUMEVENTS (arrsize(keys) + arrsize(axis) + 1)
 
-struct device_context device_touchscreen = {
-    -1,
-    touchscreen_write,
-    touchscreen_create,
+const struct device_context device_touchscreen = {
+    .fd     = -1,
+    .write  = touchscreen_write,
+    .create = touchscreen_create,
 };
 
-int touchscreen_create(const char *uinput_device)
+_Static_assert(NUMEVENTS <= DEVICE_EVENTS_MAX, "event buffer too small");
+
+int touchscreen_create(struct device_context *dev, const char *uinput_device)
 {
+    (void) dev;
+
     int uinputfd = device_open(uinput_device);
     if (uinputfd < 0) {
         goto failure_noclose;
@@ -75,43 +79,38 @@ failure_noclose:
     return -1;
 }
 
-int touchscreen_write(int uinputfd, struct hidinfo *hid)
+static unsigned touchscreen_emit(struct device_context *dev,
+                                 unsigned slot,
+                                 const uint16_t *axis,
+                                 const struct hidinfo *hid)
 {
-    int res;
-    static struct input_event events[NUMEVENTS];
-
-    size_t i  = 0;
     int touch = HID_HAS_KEY(hid->keys.held, HID_KEY_TOUCH);
 
-    events[i].type  = EV_KEY;
-    events[i].code  = keys[i];
-    events[i].value = touch;
-    i++;
+    device_emit(dev, slot, EV_KEY, keys[0], touch);
 
     // Only report coordinates if a touch is registered, as the touchscreen will
     // always report to be at (0, 0) otherwise . This prevents screen-pointers,
     // such as your mouse, to suddenly jump into a corner once lift your stylus
     // or finger off the touchscreen.
     if (touch) {
-        events[i].type  = EV_ABS;
-        events[i].code  = ABS_X;
-        events[i].value = hid->touchscreen.px;
-        i++;
-
-        events[i].type  = EV_ABS;
-        events[i].code  = ABS_Y;
-        events[i].value = hid->touchscreen.py;
-        i++;
+        device_emit(dev, slot + 1, EV_ABS, axis[0], hid->touchscreen.px);
+        device_emit(dev, slot + 2, EV_ABS, axis[1], hid->touchscreen.py);
     }
 
-    events[i].type  = EV_SYN;
-    events[i].code  = SYN_REPORT;
-    events[i].value = 0;
-    i++;
+    return slot + 3;
+}
+
+const struct device_part device_touchscreen_part = {
+    .keys       = keys,
+    .keys_count = arrsize(keys),
+    .axis       = axis,
+    .axis_count = arrsize(axis),
+    .ranges     = &touchscreen,
+    .emit       = touchscreen_emit,
+};
 
-    res = write(uinputfd, events, i * sizeof(struct input_event));
-    if (res < 0) {
-        perror("Error writing touchscreen events");
-    }
-    return res;
+int touchscreen_write(struct device_context *dev, struct hidinfo *hid)
+{
+    touchscreen_emit(dev, 0, axis, hid);
+    return device_flush(dev, "Error writing touchscreen events");
 }
@@ -0,0 +1,194 @@
+#include "devices.h"
+#include "hid.h"
+#include "keymap.h"
+#include "stick.h"
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/uhid.h>
+
+/* hid-input reports button n of a gamepad as BTN_GAMEPAD + n - 1, so the
+ * buttons the keymap maps to BTN_SOUTH up to BTN_THUMBR keep their codes; it
+ * turns the hat switch into ABS_HAT0X/ABS_HAT0Y and the axes into ABS_X,
+ * ABS_Y, ABS_RX and ABS_RY, just like the uinput gamepad.
+ */
+#define UHID_BUTTONS (BTN_THUMBR - BTN_SOUTH + 1)
+
+static const uint8_t descriptor[] = {
+    0x05, 0x01,       // Usage Page (Generic Desktop)
+    0x09, 0x05,       // Usage (Game Pad)
+    0xa1, 0x01,       // Collection (Application)
+
+    0x05, 0x09,       //   Usage Page (Button)
+    0x19, 0x01,       //   Usage Minimum (1)
+    0x29, 0x0f,       //   Usage Maximum (15)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x25, 0x01,       //   Logical Maximum (1)
+    0x75, 0x01,       //   Report Size (1)
+    0x95, 0x0f,       //   Report Count (15)
+    0x81, 0x02,       //   Input (Data, Variable, Absolute)
+    0x95, 0x01,       //   Report Count (1)
+    0x81, 0x03,       //   Input (Constant)
+
+    0x05, 0x01,       //   Usage Page (Generic Desktop)
+    0x09, 0x39,       //   Usage (Hat Switch)
+    0x25, 0x07,       //   Logical Maximum (7)
+    0x35, 0x00,       //   Physical Minimum (0)
+    0x46, 0x3b, 0x01, //   Physical Maximum (315)
+    0x65, 0x14,       //   Unit (Degrees)
+    0x75, 0x04,       //   Report Size (4)
+    0x81, 0x42,       //   Input (Data, Variable, Absolute, Null State)
+    0x65, 0x00,       //   Unit (None)
+    0x45, 0x00,       //   Physical Maximum (0)
+    0x81, 0x03,       //   Input (Constant)
+
+    0x09, 0x30,       //   Usage (X)
+    0x09, 0x31,       //   Usage (Y)
+    0x09, 0x33,       //   Usage (Rx)
+    0x09, 0x34,       //   Usage (Ry)
+    0x16, 0x64, 0xff, //   Logical Minimum (-0x9c)
+    0x26, 0x9c, 0x00, //   Logical Maximum (0x9c)
+    0x75, 0x10,       //   Report Size (16)
+    0x95, 0x04,       //   Report Count (4)
+    0x81, 0x02,       //   Input (Data, Variable, Absolute)
+
+    0xc0,             // End Collection
+};
+
+struct uhid_report {
+    uint16_t buttons;
+    uint8_t hat;
+    int16_t axis[4];
+} __attribute__((packed));
+
+/* Hat switch positions, clockwise from north, by (y + 1) * 3 + (x + 1); 8 is
+ * out of range and so centered
+ */
+static const uint8_t hat_positions[9] = {7, 0, 1, 6, 8, 2, 5, 4, 3};
+
+/* The report last written is kept in the shadow copy */
+_Static_assert(sizeof(struct uhid_report) <= sizeof(int32_t[DEVICE_EVENTS_MAX]),
+               "shadow copy too small");
+
+const struct device_context device_uhid = {
+    .fd     = -1,
+    .write  = uhid_write,
+    .create = uhid_create,
+};
+
+int uhid_create(struct device_context *dev, const char *uinput_device)
+{
+    (void) dev;
+    (void) uinput_device;
+
+    int uhidfd = open(UHID_DEFAULT_DEVICE, O_RDWR | O_CLOEXEC);
+    if (uhidfd < 0) {
+        perror("Error opening uhid device");
+        goto failure_noclose;
+    }
+
+    struct uhid_event event         = {.type = UHID_CREATE2};
+    struct uhid_create2_req *create = &event.u.create2;
+    snprintf((char *) create->name, sizeof(create->name), "Nintendo 3DS");
+    create->rd_size = sizeof(descriptor);
+    create->bus     = BUS_VIRTUAL;
+    create->vendor  = 0x057e;
+    create->product = 0x0401;
+    create->version = 1;
+    memcpy(create->rd_data, descriptor, sizeof(descriptor));
+
+    if (write(uhidfd, &event, sizeof(event)) < 0) {
+        perror("Unable to create virtual device");
+        goto failure;
+    }
+
+    // The kernel queues requests such as UHID_START and UHID_OPEN for us to
+    // read; an input-only device needs to answer none of them, so they are
+    // left alone.
+    return uhidfd;
+
+failure:
+    close(uhidfd);
+failure_noclose:
+    fprintf(stderr, "Failed to initialize HID gamepad.\n");
+    return -1;
+}
+
+static int32_t uhid_sign(int32_t value)
+{
+    return (value > 0) - (value < 0);
+}
+
+int uhid_write(struct device_context *dev, struct hidinfo *hid)
+{
+    const struct keymap *keymap = gamepad_keymap();
+    uint64_t active = keymap_eval(keymap, hid->keys.held | hid->keys.down);
+
+    uint16_t buttons = 0;
+    int32_t hat_x    = 0;
+    int32_t hat_y    = 0;
+
+    // Outputs without a HID usage in the descriptor are left out
+    for (unsigned i = 0; i < keymap->channel_count; i++) {
+        const struct keymap_channel *channel = &keymap->channels[i];
+        int32_t value = keymap_value(keymap, channel, active);
+        if (channel->type == EV_KEY) {
+            unsigned button = channel->code - BTN_SOUTH;
+            if (value && button < UHID_BUTTONS) {
+                buttons |= 1u << button;
+            }
+        } else if (channel->code == ABS_HAT0X) {
+            hat_x = uhid_sign(value);
+        } else if (channel->code == ABS_HAT0Y) {
+            hat_y = uhid_sign(value);
+        }
+    }
+
+    struct circlepos circlepad = stick_shape(STICK_CIRCLEPAD, hid->circlepad);
+    struct circlepos cstick    = stick_shape(STICK_CSTICK, hid->cstick);
+
+    struct uhid_report report = {
+        .buttons = htole16(buttons),
+        .hat     = hat_positions[(hat_y + 1) * 3 + hat_x + 1],
+        .axis =
+            {
+                htole16(circlepad.dx),
+                htole16(-circlepad.dy),
+                htole16(cstick.dx),
+                htole16(-cstick.dy),
+            },
+    };
+
+    if (dev->shadow_valid &&
+        memcmp(dev->shadow, &report, sizeof(report)) == 0) {
+        device_stats.writes_skipped++;
+        return 0;
+    }
+
+    struct uhid_event event;
+    event.type          = UHID_INPUT2;
+    event.u.input2.size = sizeof(report);
+    memcpy(event.u.input2.data, &report, sizeof(report));
+
+    // Only the used part of the data is written; uhid takes the size field
+    // for the length of the report
+    size_t len  = offsetof(struct uhid_event, u.input2.data) + sizeof(report);
+    ssize_t res = write(dev->fd, &event, len);
+    if (res < 0) {
+        perror("Error writing HID report");
+        device_stats.write_errors++;
+        dev->shadow_valid = 0;
+        return res;
+    }
+
+    device_stats.reports++;
+    memcpy(dev->shadow, &report, sizeof(report));
+    dev->shadow_valid = 1;
+    return res;
+}
@@ -0,0 +1,145 @@
+#include "fusion.h"
+#include "predict.h"
+
+#include <math.h>
+
+double fusion_beta = FUSION_BETA_DEFAULT;
+
+/* Packets further apart than this say nothing about how fast the 3DS turned
+ * in between; the filter steps a single frame over them
+ */
+#define FUSION_FRAMES_MAX (PREDICT_RESET_MS * 1000 / PREDICT_FRAME_US)
+
+/* Scale v to unit length; returns 0, leaving it alone, if it has none */
+static int fusion_normalize(float *v, unsigned n)
+{
+    float norm = 0;
+    for (unsigned i = 0; i < n; i++) {
+        norm += v[i] * v[i];
+    }
+    norm = sqrtf(norm);
+    if (!(norm > 0)) {
+        return 0;
+    }
+
+    for (unsigned i = 0; i < n; i++) {
+        v[i] /= norm;
+    }
+    return 1;
+}
+
+/* Start over from the tilt the accelerometer measures, facing yaw 0 */
+static void fusion_reset(struct fusion *fusion, const struct hidinfo *hid)
+{
+    float ax    = hid->accel.x;
+    float ay    = hid->accel.y;
+    float az    = hid->accel.z;
+    float roll  = 0;
+    float pitch = 0;
+
+    if (ax != 0 || ay != 0 || az != 0) {
+        roll  = atan2f(ay, az);
+        pitch = atan2f(-ax, hypotf(ay, az));
+    }
+
+    float cr = cosf(roll / 2);
+    float sr = sinf(roll / 2);
+    float cp = cosf(pitch / 2);
+    float sp = sinf(pitch / 2);
+
+    fusion->q[0] = cr * cp;
+    fusion->q[1] = sr * cp;
+    fusion->q[2] = cr * sp;
+    fusion->q[3] = -sr * sp;
+}
+
+static void fusion_step(struct fusion *fusion,
+                        const struct hidinfo *hid,
+                        float dt)
+{
+    const float rad = (float) M_PI / 180 / FUSION_GYRO_SCALE;
+    float *q        = fusion->q;
+
+    float gx = hid->gyro.x * rad;
+    float gy = hid->gyro.y * rad;
+    float gz = hid->gyro.z * rad;
+
+    // Rate of change of the orientation the gyroscope measures
+    float dq[4] = {
+        0.5f * (-q[1] * gx - q[2] * gy - q[3] * gz),
+        0.5f * (q[0] * gx + q[2] * gz - q[3] * gy),
+        0.5f * (q[0] * gy - q[1] * gz + q[3] * gx),
+        0.5f * (q[0] * gz + q[1] * gy - q[2] * gx),
+    };
+
+    float a[3] = {hid->accel.x, hid->accel.y, hid->accel.z};
+    if (fusion_normalize(a, 3)) {
+        // Where gravity would point at the current orientation, less where
+        // it does, and the gradient of that with respect to the orientation
+        float f[3] = {
+            2 * (q[1] * q[3] - q[0] * q[2]) - a[0],
+            2 * (q[0] * q[1] + q[2] * q[3]) - a[1],
+            1 - 2 * (q[1] * q[1] + q[2] * q[2]) - a[2],
+        };
+        float s[4] = {
+            -2 * q[2] * f[0] + 2 * q[1] * f[1],
+            2 * q[3] * f[0] + 2 * q[0] * f[1] - 4 * q[1] * f[2],
+            -2 * q[0] * f[0] + 2 * q[3] * f[1] - 4 * q[2] * f[2],
+            2 * q[1] * f[0] + 2 * q[2] * f[1],
+        };
+
+        if (fusion_normalize(s, 4)) {
+            for (unsigned i = 0; i < 4; i++) {
+                dq[i] -= (float) fusion_beta * s[i];
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < 4; i++) {
+        q[i] += dq[i] * dt;
+    }
+    fusion_normalize(q, 4);
+}
+
+static int16_t fusion_angle(float angle)
+{
+    return lroundf(angle * (FUSION_ANGLE_MAX / (float) M_PI));
+}
+
+static void fusion_euler(const float q[4], struct orientation *orientation)
+{
+    float sinp = 2 * (q[0] * q[2] - q[3] * q[1]);
+    sinp       = sinp < -1 ? -1 : sinp > 1 ? 1 : sinp;
+
+    float roll = atan2f(2 * (q[0] * q[1] + q[2] * q[3]),
+                        1 - 2 * (q[1] * q[1] + q[2] * q[2]));
+    float yaw  = atan2f(2 * (q[0] * q[3] + q[1] * q[2]),
+                        1 - 2 * (q[2] * q[2] + q[3] * q[3]));
+
+    orientation->roll  = fusion_angle(roll);
+    orientation->pitch = fusion_angle(asinf(sinp));
+    orientation->yaw   = fusion_angle(yaw);
+}
+
+void fusion_update(struct fusion *fusion, struct hidinfo *hid, uint64_t now)
+{
+    // Revision 0 packets have no sequence numbers, count the frames since
+    // the last one instead
+    int32_t frames = hid->sequence - fusion->sequence;
+    if (hid->sequence == 0 && now > fusion->last) {
+        frames = ((now - fusion->last) / 1000 + PREDICT_FRAME_US / 2) /
+                 PREDICT_FRAME_US;
+        frames = frames > 0 ? frames : 1;
+    }
+
+    if (fusion->last == 0 || frames <= 0) {
+        fusion_reset(fusion, hid);
+    } else {
+        frames = frames <= FUSION_FRAMES_MAX ? frames : 1;
+        fusion_step(fusion, hid, frames * (PREDICT_FRAME_US / 1e6f));
+    }
+    fusion->last     = now;
+    fusion->sequence = hid->sequence;
+
+    fusion_euler(fusion->q, &hid->orientation);
+}
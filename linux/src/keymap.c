@@ -0,0 +1,756 @@
+#include "keymap.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hid.h"
+
+#define arrsize(a) (sizeof(a) / sizeof(a[0]))
+
+#define KEYMAP_INPUT(name) {#name, HID_KEY_##name}
+#define KEYMAP_CODE(name) {#name, name}
+
+static const struct {
+    const char *name;
+    uint32_t key;
+} keymap_inputs[] = {
+    KEYMAP_INPUT(A),
+    KEYMAP_INPUT(B),
+    KEYMAP_INPUT(X),
+    KEYMAP_INPUT(Y),
+    KEYMAP_INPUT(L),
+    KEYMAP_INPUT(R),
+    KEYMAP_INPUT(ZL),
+    KEYMAP_INPUT(ZR),
+    KEYMAP_INPUT(START),
+    KEYMAP_INPUT(SELECT),
+    KEYMAP_INPUT(DUP),
+    KEYMAP_INPUT(DDOWN),
+    KEYMAP_INPUT(DLEFT),
+    KEYMAP_INPUT(DRIGHT),
+    KEYMAP_INPUT(CSTICK_UP),
+    KEYMAP_INPUT(CSTICK_DOWN),
+    KEYMAP_INPUT(CSTICK_LEFT),
+    KEYMAP_INPUT(CSTICK_RIGHT),
+    KEYMAP_INPUT(CPAD_UP),
+    KEYMAP_INPUT(CPAD_DOWN),
+    KEYMAP_INPUT(CPAD_LEFT),
+    KEYMAP_INPUT(CPAD_RIGHT),
+    KEYMAP_INPUT(TOUCH),
+};
+
+static const struct {
+    const char *name;
+    uint16_t code;
+} keymap_keys[] = {
+    KEYMAP_CODE(BTN_SOUTH),     KEYMAP_CODE(BTN_EAST),
+    KEYMAP_CODE(BTN_NORTH),     KEYMAP_CODE(BTN_WEST),
+    KEYMAP_CODE(BTN_A),         KEYMAP_CODE(BTN_B),
+    KEYMAP_CODE(BTN_X),         KEYMAP_CODE(BTN_Y),
+    KEYMAP_CODE(BTN_TL),        KEYMAP_CODE(BTN_TR),
+    KEYMAP_CODE(BTN_TL2),       KEYMAP_CODE(BTN_TR2),
+    KEYMAP_CODE(BTN_START),     KEYMAP_CODE(BTN_SELECT),
+    KEYMAP_CODE(BTN_MODE),      KEYMAP_CODE(BTN_THUMBL),
+    KEYMAP_CODE(BTN_THUMBR),    KEYMAP_CODE(BTN_DPAD_UP),
+    KEYMAP_CODE(BTN_DPAD_DOWN), KEYMAP_CODE(BTN_DPAD_LEFT),
+    KEYMAP_CODE(BTN_DPAD_RIGHT),
+
+    KEYMAP_CODE(KEY_A),         KEYMAP_CODE(KEY_B),
+    KEYMAP_CODE(KEY_C),         KEYMAP_CODE(KEY_D),
+    KEYMAP_CODE(KEY_E),         KEYMAP_CODE(KEY_F),
+    KEYMAP_CODE(KEY_G),         KEYMAP_CODE(KEY_H),
+    KEYMAP_CODE(KEY_I),         KEYMAP_CODE(KEY_J),
+    KEYMAP_CODE(KEY_K),         KEYMAP_CODE(KEY_L),
+    KEYMAP_CODE(KEY_M),         KEYMAP_CODE(KEY_N),
+    KEYMAP_CODE(KEY_O),         KEYMAP_CODE(KEY_P),
+    KEYMAP_CODE(KEY_Q),         KEYMAP_CODE(KEY_R),
+    KEYMAP_CODE(KEY_S),         KEYMAP_CODE(KEY_T),
+    KEYMAP_CODE(KEY_U),         KEYMAP_CODE(KEY_V),
+    KEYMAP_CODE(KEY_W),         KEYMAP_CODE(KEY_X),
+    KEYMAP_CODE(KEY_Y),         KEYMAP_CODE(KEY_Z),
+    KEYMAP_CODE(KEY_0),         KEYMAP_CODE(KEY_1),
+    KEYMAP_CODE(KEY_2),         KEYMAP_CODE(KEY_3),
+    KEYMAP_CODE(KEY_4),         KEYMAP_CODE(KEY_5),
+    KEYMAP_CODE(KEY_6),         KEYMAP_CODE(KEY_7),
+    KEYMAP_CODE(KEY_8),         KEYMAP_CODE(KEY_9),
+    KEYMAP_CODE(KEY_F1),        KEYMAP_CODE(KEY_F2),
+    KEYMAP_CODE(KEY_F3),        KEYMAP_CODE(KEY_F4),
+    KEYMAP_CODE(KEY_F5),        KEYMAP_CODE(KEY_F6),
+    KEYMAP_CODE(KEY_F7),        KEYMAP_CODE(KEY_F8),
+    KEYMAP_CODE(KEY_F9),        KEYMAP_CODE(KEY_F10),
+    KEYMAP_CODE(KEY_F11),       KEYMAP_CODE(KEY_F12),
+    KEYMAP_CODE(KEY_ESC),       KEYMAP_CODE(KEY_ENTER),
+    KEYMAP_CODE(KEY_SPACE),     KEYMAP_CODE(KEY_TAB),
+    KEYMAP_CODE(KEY_BACKSPACE), KEYMAP_CODE(KEY_DELETE),
+    KEYMAP_CODE(KEY_INSERT),    KEYMAP_CODE(KEY_HOME),
+    KEYMAP_CODE(KEY_END),       KEYMAP_CODE(KEY_PAGEUP),
+    KEYMAP_CODE(KEY_PAGEDOWN),  KEYMAP_CODE(KEY_UP),
+    KEYMAP_CODE(KEY_DOWN),      KEYMAP_CODE(KEY_LEFT),
+    KEYMAP_CODE(KEY_RIGHT),     KEYMAP_CODE(KEY_LEFTSHIFT),
+    KEYMAP_CODE(KEY_RIGHTSHIFT), KEYMAP_CODE(KEY_LEFTCTRL),
+    KEYMAP_CODE(KEY_RIGHTCTRL), KEYMAP_CODE(KEY_LEFTALT),
+    KEYMAP_CODE(KEY_RIGHTALT),  KEYMAP_CODE(KEY_LEFTMETA),
+    KEYMAP_CODE(KEY_MINUS),     KEYMAP_CODE(KEY_EQUAL),
+    KEYMAP_CODE(KEY_COMMA),     KEYMAP_CODE(KEY_DOT),
+    KEYMAP_CODE(KEY_SLASH),     KEYMAP_CODE(KEY_SEMICOLON),
+    KEYMAP_CODE(KEY_APOSTROPHE), KEYMAP_CODE(KEY_GRAVE),
+    KEYMAP_CODE(KEY_LEFTBRACE), KEYMAP_CODE(KEY_RIGHTBRACE),
+    KEYMAP_CODE(KEY_BACKSLASH), KEYMAP_CODE(KEY_VOLUMEUP),
+    KEYMAP_CODE(KEY_VOLUMEDOWN), KEYMAP_CODE(KEY_MUTE),
+    KEYMAP_CODE(KEY_PLAYPAUSE), KEYMAP_CODE(KEY_NEXTSONG),
+    KEYMAP_CODE(KEY_PREVIOUSSONG),
+};
+
+/* Axes the sticks and the devices merged into a composite one do not use */
+static const struct {
+    const char *name;
+    uint16_t code;
+} keymap_axes[] = {
+    KEYMAP_CODE(ABS_Z),
+    KEYMAP_CODE(ABS_HAT0X),
+    KEYMAP_CODE(ABS_HAT0Y),
+    KEYMAP_CODE(ABS_HAT2X),
+    KEYMAP_CODE(ABS_HAT2Y),
+    KEYMAP_CODE(ABS_HAT3X),
+    KEYMAP_CODE(ABS_HAT3Y),
+    KEYMAP_CODE(ABS_MISC),
+};
+
+#undef KEYMAP_CODE
+#undef KEYMAP_INPUT
+
+/* The first KEYMAP_LEGACY_KEYS rules are the ones the lines of a keymap file
+ * of earlier versions replace, in the same order.
+ */
+#define KEYMAP_LEGACY_KEYS 10
+
+static const char *const keymap_default_rules[] = {
+    "A = BTN_SOUTH",
+    "B = BTN_EAST",
+    "X = BTN_NORTH",
+    "Y = BTN_WEST",
+    "START = BTN_START",
+    "SELECT = BTN_SELECT",
+    "L = BTN_TL",
+    "R = BTN_TR",
+    "ZL = BTN_TL2",
+    "ZR = BTN_TR2",
+
+    // The D-pad is sent as a hat instead of buttons, due to a bug in android.
+    "DLEFT = ABS_HAT0X:-1",
+    "DRIGHT = ABS_HAT0X:1",
+    "DUP = ABS_HAT0Y:-1",
+    "DDOWN = ABS_HAT0Y:1",
+};
+
+static const uint32_t keymap_legacy_inputs[KEYMAP_LEGACY_KEYS] = {
+    HID_KEY_A,
+    HID_KEY_B,
+    HID_KEY_X,
+    HID_KEY_Y,
+    HID_KEY_START,
+    HID_KEY_SELECT,
+    HID_KEY_L,
+    HID_KEY_R,
+    HID_KEY_ZL,
+    HID_KEY_ZR,
+};
+
+static const struct {
+    const char *name;
+    uint16_t code;
+} keymap_legacy_buttons[] = {
+    {"A", BTN_SOUTH},
+    {"B", BTN_EAST},
+    {"X", BTN_NORTH},
+    {"Y", BTN_WEST},
+    {"START", BTN_START},
+    {"SELECT", BTN_SELECT},
+    {"L", BTN_TL},
+    {"R", BTN_TR},
+    {"ZL", BTN_TL2},
+    {"ZR", BTN_TR2},
+};
+
+struct keymap_rule {
+    unsigned layer;
+    unsigned line;
+    uint32_t inputs;
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+/* Rules as read from a file, before they are compiled */
+struct keymap_source {
+    const char *name;
+    unsigned layer;
+    unsigned legacy;
+    uint32_t layer_keys[KEYMAP_LAYERS_MAX];
+    unsigned count;
+    struct keymap_rule rules[KEYMAP_RULES_MAX];
+};
+
+static void keymap_error(const struct keymap_source *src,
+                         unsigned line,
+                         const char *fmt,
+                         ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s:%u: ", src->name, line);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+static char *keymap_trim(char *str)
+{
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+uint32_t keymap_parse_input(const char *name)
+{
+    for (size_t i = 0; i < arrsize(keymap_inputs); i++) {
+        if (strcmp(keymap_inputs[i].name, name) == 0) {
+            return keymap_inputs[i].key;
+        }
+    }
+    return 0;
+}
+
+static int keymap_parse_output(char *text, struct keymap_rule *rule)
+{
+    char *value = strchr(text, ':');
+    if (value != NULL) {
+        *value++ = '\0';
+        text     = keymap_trim(text);
+        value    = keymap_trim(value);
+    }
+
+    if (value == NULL) {
+        for (size_t i = 0; i < arrsize(keymap_keys); i++) {
+            if (strcmp(keymap_keys[i].name, text) == 0) {
+                rule->type  = EV_KEY;
+                rule->code  = keymap_keys[i].code;
+                rule->value = 1;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; i < arrsize(keymap_axes); i++) {
+        if (strcmp(keymap_axes[i].name, text) == 0) {
+            char *end;
+            errno     = 0;
+            long axis = strtol(value, &end, 0);
+            if (errno != 0 || *end != '\0' || end == value || axis == 0 ||
+                axis < INT16_MIN || axis > INT16_MAX) {
+                return -1;
+            }
+            rule->type  = EV_ABS;
+            rule->code  = keymap_axes[i].code;
+            rule->value = axis;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int keymap_add_rule(struct keymap_source *src,
+                           const struct keymap_rule *rule)
+{
+    if (src->count == KEYMAP_RULES_MAX) {
+        keymap_error(src, rule->line, "more than %d rules", KEYMAP_RULES_MAX);
+        return -1;
+    }
+    src->rules[src->count++] = *rule;
+    return 0;
+}
+
+/* A line of a keymap file of earlier versions: the label of the button the
+ * next of the KEYMAP_LEGACY_KEYS keys is reported as
+ */
+static int keymap_parse_legacy(struct keymap_source *src,
+                               const char *label,
+                               unsigned line)
+{
+    if (src->count != src->legacy || src->legacy == KEYMAP_LEGACY_KEYS) {
+        keymap_error(src, line, "expected a rule, got '%s'", label);
+        return -1;
+    }
+
+    for (size_t i = 0; i < arrsize(keymap_legacy_buttons); i++) {
+        if (strcmp(keymap_legacy_buttons[i].name, label) == 0) {
+            struct keymap_rule legacy = {
+                .line   = line,
+                .inputs = keymap_legacy_inputs[src->legacy],
+                .type   = EV_KEY,
+                .code   = keymap_legacy_buttons[i].code,
+                .value  = 1,
+            };
+            src->legacy++;
+            return keymap_add_rule(src, &legacy);
+        }
+    }
+
+    keymap_error(src, line, "unknown button '%s'", label);
+    return -1;
+}
+
+static int
+keymap_parse_line(struct keymap_source *src, char *text, unsigned line)
+{
+    unsigned layer;
+    char tail;
+
+    char *comment = strchr(text, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    text = keymap_trim(text);
+    if (*text == '\0') {
+        return 0;
+    }
+
+    if (*text == '[') {
+        if (sscanf(text, "[layer %u %c", &layer, &tail) != 2 || tail != ']' ||
+            layer >= KEYMAP_LAYERS_MAX) {
+            keymap_error(src, line, "invalid section '%s'", text);
+            return -1;
+        }
+        src->layer = layer;
+        return 0;
+    }
+
+    char *output = strchr(text, '=');
+    if (output == NULL) {
+        return keymap_parse_legacy(src, text, line);
+    }
+    *output++ = '\0';
+    output = keymap_trim(output);
+    text   = keymap_trim(text);
+
+    if (sscanf(text, "layer %u %c", &layer, &tail) == 1) {
+        uint32_t key = keymap_parse_input(output);
+        if (layer == 0 || layer >= KEYMAP_LAYERS_MAX || key == 0) {
+            keymap_error(src, line, "invalid layer '%s = %s'", text, output);
+            return -1;
+        }
+        for (unsigned i = 1; i < KEYMAP_LAYERS_MAX; i++) {
+            if (i != layer && src->layer_keys[i] == key) {
+                keymap_error(
+                    src, line, "%s already selects layer %u", output, i);
+                return -1;
+            }
+        }
+        src->layer_keys[layer] = key;
+        return 0;
+    }
+
+    struct keymap_rule rule = {
+        .layer = src->layer,
+        .line  = line,
+    };
+
+    for (char *input = strtok(text, "+"); input != NULL;
+         input       = strtok(NULL, "+")) {
+        input        = keymap_trim(input);
+        uint32_t key = keymap_parse_input(input);
+        if (key == 0) {
+            keymap_error(src, line, "unknown input '%s'", input);
+            return -1;
+        }
+        rule.inputs |= key;
+    }
+
+    if (rule.inputs == 0) {
+        keymap_error(src, line, "rule without inputs");
+        return -1;
+    }
+
+    if (keymap_parse_output(output, &rule) < 0) {
+        keymap_error(src, line, "invalid output '%s'", output);
+        return -1;
+    }
+
+    return keymap_add_rule(src, &rule);
+}
+
+/* Spread the bits of index over the set bits of mask, lowest first */
+static uint32_t keymap_deposit(uint32_t index, uint32_t mask)
+{
+    uint32_t keys = 0;
+    for (uint32_t bit = 1; mask != 0; bit <<= 1, mask &= mask - 1) {
+        if (index & bit) {
+            keys |= mask & -mask;
+        }
+    }
+    return keys;
+}
+
+void keymap_gather_init(struct keymap_gather *gather, uint32_t mask)
+{
+    gather->mask = mask;
+
+#ifndef __BMI2__
+    for (unsigned byte = 0; byte < sizeof(uint32_t); byte++) {
+        for (unsigned b = 0; b < 256; b++) {
+            uint32_t keys  = (uint32_t) b << (8 * byte);
+            uint32_t index = 0;
+            for (uint32_t rest = keys & mask; rest != 0; rest &= rest - 1) {
+                index |= 1u << __builtin_popcount(mask & ((rest & -rest) - 1));
+            }
+            gather->table[byte][b] = index;
+        }
+    }
+#endif
+}
+
+static inline int keymap_subset(uint32_t part, uint32_t whole)
+{
+    return (part & ~whole) == 0;
+}
+
+static int keymap_compile_layer(struct keymap *map,
+                                const struct keymap_source *src,
+                                unsigned layer,
+                                const uint64_t *outputs)
+{
+    struct keymap_layer *dst = &map->layers[layer];
+    unsigned rules[KEYMAP_RULES_MAX];
+    unsigned count      = 0;
+    uint32_t chord_mask = 0;
+
+    // Rules of the layer, then those of the base layer it does not override
+    for (unsigned i = 0; i < src->count; i++) {
+        if (src->rules[i].layer == layer) {
+            rules[count++] = i;
+        }
+    }
+    unsigned own = count;
+    for (unsigned i = 0; layer != 0 && i < src->count; i++) {
+        int overridden = 0;
+        for (unsigned k = 0; k < own; k++) {
+            overridden |= src->rules[rules[k]].inputs == src->rules[i].inputs;
+        }
+        if (src->rules[i].layer == 0 && !overridden) {
+            rules[count++] = i;
+        }
+    }
+
+    for (unsigned k = 0; k < count; k++) {
+        const struct keymap_rule *rule = &src->rules[rules[k]];
+        if (__builtin_popcount(rule->inputs) > 1) {
+            chord_mask |= rule->inputs;
+            continue;
+        }
+
+        unsigned bit = __builtin_ctz(rule->inputs);
+        for (unsigned b = 0; b < 256; b++) {
+            if (b & (1u << (bit % 8))) {
+                dst->single[bit / 8][b] |= outputs[rules[k]];
+            }
+        }
+    }
+
+    if (__builtin_popcount(chord_mask) > KEYMAP_CHORD_KEYS_MAX) {
+        fprintf(stderr,
+                "%s: chords of layer %u use more than %d inputs\n",
+                src->name,
+                layer,
+                KEYMAP_CHORD_KEYS_MAX);
+        return -1;
+    }
+    keymap_gather_init(&dst->chord_keys, chord_mask);
+
+    // For every combination of chord inputs: the outputs of the largest
+    // chords held, and those of the rules they contain
+    for (uint32_t index = 0; index < (1u << __builtin_popcount(chord_mask));
+         index++) {
+        uint32_t keys = keymap_deposit(index, chord_mask);
+
+        for (unsigned k = 0; k < count; k++) {
+            const struct keymap_rule *chord = &src->rules[rules[k]];
+            if (__builtin_popcount(chord->inputs) < 2 ||
+                !keymap_subset(chord->inputs, keys)) {
+                continue;
+            }
+
+            int largest = 1;
+            for (unsigned j = 0; j < count; j++) {
+                const struct keymap_rule *rule = &src->rules[rules[j]];
+                if (rule->inputs == chord->inputs) {
+                    continue;
+                }
+                if (keymap_subset(chord->inputs, rule->inputs) &&
+                    keymap_subset(rule->inputs, keys)) {
+                    largest = 0;
+                }
+                if (keymap_subset(rule->inputs, chord->inputs)) {
+                    dst->chords[index].off |= outputs[rules[j]];
+                }
+            }
+            if (largest) {
+                dst->chords[index].on |= outputs[rules[k]];
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Tabulate the events of a keymap without layers or chords over the window
+ * of the key mask their keys are in; a keymap with an event whose keys do not
+ * fit into one is not direct
+ */
+static void keymap_compile_direct(struct keymap *map)
+{
+    unsigned shifts[KEYMAP_CHANNELS_MAX];
+
+    for (unsigned i = 0; i < map->channel_count; i++) {
+        uint32_t keys = map->channels[i].keys;
+        shifts[i]     = keys ? __builtin_ctz(keys) : 0;
+        if (shifts[i] > 32 - KEYMAP_DIRECT_BITS) {
+            shifts[i] = 32 - KEYMAP_DIRECT_BITS;
+        }
+        if ((keys >> shifts[i]) > KEYMAP_DIRECT_MASK) {
+            return;
+        }
+    }
+
+    for (unsigned i = 0; i < map->channel_count; i++) {
+        const struct keymap_channel *channel = &map->channels[i];
+        if (channel->type == EV_KEY &&
+            __builtin_popcount(channel->keys) == 1) {
+            map->direct_codes[map->direct_buttons] = channel->code;
+            map->direct_keys[map->direct_buttons++] = channel->keys;
+            continue;
+        }
+
+        struct keymap_lookup *lookup =
+            &map->direct_lookups[map->direct_lookup_count++];
+        lookup->type  = channel->type;
+        lookup->code  = channel->code;
+        lookup->shift = shifts[i];
+        for (uint32_t state = 0; state <= KEYMAP_DIRECT_MASK; state++) {
+            uint64_t active = keymap_eval(map, state << shifts[i]);
+            lookup->values[state] = keymap_value(map, channel, active);
+        }
+    }
+    map->direct = 1;
+}
+
+static struct keymap *keymap_compile(const struct keymap_source *src)
+{
+    uint64_t outputs[KEYMAP_RULES_MAX];
+    struct keymap_rule distinct[KEYMAP_OUTPUTS_MAX];
+    unsigned output_count = 0;
+
+    struct keymap *map = calloc(1, sizeof(*map));
+    if (map == NULL) {
+        perror("Failed to allocate keymap");
+        return NULL;
+    }
+
+    uint32_t layer_mask = 0;
+    for (unsigned i = 1; i < KEYMAP_LAYERS_MAX; i++) {
+        layer_mask |= src->layer_keys[i];
+    }
+
+    for (unsigned i = 0; i < src->count; i++) {
+        const struct keymap_rule *rule = &src->rules[i];
+        unsigned out;
+
+        if (rule->inputs & layer_mask) {
+            keymap_error(src, rule->line, "input selects a layer");
+            goto failure;
+        }
+
+        for (out = 0; out < output_count; out++) {
+            if (distinct[out].type == rule->type &&
+                distinct[out].code == rule->code &&
+                distinct[out].value == rule->value) {
+                break;
+            }
+        }
+        if (out == output_count) {
+            if (output_count == KEYMAP_OUTPUTS_MAX) {
+                keymap_error(src,
+                             rule->line,
+                             "more than %d distinct outputs",
+                             KEYMAP_OUTPUTS_MAX);
+                goto failure;
+            }
+            distinct[output_count++] = *rule;
+        }
+        outputs[i]       = 1ull << out;
+        map->values[out] = rule->value;
+
+        unsigned ch;
+        for (ch = 0; ch < map->channel_count; ch++) {
+            if (map->channels[ch].type == rule->type &&
+                map->channels[ch].code == rule->code) {
+                break;
+            }
+        }
+        if (ch == map->channel_count) {
+            if (map->channel_count == KEYMAP_CHANNELS_MAX) {
+                keymap_error(src,
+                             rule->line,
+                             "more than %d distinct events",
+                             KEYMAP_CHANNELS_MAX);
+                goto failure;
+            }
+            map->channels[ch] = (struct keymap_channel){
+                .type = rule->type,
+                .code = rule->code,
+            };
+            map->channel_count++;
+        }
+
+        struct keymap_channel *channel = &map->channels[ch];
+        channel->outputs |= outputs[i];
+        if (rule->layer == 0) {
+            channel->keys |= rule->inputs;
+        }
+        if (rule->value < channel->min) {
+            channel->min = rule->value;
+        }
+        if (rule->value > channel->max) {
+            channel->max = rule->value;
+        }
+    }
+
+    keymap_gather_init(&map->layer_keys, layer_mask);
+    for (uint32_t index = 0; index < (1u << __builtin_popcount(layer_mask));
+         index++) {
+        uint32_t keys = keymap_deposit(index, layer_mask);
+        for (unsigned i = 1; i < KEYMAP_LAYERS_MAX; i++) {
+            if (src->layer_keys[i] & keys) {
+                map->layer_of[index] = i;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < KEYMAP_LAYERS_MAX; i++) {
+        if (i == 0 || src->layer_keys[i] != 0) {
+            if (keymap_compile_layer(map, src, i, outputs) < 0) {
+                goto failure;
+            }
+        }
+    }
+
+    if (layer_mask == 0 && map->layers[0].chord_keys.mask == 0) {
+        keymap_compile_direct(map);
+    }
+
+    return map;
+
+failure:
+    free(map);
+    return NULL;
+}
+
+static int keymap_parse_defaults(struct keymap_source *src, size_t first)
+{
+    for (size_t i = first; i < arrsize(keymap_default_rules); i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "%s", keymap_default_rules[i]);
+        if (keymap_parse_line(src, line, i + 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct keymap *keymap_load(const char *path)
+{
+    struct keymap *map = NULL;
+    char line[256];
+    unsigned lineno = 0;
+
+    printf("Loading keymap from file: %s\n", path);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr,
+                "Failed to open keymap '%s': %s\n",
+                path,
+                strerror(errno));
+        return NULL;
+    }
+
+    struct keymap_source *src = calloc(1, sizeof(*src));
+    if (src == NULL) {
+        perror("Failed to allocate keymap");
+        goto out;
+    }
+    src->name = path;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (keymap_parse_line(src, line, ++lineno) < 0) {
+            goto out;
+        }
+    }
+
+    // Earlier versions only ever remapped the buttons, and always all of them
+    if (src->legacy > 0) {
+        if (src->legacy != KEYMAP_LEGACY_KEYS) {
+            keymap_error(src,
+                         lineno,
+                         "expected a label for each of the %d buttons",
+                         KEYMAP_LEGACY_KEYS);
+            goto out;
+        }
+        src->name = "default keymap";
+        if (keymap_parse_defaults(src, KEYMAP_LEGACY_KEYS) < 0) {
+            goto out;
+        }
+    }
+
+    map = keymap_compile(src);
+    if (map != NULL) {
+        printf("Keymap file loaded.\n");
+    }
+
+out:
+    free(src);
+    fclose(file);
+    return map;
+}
+
+struct keymap *keymap_default(void)
+{
+    struct keymap *map        = NULL;
+    struct keymap_source *src = calloc(1, sizeof(*src));
+    if (src == NULL) {
+        perror("Failed to allocate keymap");
+        return NULL;
+    }
+    src->name = "default keymap";
+
+    if (keymap_parse_defaults(src, 0) == 0) {
+        map = keymap_compile(src);
+    }
+
+    free(src);
+    return map;
+}
+
+void keymap_free(struct keymap *map)
+{
+    free(map);
+}
@@ -26,19 +26,29 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 #include "ctroller.h"
 #include "hid.h"
 #include "devices.h"
+#include "fusion.h"
+#include "keymap.h"
+#include "motion.h"
+#include "predict.h"
+#include "session.h"
+#include "stick.h"
 
-void on_terminate(int signum)
-{
-    (void) signum;
-    puts("Exiting...");
-    ctroller_exit();
-    exit(EXIT_SUCCESS);
-}
+/* SCHED_FIFO priority of the receive threads in real-time mode: below the
+ * threaded interrupt handlers (50) that feed them packets, above everything
+ * else
+ */
+#define REALTIME_PRIORITY 40
 
 void print_usage(void)
 {
@@ -50,12 +60,98 @@ void print_usage(void)
 #define print_opt(shortopt, longopt, desc)                                     \
     printf("  -%-1s  --%-34s " desc, shortopt, longopt)
 
+    print_opt("a",
+              "analog=<stick>:<shape>",
+              "shape the response of the circlepad or cstick, given as "
+              "<dz>[,<anti>,<outer>[,<curve>]]: a round deadzone of 'dz', the "
+              "radius it jumps to when leaving it ('anti'), the radius from "
+              "which on it is fully deflected ('outer', all in percent of "
+              "the full radius, defaults to 0 and 100) and the exponent of "
+              "the response in between ('curve', defaults to 1)\n");
+    print_opt("b",
+              "backend=<name>",
+              "how the gamepad is provided (possible values are: uinput or "
+              "uhid, which creates a HID gamepad through " UHID_DEFAULT_DEVICE
+              " and writes each state as one report, defaults to uinput)\n");
+    print_opt("c",
+              "composite",
+              "provide all 3DS devices as a single composite device instead "
+              "of one device each\n");
     print_opt("d", "daemonize", "execute in background\n");
+    print_opt("e",
+              "predict=<ms>",
+              "extrapolate the circle pad, C-stick and gyroscope 'ms' ahead "
+              "of the packets and through short gaps between them (at most "
+              STRINGIFY(PREDICT_GAP_MAX_MS) ", defaults to 0)\n");
+    print_opt("f",
+              "max-rate=<device>:<hz>",
+              "report the gyroscope, accelerometer or orientation at most 'hz' "
+              "times per second\n");
+    print_opt("g",
+              "motion-gate=<inputs>",
+              "only report motion while the 3DS inputs are held, e.g. ZL or "
+              "L+R (names as in keymap files)\n");
     print_opt("h", "help", "print this help text\n");
-    print_opt("k", "keymap=<path>", "use a keymap file (if not set, ctroller will use the default keymap)\n");
+    print_opt("i",
+              "idle-teardown=<s>",
+              "remove the devices of a 3DS that has not sent anything for 's' "
+              "seconds; they are created again when it comes back (defaults "
+              "to 0, which keeps them)\n");
+    print_opt("j",
+              "workers=<num>",
+              "serve clients from 'num' threads, each pinned to a core and "
+              "listening on its own SO_REUSEPORT socket (defaults to 1)\n");
+    print_opt("l",
+              "latency",
+              "measure the time from packet arrival until the devices are "
+              "written and print a histogram on exit\n");
+    print_opt("k",
+              "keymap=<path>",
+              "use a keymap file (if not set, ctroller will use the default "
+              "keymap, see the README for the format); the file is reloaded "
+              "when it is saved\n");
+    print_opt("m",
+              "smooth=<device>:<fc>/<beta>",
+              "smooth the gyroscope or accelerometer with a One Euro filter "
+              "that cuts off at 'fc' Hz at rest, and 'beta' Hz higher per "
+              "unit/s of motion (either for all axes, or for x, y and z "
+              "separated by commas)\n");
+    print_opt("o",
+              "output=<name>",
+              "how events are written to the devices (possible values are: "
+              "write or io_uring, defaults to write)\n");
+    print_opt("O",
+              "orientation[=<beta>]",
+              "provide the orientation of the 3DS, fused from the gyroscope "
+              "and accelerometer, as a device of its own; 'beta' is how fast "
+              "the accelerometer corrects the drift of the gyroscope (in "
+              "rad/s, defaults to " STRINGIFY(FUSION_BETA_DEFAULT) ")\n");
     print_opt("p",
               "port=<num>",
               "listen on port 'num' (defaults to " PORT_DEFAULT ")\n");
+    print_opt("P",
+              "pool=<num>",
+              "create 'num' sets of devices up front and keep the ones of "
+              "disconnected 3DS units around for the next one (defaults to "
+              "0)\n");
+    print_opt("R",
+              "realtime[=<cpu>]",
+              "busy-poll the socket, lock all memory and receive under "
+              "SCHED_FIFO pinned to 'cpu' (defaults to the current one)\n");
+    print_opt("r",
+              "receiver=<name>",
+              "how packets are read from the socket (possible values are: "
+              "recvfrom, recvmmsg or io_uring, defaults to recvfrom)\n");
+    print_opt("s",
+              "upsample=<hz>",
+              "write the circle pad, C-stick and touch position 'hz' times "
+              "per second, interpolated between packets (at most "
+              STRINGIFY(CTROLLER_OUTPUT_RATE_MAX) ", defaults to 0, which "
+              "writes them as they arrive)\n");
+    print_opt("t",
+              "threshold=<device>:<n>[,<n>,<n>]",
+              "only report an axis of the gyroscope, accelerometer or "
+              "orientation once it moved by 'n' (per axis, x, y and z)\n");
     print_opt("u",
               "uinput-device=<path>",
               "uinput character "
@@ -63,8 +159,8 @@ void print_usage(void)
     print_opt("x",
               "exclude=<device1>[,<device2>,...]",
               "3DS devices that will not be provided to the system"
-              " (possible values are: gamepad, touchscreen, gyroscope or "
-              "accelerometer)\n");
+              " (possible values are: gamepad, touchscreen, gyroscope, "
+              "accelerometer or orientation)\n");
     print_opt("v", "version", "prints ctroller version\n");
 #undef print_opt
 }
@@ -77,8 +173,203 @@ static const struct device_name_to_id {
     {"touchscreen", DEVICE_TOUCHSCREEN},
     {"gyroscope", DEVICE_GYROSCOPE},
     {"accelerometer", DEVICE_ACCELEROMETER},
+    {"orientation", DEVICE_ORIENTATION},
+};
+
+static const struct receiver_name_to_poll {
+    const char *name;
+    ctroller_call_poll *poll;
+} recv_to_poll[] = {
+    {"recvfrom", ctroller_poll_hid_info},
+    {"recvmmsg", ctroller_poll_hid_batch},
+    {"io_uring", ctroller_poll_hid_uring},
 };
 
+static ctroller_call_poll *parse_receiver(const char *name)
+{
+    for (size_t i = 0; i < arrsize(recv_to_poll); i++) {
+        if (strcmp(recv_to_poll[i].name, name) == 0) {
+            return recv_to_poll[i].poll;
+        }
+    }
+    return NULL;
+}
+
+/* Parses the "<device>:" in front of the settings of a motion sensor */
+static int parse_motion_device(const char *arg, const char **settings)
+{
+    const char *colon = strchr(arg, ':');
+    if (colon == NULL) {
+        return -1;
+    }
+    *settings = colon + 1;
+
+    size_t len = colon - arg;
+    for (size_t i = 0; i < arrsize(dev_to_id); i++) {
+        if (strncmp(dev_to_id[i].name, arg, len) == 0 &&
+            dev_to_id[i].name[len] == '\0' &&
+            (dev_to_id[i].id == DEVICE_GYROSCOPE ||
+             dev_to_id[i].id == DEVICE_ACCELEROMETER ||
+             dev_to_id[i].id == DEVICE_ORIENTATION)) {
+            return dev_to_id[i].id;
+        }
+    }
+    return -1;
+}
+
+static int parse_threshold(const char *arg)
+{
+    const char *settings;
+    int32_t threshold[3];
+    char tail;
+
+    int id = parse_motion_device(arg, &settings);
+    if (id < 0) {
+        return -1;
+    }
+
+    int count = sscanf(settings,
+                       "%d,%d,%d%c",
+                       &threshold[0],
+                       &threshold[1],
+                       &threshold[2],
+                       &tail);
+    if (count == 1) {
+        threshold[1] = threshold[2] = threshold[0];
+    } else if (count != 3) {
+        return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (threshold[i] < 0) {
+            return -1;
+        }
+        motion_config[id].threshold[i] = threshold[i];
+    }
+    return 0;
+}
+
+static int parse_rate(const char *arg)
+{
+    const char *settings;
+    unsigned rate;
+    char tail;
+
+    int id = parse_motion_device(arg, &settings);
+    if (id < 0 || sscanf(settings, "%u%c", &rate, &tail) != 1) {
+        return -1;
+    }
+    motion_config[id].rate = rate;
+    return 0;
+}
+
+static int parse_smooth(const char *arg)
+{
+    const char *settings;
+    double cutoff[3];
+    double beta[3];
+    char tail;
+
+    // The orientation is smoothed by the gyroscope it integrates
+    int id = parse_motion_device(arg, &settings);
+    if (id < 0 || id == DEVICE_ORIENTATION) {
+        return -1;
+    }
+
+    int count = sscanf(settings,
+                       "%lf/%lf,%lf/%lf,%lf/%lf%c",
+                       &cutoff[0],
+                       &beta[0],
+                       &cutoff[1],
+                       &beta[1],
+                       &cutoff[2],
+                       &beta[2],
+                       &tail);
+    if (count == 2) {
+        cutoff[1] = cutoff[2] = cutoff[0];
+        beta[1]   = beta[2] = beta[0];
+    } else if (count != 6) {
+        return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (!(cutoff[i] >= 0 && cutoff[i] <= MOTION_CUTOFF_MAX) ||
+            !(beta[i] >= 0 && beta[i] <= MOTION_BETA_MAX)) {
+            return -1;
+        }
+        motion_config[id].cutoff[i] = cutoff[i];
+        motion_config[id].beta[i]   = beta[i];
+    }
+    return 0;
+}
+
+static int parse_gate(const char *arg)
+{
+    uint32_t gate     = 0;
+    const char *input = arg;
+    const char *end;
+
+    do {
+        char name[32];
+        end = strchrnul(input, '+');
+        if (end - input >= (ptrdiff_t) sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, input, end - input);
+        name[end - input] = '\0';
+
+        uint32_t key = keymap_parse_input(name);
+        if (key == 0) {
+            return -1;
+        }
+        gate |= key;
+        input = end + 1;
+    } while (*end != '\0');
+
+    motion_config[DEVICE_GYROSCOPE].gate     = gate;
+    motion_config[DEVICE_ACCELEROMETER].gate = gate;
+    motion_config[DEVICE_ORIENTATION].gate   = gate;
+    return gate != 0 ? 0 : -1;
+}
+
+static int parse_stick(const char *arg)
+{
+    static const char *const names[STICKS_COUNT] = {
+        [STICK_CIRCLEPAD] = "circlepad",
+        [STICK_CSTICK]    = "cstick",
+    };
+    struct stick_config config = {.outer = 100, .curve = 1};
+    int end                    = 0;
+
+    const char *colon = strchr(arg, ':');
+    if (colon == NULL) {
+        return -1;
+    }
+
+    int id = -1;
+    for (int i = 0; i < STICKS_COUNT; i++) {
+        if (strncmp(names[i], arg, colon - arg) == 0 &&
+            names[i][colon - arg] == '\0') {
+            id = i;
+        }
+    }
+
+    // end is left after the last of the settings that were given
+    int count = sscanf(colon + 1,
+                       "%u%n,%u,%u%n,%lf%n",
+                       &config.deadzone,
+                       &end,
+                       &config.anti_deadzone,
+                       &config.outer,
+                       &end,
+                       &config.curve,
+                       &end);
+    if (id < 0 || count == 2 || count < 1 || colon[1 + end] != '\0') {
+        return -1;
+    }
+    return stick_configure(id, &config);
+}
+
 static device_mask_t parse_device_mask(const char *device_list)
 {
     device_mask_t mask  = 0;
@@ -102,34 +393,337 @@ static device_mask_t parse_device_mask(const char *device_list)
     return mask;
 }
 
+struct options {
+    char *uinput_device;
+    char *port;
+    int daemonize;
+    unsigned device_exclude_mask;
+    int composite;
+    int uhid;
+    int orientation;
+    char *keymap;
+    ctroller_call_poll *poll;
+    int output_uring;
+    int workers;
+    unsigned idle_teardown;
+    unsigned pool;
+    unsigned output_rate;
+    unsigned horizon;
+    int realtime;
+    int cpu;
+    unsigned flags;
+    int version;
+};
+
+static int pin_to_cpu(int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err) {
+        fprintf(
+            stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/* Move the calling thread, already pinned, into the real-time class and fault
+ * in its buffers. None of this is required to run, so failures, mostly for
+ * lack of CAP_SYS_NICE, are reported and otherwise ignored.
+ */
+static void realtime_enter(void)
+{
+    struct sched_param param = {.sched_priority = REALTIME_PRIORITY};
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err) {
+        fprintf(stderr, "Failed to enter SCHED_FIFO: %s\n", strerror(err));
+    }
+
+    ctroller_prefault();
+}
+
+static int run(const struct options *options, unsigned flags)
+{
+    int res;
+    ctroller_call_poll *poll = options->poll;
+
+    device_mask_t device_mask = ~options->device_exclude_mask & DEVICE_MASK_ALL;
+    if (!options->orientation) {
+        device_mask &= ~BIT(DEVICE_ORIENTATION);
+    }
+    if (options->composite) {
+        device_mask |= DEVICE_MASK_COMPOSITE;
+    }
+    if (options->uhid) {
+        device_mask |= DEVICE_MASK_UHID;
+    }
+
+    if (ctroller_init(options->uinput_device,
+                      options->port,
+                      device_mask,
+                      options->flags | flags) == -1) {
+        perror("Error initializing ctroller");
+        return EXIT_FAILURE;
+    }
+
+    if (poll == ctroller_poll_hid_uring && ctroller_uring_init() < 0) {
+        perror("io_uring receiver unavailable, falling back to recvfrom");
+        poll = ctroller_poll_hid_info;
+    }
+
+    if (options->output_uring && ctroller_output_uring_init() < 0) {
+        perror("io_uring output unavailable, falling back to write");
+    }
+
+    if (options->realtime) {
+        realtime_enter();
+    }
+
+    printf("Waiting for incoming packets...\n");
+
+    while (1) {
+        res = poll();
+        if (res == CTROLLER_POLL_EXIT) {
+            res = EXIT_SUCCESS;
+            break;
+        }
+        if (res < 0) {
+            fprintf(stderr, "An error occured (%d). Exiting...", res);
+            fflush(stderr);
+            res = EXIT_FAILURE;
+            break;
+        }
+
+        if (res == 0 && !options->daemonize) {
+            puts("Timeout waiting for 3DS. Retrying...");
+        }
+    }
+
+    puts("Exiting...");
+
+    ctroller_exit();
+
+    return res;
+}
+
+/* Reloads the keymap whenever its file is saved. The directory is watched
+ * rather than the file, as editors tend to save by renaming a new file over
+ * the old one.
+ */
+struct keymap_watch {
+    pthread_t thread;
+    const char *path;
+    const char *name;
+    int fd;
+};
+
+static void *keymap_watch_run(void *arg)
+{
+    struct keymap_watch *watch = arg;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(watch->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to watch keymap");
+            return NULL;
+        }
+
+        int changed = 0;
+        const struct inotify_event *event;
+        for (char *ptr = buf; ptr < buf + len;
+             ptr += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->len > 0 && strcmp(event->name, watch->name) == 0) {
+                changed = 1;
+            }
+        }
+        if (!changed) {
+            continue;
+        }
+
+        // Gamepads pick the new map up on their next write; building it is
+        // not to be cut short by keymap_watch_stop()
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        struct keymap *keymap = keymap_load(watch->path);
+        if (keymap == NULL) {
+            fprintf(stderr, "Keeping the current keymap.\n");
+        } else if (gamepad_set_keymap(keymap) < 0) {
+            keymap_free(keymap);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+}
+
+static int keymap_watch_start(struct keymap_watch *watch, const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    watch->path = path;
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+        watch->name = path;
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+        if (dir[0] == '\0') {
+            snprintf(dir, sizeof(dir), "/");
+        }
+        watch->name = slash + 1;
+    }
+
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd < 0 ||
+        inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("Failed to watch keymap");
+        goto failure;
+    }
+
+    int err = pthread_create(&watch->thread, NULL, keymap_watch_run, watch);
+    if (err) {
+        fprintf(stderr, "Failed to watch keymap: %s\n", strerror(err));
+        goto failure;
+    }
+    return 0;
+
+failure:
+    if (watch->fd >= 0) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+    return -1;
+}
+
+static void keymap_watch_stop(struct keymap_watch *watch)
+{
+    if (watch->fd < 0) {
+        return;
+    }
+    pthread_cancel(watch->thread);
+    pthread_join(watch->thread, NULL);
+    close(watch->fd);
+    watch->fd = -1;
+}
+
+struct worker {
+    pthread_t thread;
+    int cpu;
+    const struct options *options;
+    int res;
+};
+
+static void *worker_run(void *arg)
+{
+    struct worker *worker = arg;
+
+    pin_to_cpu(worker->cpu);
+
+    worker->res = run(worker->options, CTROLLER_REUSEPORT);
+    return NULL;
+}
+
+/* Every worker binds its own socket with SO_REUSEPORT; the kernel hashes each
+ * client onto one of them, so a worker owns its clients' sessions and devices
+ * without sharing any state with the other workers.
+ */
+static int run_workers(const struct options *options)
+{
+    int res = EXIT_SUCCESS;
+    struct worker workers[options->workers];
+
+    cpu_set_t online;
+    if (sched_getaffinity(0, sizeof(online), &online) < 0) {
+        perror("Failed to query available CPUs");
+        return EXIT_FAILURE;
+    }
+
+    int cpu = (options->cpu >= 0) ? options->cpu - 1 : -1;
+    for (int i = 0; i < options->workers; i++) {
+        // Spread workers round-robin over the CPUs we may run on, starting
+        // at the one chosen for real-time mode
+        do {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(cpu, &online));
+
+        workers[i].cpu     = cpu;
+        workers[i].options = options;
+        workers[i].res     = EXIT_SUCCESS;
+
+        int err =
+            pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        if (err) {
+            fprintf(stderr, "Failed to start worker: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < options->workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].res != EXIT_SUCCESS) {
+            res = workers[i].res;
+        }
+    }
+
+    return res;
+}
+
 int main(int argc, char *argv[])
 {
     int res = EXIT_SUCCESS;
 
     // clang-format off
-    struct options {
-        char *uinput_device;
-        char *port;
-        int daemonize;
-        unsigned device_exclude_mask;
-        char *keymap;
-        int version;
-    } options = {
+    struct options options = {
         .uinput_device       = NULL,
         .port                = NULL,
         .daemonize           = 0,
         .device_exclude_mask = 0,
+        .composite           = 0,
+        .uhid                = 0,
+        .orientation         = 0,
         .keymap              = NULL,
+        .poll                = ctroller_poll_hid_info,
+        .output_uring        = 0,
+        .workers             = 1,
+        .idle_teardown       = 0,
+        .pool                = 0,
+        .output_rate         = 0,
+        .horizon             = 0,
+        .realtime            = 0,
+        .cpu                 = -1,
+        .flags               = 0,
         .version             = 0,
     };
 
     static const struct option optstrings[] = {
+        {"analog",          required_argument, NULL, 'a'},
+        {"backend",         required_argument, NULL, 'b'},
+        {"composite",       no_argument,       NULL, 'c'},
         {"daemonize",       no_argument,       NULL, 'd'},
+        {"predict",         required_argument, NULL, 'e'},
+        {"max-rate",        required_argument, NULL, 'f'},
+        {"smooth",          required_argument, NULL, 'm'},
+        {"motion-gate",     required_argument, NULL, 'g'},
         {"help",            no_argument,       NULL, 'h'},
+        {"idle-teardown",   required_argument, NULL, 'i'},
         {"port",            required_argument, NULL, 'p'},
+        {"pool",            required_argument, NULL, 'P'},
         {"uinput-device",   required_argument, NULL, 'u'},
         {"exclude",         required_argument, NULL, 'x'},
+        {"threshold",       required_argument, NULL, 't'},
+        {"upsample",        required_argument, NULL, 's'},
         {"keymap",          required_argument, NULL, 'k'},
+        {"receiver",        required_argument, NULL, 'r'},
+        {"output",          required_argument, NULL, 'o'},
+        {"orientation",     optional_argument, NULL, 'O'},
+        {"workers",         required_argument, NULL, 'j'},
+        {"realtime",        optional_argument, NULL, 'R'},
+        {"latency",         no_argument,       NULL, 'l'},
         {"version",         no_argument,       NULL, 'v'},
         {NULL,              0,                 NULL, 0},
     };
@@ -137,20 +731,61 @@ int main(int argc, char *argv[])
 
     int index = 0;
     int curopt;
-    while ((curopt = getopt_long(argc, argv, "dhp:u:x:k:v", optstrings, &index)) !=
+    while ((curopt = getopt_long(argc, argv, "a:b:cde:f:g:hi:m:p:P:u:x:s:t:k:r:o:O::j:R::lv", optstrings, &index)) !=
            -1) {
         switch (curopt) {
         case 0:
             break;
+        case 'b':
+            if (strcmp(optarg, "uhid") == 0) {
+                options.uhid = 1;
+            } else if (strcmp(optarg, "uinput") != 0) {
+                fprintf(stderr, "Unknown backend '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            options.composite = 1;
+            break;
         case 'd':
             options.daemonize = 1;
             break;
+        case 'e': {
+            char tail;
+            if (sscanf(optarg, "%u%c", &options.horizon, &tail) != 1 ||
+                options.horizon > PREDICT_GAP_MAX_MS) {
+                fprintf(stderr, "Invalid prediction '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        }
         case 'h':
             print_usage();
             return EXIT_SUCCESS;
+        case 'i': {
+            char tail;
+            if (sscanf(optarg, "%u%c", &options.idle_teardown, &tail) != 1) {
+                fprintf(stderr, "Invalid idle teardown '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        }
         case 'p':
             options.port = optarg;
             break;
+        case 'P': {
+            char tail;
+            if (sscanf(optarg, "%u%c", &options.pool, &tail) != 1 ||
+                options.pool > SESSIONS_MAX) {
+                fprintf(stderr, "Invalid pool size '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        }
         case 'u':
             options.uinput_device = optarg;
             printf("uinput device: %s\n", optarg);
@@ -158,9 +793,104 @@ int main(int argc, char *argv[])
         case 'x':
             options.device_exclude_mask = parse_device_mask(optarg);
             break;
+        case 's': {
+            char tail;
+            if (sscanf(optarg, "%u%c", &options.output_rate, &tail) != 1 ||
+                options.output_rate > CTROLLER_OUTPUT_RATE_MAX) {
+                fprintf(stderr, "Invalid output rate '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'a':
+            if (parse_stick(optarg) < 0) {
+                fprintf(stderr, "Invalid stick shape '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (parse_threshold(optarg) < 0) {
+                fprintf(stderr, "Invalid threshold '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            if (parse_rate(optarg) < 0) {
+                fprintf(stderr, "Invalid rate '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            if (parse_smooth(optarg) < 0) {
+                fprintf(stderr, "Invalid smoothing '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            if (parse_gate(optarg) < 0) {
+                fprintf(stderr, "Invalid motion gate '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
         case 'k':
             options.keymap = optarg;
             break;
+        case 'r':
+            options.poll = parse_receiver(optarg);
+            if (options.poll == NULL) {
+                fprintf(stderr, "Unknown receiver '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "io_uring") == 0) {
+                options.output_uring = 1;
+            } else if (strcmp(optarg, "write") != 0) {
+                fprintf(stderr, "Unknown output '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'O':
+            options.orientation = 1;
+            if (optarg != NULL) {
+                char tail;
+                if (sscanf(optarg, "%lf%c", &fusion_beta, &tail) != 1 ||
+                    !(fusion_beta > 0 && fusion_beta <= FUSION_BETA_MAX)) {
+                    fprintf(stderr, "Invalid orientation gain '%s'.\n", optarg);
+                    print_usage();
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+        case 'j':
+            options.workers = atoi(optarg);
+            if (options.workers < 1 || options.workers > CPU_SETSIZE) {
+                fprintf(stderr, "Invalid number of workers '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            options.realtime = 1;
+            options.flags |= CTROLLER_BUSY_POLL;
+            if (optarg != NULL) {
+                options.cpu = atoi(optarg);
+                if (options.cpu < 0 || options.cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid CPU '%s'.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+        case 'l':
+            options.flags |= CTROLLER_LATENCY;
+            break;
         case 'v':
             options.version = 1;
             break;
@@ -170,10 +900,32 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (options.uhid && options.composite) {
+        fprintf(stderr, "--composite is only available with uinput.\n");
+        return EXIT_FAILURE;
+    }
+
     if (options.version) {
         printf("android-%s\n", CTROLLER_VERSION_STRING);
         exit(EXIT_SUCCESS);
     }
+
+    // Before daemonizing, as the sockets are passed to this very process
+    int listen_fds = ctroller_listen_fds();
+    if (listen_fds < 0) {
+        return EXIT_FAILURE;
+    }
+    if (listen_fds > options.workers) {
+        fprintf(stderr,
+                "Only using %d of the %d passed sockets, one per worker.\n",
+                options.workers,
+                listen_fds);
+    }
+    ctroller_set_idle_teardown(options.idle_teardown);
+    ctroller_set_pool(options.pool);
+    ctroller_set_output_rate(options.output_rate);
+    ctroller_set_prediction(options.horizon);
+    motion_smooth_init();
     
     if (options.daemonize) {
         printf("Daemonizing %s...\n", "ctroller-android");
@@ -184,60 +936,67 @@ int main(int argc, char *argv[])
     }
 
     // If the keymap file is specified, load it.
-    if(options.keymap != NULL) load_keymap(options.keymap);
-    
-    if (ctroller_init(options.uinput_device,
-                      options.port,
-                      ~options.device_exclude_mask) == -1) {
-        perror("Error initializing ctroller");
-        exit(EXIT_FAILURE);
+    struct keymap *keymap = NULL;
+    if (options.keymap != NULL) {
+        keymap = keymap_load(options.keymap);
+        if (keymap == NULL) {
+            fprintf(stderr, "Reverting to default keymap.\n\n");
+        }
+    }
+    if (keymap == NULL && (keymap = keymap_default()) == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (gamepad_set_keymap(keymap) < 0) {
+        keymap_free(keymap);
+        return EXIT_FAILURE;
     }
     
+    // Termination signals are only ever seen through a signalfd in the event
+    // loop of each thread, so shutdown happens outside of signal context.
+    // Blocking them here, before any worker starts, makes every thread
+    // inherit the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
 
-    if (signal(SIGINT, on_terminate) == SIG_ERR) {
-        fprintf(stderr, "Failed to register SIGINT handler.\n");
+    int signal_fd = -1;
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+        (signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("Failed to set up signal handling");
+        return EXIT_FAILURE;
     }
+    ctroller_set_signal_fd(signal_fd);
 
-    printf("Waiting for incoming packets...\n");
+    // Started before real-time mode pins this thread, so that it stays out of
+    // the way of the receive loop
+    struct keymap_watch watch = {.fd = -1};
+    if (options.keymap != NULL) {
+        keymap_watch_start(&watch, options.keymap);
+    }
 
-    int connected      = 0;
-    struct hidinfo hid = {};
-    while (1) {
-        res = ctroller_poll_hid_info(&hid);
-        if (res < 0) {
-            fprintf(stderr, "An error occured (%d). Exiting...", res);
-            fflush(stderr);
-            res = EXIT_FAILURE;
-            break;
+    if (options.realtime) {
+        // Lock before any worker starts, so that their stacks are locked too
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            perror("Failed to lock memory");
         }
-
-        if (res != 0) {
-            if (!connected) {
-                printf("Nintendo 3DS connected. (ctroller version "
-                       "%01d.%01d.%01d)\n",
-                       (hid.version & 0x0f00) >> 8,
-                       (hid.version & 0x00f0) >> 4,
-                       (hid.version & 0x000f) >> 0);
-                connected = 1;
-                if (hid.version != CTROLLER_VERSION) {
-                    fprintf(stderr,
-                            "Server version (%#04x) and client version "
-                            "(%#04x) differ.\n",
-                            CTROLLER_VERSION,
-                            hid.version);
-                }
-            }
-            ctroller_write_hid_info(&hid);
-        } else {
-            connected = 0;
-            memset(&hid, 0, sizeof(hid));
-            if (!options.daemonize) {
-                puts("Timeout waiting for 3DS. Retrying...");
-            }
+        if (options.cpu < 0) {
+            options.cpu = sched_getcpu();
+        }
+        if (options.workers == 1) {
+            pin_to_cpu(options.cpu);
         }
     }
 
-    ctroller_exit();
+    if (options.workers > 1) {
+        res = run_workers(&options);
+    } else {
+        res = run(&options, 0);
+    }
 
+    keymap_watch_stop(&watch);
+    close(signal_fd);
+    gamepad_free_keymaps();
+    stick_free();
     return res;
 }
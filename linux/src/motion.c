@@ -0,0 +1,235 @@
+#include "motion.h"
+#include "hid.h"
+#include "predict.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Fractional bits of the compiled betas */
+#define MOTION_BETA_SHIFT 20
+
+/* Packets missing in a row after which the filters start over */
+#define MOTION_SMOOTH_GAP_MAX 15
+
+/* Largest 2 pi f dt the filters use; beyond it, the smoothing factor is 1 in
+ * all but the last bit
+ */
+#define MOTION_RATE_MAX (1 << (2 * MOTION_ALPHA_SHIFT))
+
+typedef int16_t motion_axes
+    __attribute__((vector_size(MOTION_LANES * sizeof(int16_t))));
+typedef float motion_factors
+    __attribute__((vector_size(MOTION_LANES * sizeof(float))));
+
+struct motion_config motion_config[DEVICES_COUNT];
+
+__thread struct motion_stats motion_stats;
+
+/* motion_config compiled by motion_smooth_init(). Rates are 2 pi f dt for a
+ * frame, in 1/(1 << MOTION_ALPHA_SHIFT).
+ */
+static struct {
+    int enabled;
+    int32_t speed_rate;     // of the speed estimate
+    int32_t speed_alpha;    // its smoothing factor over a single frame
+    motion_lanes rest_rate; // at rest
+    motion_lanes beta;      // rate per speed, see MOTION_BETA_SHIFT
+    motion_lanes speed_max; // beyond which beta * speed would overflow
+    motion_lanes pass;      // -1 in lanes that are not filtered
+} motion_smooth_params;
+
+/* Whether the value in a slot differs from the one last reported */
+static inline int motion_changed(const struct device_context *dev,
+                                 unsigned slot,
+                                 int32_t value)
+{
+    return !(dev->shadow_valid & (1ull << slot)) || dev->shadow[slot] != value;
+}
+
+/* Number of axes that changed before a filter but no longer do after it */
+static unsigned motion_suppressed(const struct device_context *dev,
+                                  unsigned slot,
+                                  const int32_t before[3],
+                                  const int32_t after[3])
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        count += motion_changed(dev, slot + i, before[i]) &&
+                 !motion_changed(dev, slot + i, after[i]);
+    }
+    return count;
+}
+
+int motion_filter(struct device_context *dev,
+                  enum DEVICE_ID id,
+                  unsigned slot,
+                  const struct hidinfo *hid,
+                  int32_t values[3])
+{
+    const struct motion_config *config = &motion_config[id];
+    int32_t raw[3] = {values[0], values[1], values[2]};
+
+    if (config->gate && (hid->keys.held & config->gate) != config->gate) {
+        // Released right away, regardless of the other filters
+        values[0] = values[1] = values[2] = 0;
+        motion_stats.gated += motion_suppressed(dev, slot, raw, values);
+        return 1;
+    }
+
+    if (config->threshold[0] | config->threshold[1] | config->threshold[2]) {
+        for (unsigned i = 0; i < 3; i++) {
+            int32_t threshold = config->threshold[i];
+            if ((dev->shadow_valid & (1ull << (slot + i))) &&
+                abs(values[i] - dev->shadow[slot + i]) < threshold) {
+                values[i] = dev->shadow[slot + i];
+            }
+        }
+        motion_stats.hysteresis += motion_suppressed(dev, slot, raw, values);
+    }
+
+    if (config->rate == 0) {
+        return 1;
+    }
+
+    unsigned changed = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        changed += motion_changed(dev, slot + i, values[i]);
+    }
+    if (changed == 0) {
+        return 1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (now < dev->motion_deadline[id]) {
+        motion_stats.rate += changed;
+        return 0;
+    }
+    dev->motion_deadline[id] = now + 1000000000 / config->rate;
+    return 1;
+}
+
+static inline int32_t motion_rate(double hz)
+{
+    return lround(2 * M_PI * hz * PREDICT_FRAME_US / 1e6 *
+                  (1 << MOTION_ALPHA_SHIFT));
+}
+
+int motion_smooth_init(void)
+{
+    static const enum DEVICE_ID sensors[] = {
+        DEVICE_GYROSCOPE,
+        DEVICE_ACCELEROMETER,
+    };
+    typeof(motion_smooth_params) *params = &motion_smooth_params;
+
+    params->enabled     = 0;
+    params->speed_rate  = motion_rate(MOTION_SPEED_CUTOFF);
+    params->speed_alpha = (params->speed_rate << MOTION_ALPHA_SHIFT) /
+                          ((1 << MOTION_ALPHA_SHIFT) + params->speed_rate);
+    for (unsigned lane = 0; lane < MOTION_LANES; lane++) {
+        const struct motion_config *config =
+            lane < 6 ? &motion_config[sensors[lane / 3]] : NULL;
+        if (config == NULL || !(config->cutoff[lane % 3] > 0)) {
+            params->pass[lane] = -1;
+            continue;
+        }
+
+        int32_t beta = lround(2 * M_PI * config->beta[lane % 3] *
+                              (1 << MOTION_BETA_SHIFT));
+        params->rest_rate[lane] = motion_rate(config->cutoff[lane % 3]);
+        params->beta[lane]      = beta;
+        params->speed_max[lane] = beta > 0 ? INT32_MAX / beta : INT32_MAX;
+        params->pass[lane]      = 0;
+        params->enabled         = 1;
+    }
+    return params->enabled;
+}
+
+/* Limit lanes that are not negative to max. Without SSE4.1, a plain
+ * minimum is done lane by lane, so the excess is masked off by its sign.
+ * Vectors are passed by pointer, as their ABI depends on the instruction set
+ * compiled for.
+ */
+static inline void motion_limit(motion_lanes *lanes, const motion_lanes *max)
+{
+    motion_lanes excess = *lanes - *max;
+    *lanes -= excess & ~(excess >> 31);
+}
+
+void motion_smooth(struct motion_smooth *smooth, struct hidinfo *hid)
+{
+    const typeof(motion_smooth_params) *params = &motion_smooth_params;
+    if (!params->enabled) {
+        return;
+    }
+
+    // The axes of each sensor are consecutive, so both load at once
+    motion_axes axes = {};
+    memcpy(&axes[0], &hid->gyro, sizeof(hid->gyro));
+    memcpy(&axes[3], &hid->accel, sizeof(hid->accel));
+
+    motion_lanes raw   = __builtin_convertvector(axes, motion_lanes);
+    motion_lanes value = raw << MOTION_VALUE_SHIFT;
+
+    // Packets of revision 0 carry no sequence number, take them as they come
+    int32_t frames   = hid->sequence - smooth->sequence;
+    frames           = hid->sequence != 0 ? frames : 1;
+    smooth->sequence = hid->sequence;
+
+    if (!smooth->valid || frames <= 0 || frames > MOTION_SMOOTH_GAP_MAX) {
+        smooth->value = value;
+        smooth->speed = (motion_lanes){};
+        smooth->valid = 1;
+        return;
+    }
+
+    // Values and speeds stay within 17 bits plus their fractional ones, so
+    // every product with a factor of up to 1 << MOTION_ALPHA_SHIFT fits
+    const int32_t one   = 1 << MOTION_ALPHA_SHIFT;
+    const int32_t round = one >> 1;
+
+    // The speed, low-pass filtered at a fixed cutoff
+    motion_lanes speed = (value - smooth->value) >>
+                         (MOTION_VALUE_SHIFT - MOTION_SPEED_SHIFT);
+    int32_t alpha = params->speed_alpha;
+    if (frames > 1) {
+        int32_t rate = params->speed_rate * frames;
+        alpha        = (rate << MOTION_ALPHA_SHIFT) / (one + rate);
+        speed /= frames;
+    }
+    smooth->speed += (alpha * (speed - smooth->speed) + round) >>
+                     MOTION_ALPHA_SHIFT;
+
+    // The faster an axis moves, the higher its cutoff
+    motion_lanes sign = smooth->speed >> 31;
+    speed             = (smooth->speed ^ sign) - sign;
+    motion_limit(&speed, &params->speed_max);
+
+    motion_lanes rates =
+        params->rest_rate +
+        ((params->beta * speed) >>
+         (MOTION_BETA_SHIFT + MOTION_SPEED_SHIFT - MOTION_ALPHA_SHIFT));
+    const motion_lanes rate_max = (motion_lanes){} + MOTION_RATE_MAX;
+    rates *= frames;
+    motion_limit(&rates, &rate_max);
+
+    // Vectors of integers cannot be divided but lane by lane, so the
+    // smoothing factors are divided out in single precision
+    motion_factors factors = __builtin_convertvector(rates, motion_factors);
+    factors                = factors * (float) one / (factors + (float) one);
+    motion_lanes alphas    = __builtin_convertvector(factors, motion_lanes);
+    smooth->value += (alphas * (value - smooth->value) + round) >>
+                     MOTION_ALPHA_SHIFT;
+
+    motion_lanes out = (smooth->value + (1 << (MOTION_VALUE_SHIFT - 1))) >>
+                       MOTION_VALUE_SHIFT;
+    out = (out & ~params->pass) | (raw & params->pass);
+
+    axes = __builtin_convertvector(out, motion_axes);
+    memcpy(&hid->gyro, &axes[0], sizeof(hid->gyro));
+    memcpy(&hid->accel, &axes[3], sizeof(hid->accel));
+}
@@ -0,0 +1,115 @@
+#include "predict.h"
+
+__thread struct predict_stats predict_stats;
+
+static inline int32_t predict_clamp(int64_t value, int64_t min, int64_t max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+static void predict_get(const struct hidinfo *hid,
+                        int32_t values[PREDICT_AXES])
+{
+    values[0] = hid->circlepad.dx;
+    values[1] = hid->circlepad.dy;
+    values[2] = hid->cstick.dx;
+    values[3] = hid->cstick.dy;
+    values[4] = hid->gyro.x;
+    values[5] = hid->gyro.y;
+    values[6] = hid->gyro.z;
+}
+
+static void predict_set(struct hidinfo *hid,
+                        const int32_t values[PREDICT_AXES])
+{
+    hid->circlepad.dx = values[0];
+    hid->circlepad.dy = values[1];
+    hid->cstick.dx    = values[2];
+    hid->cstick.dy    = values[3];
+    hid->gyro.x       = values[4];
+    hid->gyro.y       = values[5];
+    hid->gyro.z       = values[6];
+}
+
+void predict_update(struct predict *predict,
+                    const struct hidinfo *hid,
+                    uint64_t now)
+{
+    int32_t values[PREDICT_AXES];
+    predict_get(hid, values);
+    predict_stats.updates++;
+
+    // Revision 0 packets have no sequence numbers, count the frames since
+    // the last one instead
+    int32_t frames = hid->sequence - predict->sequence;
+    if (hid->sequence == 0 && now > predict->last) {
+        frames = ((now - predict->last) / 1000 + PREDICT_FRAME_US / 2) /
+                 PREDICT_FRAME_US;
+        frames = frames > 0 ? frames : 1;
+    }
+
+    // How much longer than the fastest packet this one took to arrive; less
+    // than nothing if it was faster still
+    uint64_t sent = predict->last + (uint64_t) frames * PREDICT_FRAME_US * 1000;
+    int64_t late  = (int64_t) (now - sent);
+    if (predict->last == 0 || frames <= 0 ||
+        frames > PREDICT_RESET_MS * 1000 / PREDICT_FRAME_US ||
+        late > PREDICT_RESET_MS * 1000000ll) {
+        for (unsigned i = 0; i < PREDICT_AXES; i++) {
+            predict->axes[i].x = values[i] * 65536;
+            predict->axes[i].v = 0;
+        }
+        predict->last     = now;
+        predict->sequence = hid->sequence;
+        return;
+    }
+
+    // A packet faster than any before moves our idea of the client's clock
+    // back to it; otherwise it creeps forward, to follow the drift between
+    // the clocks and a lasting change of the delay.
+    if (late < 0) {
+        sent = now;
+    } else {
+        sent += late / PREDICT_DRIFT_DIV;
+    }
+
+    int64_t dt_us = (int64_t) frames * PREDICT_FRAME_US;
+    for (unsigned i = 0; i < PREDICT_AXES; i++) {
+        struct predict_axis *axis = &predict->axes[i];
+
+        int64_t x        = axis->x + (int64_t) axis->v * dt_us / 1000;
+        int64_t residual = (int64_t) values[i] * 65536 - x;
+        int64_t dv       = residual * PREDICT_BETA / 256 * 1000 / dt_us;
+
+        axis->x = predict_clamp(x + residual * PREDICT_ALPHA / 256,
+                                (int64_t) INT16_MIN * 65536,
+                                (int64_t) INT16_MAX * 65536);
+        axis->v = predict_clamp(axis->v + dv, INT32_MIN, INT32_MAX);
+    }
+    predict->last     = sent;
+    predict->sequence = hid->sequence;
+}
+
+void predict_apply(const struct predict *predict,
+                   struct hidinfo *hid,
+                   uint64_t at)
+{
+    if (predict->last == 0) {
+        return;
+    }
+
+    int64_t dt_us = at > predict->last ? (at - predict->last) / 1000 : 0;
+    if (dt_us > PREDICT_GAP_MAX_MS * 1000) {
+        dt_us = PREDICT_GAP_MAX_MS * 1000;
+    }
+
+    int32_t values[PREDICT_AXES];
+    for (unsigned i = 0; i < PREDICT_AXES; i++) {
+        const struct predict_axis *axis = &predict->axes[i];
+
+        // Round to the nearest unit
+        int64_t x = axis->x + (int64_t) axis->v * dt_us / 1000 + 32768;
+        values[i] = predict_clamp(x >> 16, INT16_MIN, INT16_MAX);
+    }
+    predict_set(hid, values);
+}
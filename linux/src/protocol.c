@@ -0,0 +1,183 @@
+#include "protocol.h"
+
+#include "ctroller.h"
+
+/* How a field is encoded relative to the base state */
+enum protocol_kind {
+    PROTOCOL_KIND_EDGE, // u32 sent as is, 0 if absent
+    PROTOCOL_KIND_MASK, // u32 XORed with the base
+    PROTOCOL_KIND_AXIS, // 16 bit zigzag difference to the base
+};
+
+#define PROTOCOL_FIELD(field, kind)                                            \
+    {offsetof(struct hidinfo, field), PROTOCOL_KIND_##kind}
+
+static const struct {
+    size_t offset;
+    enum protocol_kind kind;
+} protocol_fields[PROTOCOL_FIELD_COUNT] = {
+    [PROTOCOL_FIELD_KEYS_UP]     = PROTOCOL_FIELD(keys.up, EDGE),
+    [PROTOCOL_FIELD_KEYS_DOWN]   = PROTOCOL_FIELD(keys.down, EDGE),
+    [PROTOCOL_FIELD_KEYS_HELD]   = PROTOCOL_FIELD(keys.held, MASK),
+    [PROTOCOL_FIELD_TOUCH_X]     = PROTOCOL_FIELD(touchscreen.px, AXIS),
+    [PROTOCOL_FIELD_TOUCH_Y]     = PROTOCOL_FIELD(touchscreen.py, AXIS),
+    [PROTOCOL_FIELD_CIRCLEPAD_X] = PROTOCOL_FIELD(circlepad.dx, AXIS),
+    [PROTOCOL_FIELD_CIRCLEPAD_Y] = PROTOCOL_FIELD(circlepad.dy, AXIS),
+    [PROTOCOL_FIELD_CSTICK_X]    = PROTOCOL_FIELD(cstick.dx, AXIS),
+    [PROTOCOL_FIELD_CSTICK_Y]    = PROTOCOL_FIELD(cstick.dy, AXIS),
+    [PROTOCOL_FIELD_GYRO_X]      = PROTOCOL_FIELD(gyro.x, AXIS),
+    [PROTOCOL_FIELD_GYRO_Y]      = PROTOCOL_FIELD(gyro.y, AXIS),
+    [PROTOCOL_FIELD_GYRO_Z]      = PROTOCOL_FIELD(gyro.z, AXIS),
+    [PROTOCOL_FIELD_ACCEL_X]     = PROTOCOL_FIELD(accel.x, AXIS),
+    [PROTOCOL_FIELD_ACCEL_Y]     = PROTOCOL_FIELD(accel.y, AXIS),
+    [PROTOCOL_FIELD_ACCEL_Z]     = PROTOCOL_FIELD(accel.z, AXIS),
+};
+
+#undef PROTOCOL_FIELD
+
+_Static_assert(PROTOCOL_EDGE_RECORDS >> PROTOCOL_FIELD_COUNT,
+               "field bitmap has no room for the edge record flag");
+
+/* LEB128: seven bits per byte, least significant group first, the top bit
+ * set on every byte but the last.
+ */
+static const unsigned char *protocol_read_varint(const unsigned char *buf,
+                                                 const unsigned char *end,
+                                                 unsigned max,
+                                                 uint32_t *val)
+{
+    uint32_t result = 0;
+    for (unsigned i = 0; i < max && buf < end; i++) {
+        unsigned char byte = *buf++;
+        result |= (uint32_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *val = result;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static inline uint16_t protocol_unzigzag(uint32_t val)
+{
+    return (uint16_t) ((val >> 1) ^ -(val & 1));
+}
+
+int protocol_unpack_header(const unsigned char *buf,
+                           size_t len,
+                           struct protocol_header *header)
+{
+    if (len < PACKET_REV2_HEADER_SIZE) {
+        return -1;
+    }
+
+    header->version  = (uint16_t) (buf[2] << 8 | buf[3]);
+    header->sequence = (uint32_t) buf[4] << 24 | (uint32_t) buf[5] << 16 |
+                       (uint32_t) buf[6] << 8 | buf[7];
+    header->type     = buf[8];
+
+    return PACKET_REV2_HEADER_SIZE;
+}
+
+int protocol_pack_header(unsigned char *buf,
+                         const struct protocol_header *header)
+{
+    buf[0] = PACKET_MAGIC >> 8;
+    buf[1] = PACKET_MAGIC & 0xff;
+    buf[2] = header->version >> 8;
+    buf[3] = header->version & 0xff;
+    buf[4] = header->sequence >> 24;
+    buf[5] = header->sequence >> 16;
+    buf[6] = header->sequence >> 8;
+    buf[7] = header->sequence;
+    buf[8] = header->type;
+
+    return PACKET_REV2_HEADER_SIZE;
+}
+
+int protocol_decode_state(const unsigned char *body,
+                          size_t len,
+                          const struct hidinfo *base,
+                          struct hidinfo *hid,
+                          struct protocol_edges *edges)
+{
+    const unsigned char *end = body + len;
+    if (len < sizeof(uint16_t)) {
+        return -1;
+    }
+
+    unsigned bitmap = body[0] << 8 | body[1];
+    body += sizeof(uint16_t);
+
+    unsigned flags = bitmap & ~(BIT(PROTOCOL_FIELD_COUNT) - 1);
+    bitmap &= BIT(PROTOCOL_FIELD_COUNT) - 1;
+    if (flags & ~PROTOCOL_EDGE_RECORDS) {
+        return -1;
+    }
+
+    // Edges only ever belong to the packet carrying them
+    *hid           = *base;
+    hid->keys.up   = 0;
+    hid->keys.down = 0;
+
+    for (unsigned field = 0; bitmap != 0; field++, bitmap >>= 1) {
+        if (!(bitmap & 1)) {
+            continue;
+        }
+
+        enum protocol_kind kind = protocol_fields[field].kind;
+        void *target = (unsigned char *) hid + protocol_fields[field].offset;
+        uint32_t val;
+
+        body = protocol_read_varint(body,
+                                    end,
+                                    (kind == PROTOCOL_KIND_AXIS)
+                                        ? PROTOCOL_VARINT16_MAX
+                                        : PROTOCOL_VARINT32_MAX,
+                                    &val);
+        if (body == NULL) {
+            return -1;
+        }
+
+        switch (kind) {
+        case PROTOCOL_KIND_EDGE:
+            *(uint32_t *) target = val;
+            break;
+        case PROTOCOL_KIND_MASK:
+            *(uint32_t *) target ^= val;
+            break;
+        case PROTOCOL_KIND_AXIS:
+            *(uint16_t *) target += protocol_unzigzag(val);
+            break;
+        }
+    }
+
+    edges->count = 0;
+    if (flags & PROTOCOL_EDGE_RECORDS) {
+        if (body == end || *body > PROTOCOL_EDGE_RECORDS_MAX) {
+            return -1;
+        }
+        edges->count = *body++;
+
+        for (unsigned i = 0; i < edges->count; i++) {
+            uint32_t down, up;
+            if (body == end || *body == 0) {
+                return -1;
+            }
+            edges->records[i].distance = *body++;
+
+            body = protocol_read_varint(body, end, PROTOCOL_VARINT32_MAX, &down);
+            if (body == NULL) {
+                return -1;
+            }
+            body = protocol_read_varint(body, end, PROTOCOL_VARINT32_MAX, &up);
+            if (body == NULL) {
+                return -1;
+            }
+            edges->records[i].down = down;
+            edges->records[i].up   = up;
+        }
+    }
+
+    return (body == end) ? 0 : -1;
+}
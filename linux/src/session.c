@@ -0,0 +1,535 @@
+#include "session.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#define SESSION_NONE (-1)
+#define SESSION_TABLE_MASK (SESSION_TABLE_SIZE - 1)
+
+_Static_assert((SESSION_TABLE_SIZE & SESSION_TABLE_MASK) == 0,
+               "SESSION_TABLE_SIZE must be a power of two");
+_Static_assert(SESSION_TABLE_SIZE > SESSIONS_MAX,
+               "session index must have room for every slot");
+
+static const struct device_context *const device_templates[DEVICES_COUNT] = {
+    [DEVICE_GAMEPAD]       = &device_gamepad,
+    [DEVICE_TOUCHSCREEN]   = &device_touchscreen,
+    [DEVICE_GYROSCOPE]     = &device_gyroscope,
+    [DEVICE_ACCELEROMETER] = &device_accelerometer,
+    [DEVICE_ORIENTATION]   = &device_orientation,
+};
+
+/* FNV-1a over the parts of the address that identify a sender */
+static uint32_t session_hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t session_hash(const struct sockaddr *addr)
+{
+    uint32_t hash = 2166136261u;
+
+    switch (addr->sa_family) {
+    case AF_INET: {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        hash = session_hash_bytes(hash, &in->sin_addr, sizeof(in->sin_addr));
+        hash = session_hash_bytes(hash, &in->sin_port, sizeof(in->sin_port));
+        break;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        hash =
+            session_hash_bytes(hash, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        hash =
+            session_hash_bytes(hash, &in6->sin6_port, sizeof(in6->sin6_port));
+        break;
+    }
+    default:
+        break;
+    }
+
+    return hash;
+}
+
+static int session_addr_equal(const struct session *session,
+                              const struct sockaddr *addr)
+{
+    const struct sockaddr *own = (const struct sockaddr *) &session->addr;
+    if (own->sa_family != addr->sa_family) {
+        return 0;
+    }
+
+    switch (addr->sa_family) {
+    case AF_INET: {
+        const struct sockaddr_in *a = (const struct sockaddr_in *) own;
+        const struct sockaddr_in *b = (const struct sockaddr_in *) addr;
+        return a->sin_port == b->sin_port &&
+               a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6 *) own;
+        const struct sockaddr_in6 *b = (const struct sockaddr_in6 *) addr;
+        return a->sin6_port == b->sin6_port &&
+               memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) ==
+                   0;
+    }
+    default:
+        return 0;
+    }
+}
+
+void session_table_init(struct session_table *table)
+{
+    for (size_t i = 0; i < SESSION_TABLE_SIZE; i++) {
+        table->index[i] = SESSION_NONE;
+    }
+
+    // Hand out low slots first
+    for (int i = 0; i < SESSIONS_MAX; i++) {
+        table->free[i] = SESSIONS_MAX - 1 - i;
+    }
+    table->free_count = SESSIONS_MAX;
+    table->clock      = 0;
+
+    table->pool       = NULL;
+    table->pool_size  = 0;
+    table->pool_count = 0;
+    table->pool_mask  = 0;
+}
+
+struct session *session_lookup(struct session_table *table,
+                               const struct sockaddr *addr,
+                               socklen_t addr_len)
+{
+    (void) addr_len;
+
+    uint32_t hash = session_hash(addr);
+    for (uint32_t pos = hash;; pos++) {
+        int16_t slot = table->index[pos & SESSION_TABLE_MASK];
+        if (slot == SESSION_NONE) {
+            return NULL;
+        }
+
+        struct session *session = &table->slots[slot];
+        if (session->hash == hash && session_addr_equal(session, addr)) {
+            session->last_seen = ++table->clock;
+            return session;
+        }
+    }
+}
+
+static struct session *session_least_recent(struct session_table *table)
+{
+    struct session *oldest = NULL;
+    for (size_t i = 0; i < SESSION_TABLE_SIZE; i++) {
+        if (table->index[i] == SESSION_NONE) {
+            continue;
+        }
+        struct session *session = &table->slots[table->index[i]];
+        if (oldest == NULL || session->last_seen < oldest->last_seen) {
+            oldest = session;
+        }
+    }
+    return oldest;
+}
+
+/* Returns 0, or -1 if a device could not be created, in which case the ones
+ * that were are left for session_devices_destroy()
+ */
+static int session_devices_create(struct device_context *devices,
+                                  const char *uinput_device,
+                                  device_mask_t device_mask)
+{
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        devices[i]               = *device_templates[i];
+        devices[i].uinput_device = uinput_device;
+    }
+
+    // A composite device takes the place of the gamepad; the others stay
+    // closed
+    if (device_mask & DEVICE_MASK_COMPOSITE) {
+        struct device_context *composite = &devices[DEVICE_GAMEPAD];
+
+        *composite               = device_composite;
+        composite->parts         = device_mask & DEVICE_MASK_ALL;
+        composite->uinput_device = uinput_device;
+        fprintf(stderr, "initializing composite device...\n");
+        composite->fd = composite->create(composite, uinput_device);
+        return composite->fd == -1 ? -1 : 0;
+    }
+
+    if (device_mask & DEVICE_MASK_UHID) {
+        devices[DEVICE_GAMEPAD]               = device_uhid;
+        devices[DEVICE_GAMEPAD].uinput_device = uinput_device;
+    }
+
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        if (device_mask & (1 << i)) {
+            fprintf(stderr, "initializing device DEVICE_ID=%zu...\n", i);
+            struct device_context *dev = &devices[i];
+            dev->fd                    = dev->create(dev, uinput_device);
+            if (dev->fd == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Whether every device of the mask is open, which one that failed to be
+ * recreated for a new keymap is not any more
+ */
+static int session_devices_complete(const struct device_context *devices,
+                                    device_mask_t device_mask)
+{
+    if (device_mask & DEVICE_MASK_COMPOSITE) {
+        return devices[DEVICE_GAMEPAD].fd != -1;
+    }
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        if ((device_mask & (1 << i)) && devices[i].fd == -1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void session_devices_destroy(struct device_context *devices)
+{
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        device_destroy(&devices[i]);
+    }
+}
+
+/* Let go of whatever the last session held. The shadow copies stay valid, so
+ * the first write of the next session only carries what it changes.
+ */
+static void session_devices_reset(struct device_context *devices)
+{
+    struct hidinfo neutral = {};
+
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        struct device_context *dev = &devices[i];
+        if (dev->fd != -1) {
+            memset(dev->motion_deadline, 0, sizeof(dev->motion_deadline));
+            dev->write(dev, &neutral);
+        }
+    }
+}
+
+int session_pool_init(struct session_table *table,
+                      unsigned size,
+                      const char *uinput_device,
+                      device_mask_t device_mask)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    table->pool = calloc(size, sizeof(*table->pool));
+    if (table->pool == NULL) {
+        perror("Failed to allocate device pool");
+        return -1;
+    }
+    table->pool_size = size;
+    table->pool_mask = device_mask;
+
+    // Sessions create what the pool is short of themselves
+    for (unsigned i = 0; i < size; i++) {
+        struct device_context *devices = table->pool[table->pool_count];
+        if (session_devices_create(devices, uinput_device, device_mask) < 0) {
+            session_devices_destroy(devices);
+            fprintf(stderr,
+                    "Created %u of %u spare device sets.\n",
+                    table->pool_count,
+                    size);
+            break;
+        }
+        table->pool_count++;
+    }
+    return 0;
+}
+
+int session_devices_open(struct session_table *table,
+                         struct session *session,
+                         const char *uinput_device,
+                         device_mask_t device_mask,
+                         uint64_t now)
+{
+    if (session->devices_open) {
+        return 0;
+    }
+
+    if (table->pool_count > 0) {
+        memcpy(session->devices,
+               table->pool[--table->pool_count],
+               sizeof(session->devices));
+        session->devices_open = 1;
+        return 0;
+    }
+
+    if (now < session->devices_retry) {
+        return -1;
+    }
+
+    if (session_devices_create(session->devices, uinput_device, device_mask) <
+        0) {
+        session_devices_destroy(session->devices);
+
+        unsigned backoff = session->devices_backoff * 2;
+        if (backoff < SESSION_RETRY_MIN_MS) {
+            backoff = SESSION_RETRY_MIN_MS;
+        } else if (backoff > SESSION_RETRY_MAX_MS) {
+            backoff = SESSION_RETRY_MAX_MS;
+        }
+        session->devices_backoff = backoff;
+        session->devices_retry   = now + backoff * 1000000ull;
+        fprintf(stderr,
+                "Failed to create the devices of %s, trying again in %u "
+                "ms.\n",
+                session_name(session),
+                backoff);
+        return -1;
+    }
+
+    session->devices_backoff = 0;
+    session->devices_retry   = 0;
+    session->devices_open    = 1;
+    return 0;
+}
+
+void session_devices_close(struct session_table *table,
+                           struct session *session)
+{
+    if (!session->devices_open) {
+        return;
+    }
+    session->devices_open = 0;
+
+    if (table->pool_count < table->pool_size &&
+        session_devices_complete(session->devices, table->pool_mask)) {
+        session_devices_reset(session->devices);
+        memcpy(table->pool[table->pool_count++],
+               session->devices,
+               sizeof(session->devices));
+        return;
+    }
+
+    session_devices_destroy(session->devices);
+}
+
+struct session *session_open(struct session_table *table,
+                             const struct sockaddr *addr,
+                             socklen_t addr_len)
+{
+    if (addr_len > sizeof(struct sockaddr_storage)) {
+        return NULL;
+    }
+
+    if (table->free_count == 0) {
+        struct session *oldest = session_least_recent(table);
+        printf("Too many clients, dropping %s.\n", session_name(oldest));
+        session_close(table, oldest);
+    }
+
+    int16_t slot            = table->free[--table->free_count];
+    struct session *session = &table->slots[slot];
+
+    memset(&session->addr, 0, sizeof(session->addr));
+    memcpy(&session->addr, addr, addr_len);
+    session->addr_len        = addr_len;
+    session->hash            = session_hash(addr);
+    session->last_seen       = ++table->clock;
+    session->deadline        = 0;
+    session->state           = SESSION_IDLE;
+    session->devices_open    = 0;
+    session->devices_retry   = 0;
+    session->devices_backoff = 0;
+    session->have_pending    = 0;
+    session->sensors         = PROTOCOL_SENSOR_ALL;
+    memset(&session->hid, 0, sizeof(session->hid));
+    session->ramp.active  = 0;
+    session->ramp.last    = 0;
+    session->predict.last = 0;
+    session->smooth.valid = 0;
+    session->fusion.last  = 0;
+    session_restart(session);
+
+    uint32_t pos = session->hash;
+    while (table->index[pos & SESSION_TABLE_MASK] != SESSION_NONE) {
+        pos++;
+    }
+    table->index[pos & SESSION_TABLE_MASK] = slot;
+
+    return session;
+}
+
+void session_close(struct session_table *table, struct session *session)
+{
+    int16_t slot = session - table->slots;
+
+    uint32_t pos = session->hash;
+    while (table->index[pos & SESSION_TABLE_MASK] != slot) {
+        pos++;
+    }
+
+    // Backward-shift deletion: pull later entries of the probe sequence into
+    // the hole so that lookups never need tombstones.
+    uint32_t hole = pos & SESSION_TABLE_MASK;
+    for (uint32_t next = (hole + 1) & SESSION_TABLE_MASK;;
+         next          = (next + 1) & SESSION_TABLE_MASK) {
+        int16_t moved = table->index[next];
+        if (moved == SESSION_NONE) {
+            break;
+        }
+
+        uint32_t home = table->slots[moved].hash & SESSION_TABLE_MASK;
+        if (((next - home) & SESSION_TABLE_MASK) >=
+            ((next - hole) & SESSION_TABLE_MASK)) {
+            table->index[hole] = moved;
+            hole               = next;
+        }
+    }
+    table->index[hole] = SESSION_NONE;
+
+    session->ramp.active = 0;
+    session_devices_close(table, session);
+    table->free[table->free_count++] = slot;
+}
+
+enum session_seq session_check_sequence(struct session *session,
+                                        uint32_t sequence)
+{
+    struct session_window *window = &session->window;
+    int32_t ahead                 = (int32_t) (sequence - window->top);
+
+    if (!window->valid || ahead <= -SESSION_SEQ_RESYNC) {
+        // First packet of the session, or a client that started over
+        window->valid = 1;
+        window->top   = sequence;
+        window->seen  = 1;
+        return SESSION_SEQ_NEW;
+    }
+
+    if (ahead > 0) {
+        window->seen =
+            (ahead < SESSION_WINDOW) ? (window->seen << ahead) | 1 : 1;
+        window->top  = sequence;
+        return SESSION_SEQ_NEW;
+    }
+
+    uint32_t behind = -ahead;
+    if (behind >= SESSION_WINDOW) {
+        return SESSION_SEQ_EXPIRED;
+    }
+
+    uint64_t bit = (uint64_t) 1 << behind;
+    if (window->seen & bit) {
+        return SESSION_SEQ_DUPLICATE;
+    }
+    window->seen |= bit;
+    return SESSION_SEQ_LATE;
+}
+
+uint64_t session_expire(struct session_table *table,
+                        uint64_t now,
+                        void (*expired)(struct session *session))
+{
+    uint64_t next = 0;
+
+    for (size_t i = 0; i < SESSION_TABLE_SIZE; i++) {
+        if (table->index[i] == SESSION_NONE) {
+            continue;
+        }
+
+        struct session *session = &table->slots[table->index[i]];
+        if (session->state == SESSION_IDLE) {
+            continue;
+        }
+
+        if (session->deadline <= now) {
+            expired(session);
+        }
+        if (session->state != SESSION_IDLE &&
+            (next == 0 || session->deadline < next)) {
+            next = session->deadline;
+        }
+    }
+
+    return next;
+}
+
+void session_restart(struct session *session)
+{
+    session->window.valid  = 0;
+    session->history.valid = 0;
+}
+
+void session_history_push(struct session *session, const struct hidinfo *hid)
+{
+    unsigned slot = hid->sequence % PROTOCOL_HISTORY;
+
+    session->history.states[slot] = *hid;
+    session->history.valid |= 1u << slot;
+}
+
+const struct hidinfo *session_history_find(const struct session *session,
+                                           uint32_t sequence)
+{
+    unsigned slot               = sequence % PROTOCOL_HISTORY;
+    const struct hidinfo *state = &session->history.states[slot];
+
+    if (!(session->history.valid & (1u << slot)) ||
+        state->sequence != sequence) {
+        return NULL;
+    }
+    return state;
+}
+
+void session_close_all(struct session_table *table)
+{
+    // Nothing is going to take devices from the pool any more
+    table->pool_size = 0;
+
+    for (size_t i = 0; i < SESSION_TABLE_SIZE; i++) {
+        // Closing shifts later entries back into this position
+        while (table->index[i] != SESSION_NONE) {
+            session_close(table, &table->slots[table->index[i]]);
+        }
+    }
+
+    while (table->pool_count > 0) {
+        session_devices_destroy(table->pool[--table->pool_count]);
+    }
+    free(table->pool);
+    table->pool = NULL;
+}
+
+const char *session_name(const struct session *session)
+{
+    static __thread char name[NI_MAXHOST + NI_MAXSERV + 4];
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+
+    if (getnameinfo((const struct sockaddr *) &session->addr,
+                    session->addr_len,
+                    host,
+                    sizeof(host),
+                    serv,
+                    sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        return "unknown";
+    }
+
+    snprintf(name, sizeof(name), "%s:%s", host, serv);
+    return name;
+}
@@ -0,0 +1,57 @@
+#include "stick.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const struct stick_table *stick_tables[STICKS_COUNT];
+
+int stick_configure(enum stick_id id, const struct stick_config *config)
+{
+    if (config->deadzone >= config->outer || config->outer > 100 ||
+        config->anti_deadzone >= 100 || !(config->curve > 0)) {
+        return -1;
+    }
+
+    struct stick_table *table = malloc(sizeof(*table));
+    if (table == NULL) {
+        perror("Failed to allocate stick table");
+        return -1;
+    }
+
+    double inner = STICK_RANGE * config->deadzone / 100.0;
+    double outer = STICK_RANGE * config->outer / 100.0;
+    double anti  = config->anti_deadzone / 100.0;
+
+    for (unsigned x = 0; x <= STICK_RANGE; x++) {
+        for (unsigned y = 0; y <= STICK_RANGE; y++) {
+            double r = hypot(x, y);
+            if (r <= inner) {
+                table->pos[x][y][0] = 0;
+                table->pos[x][y][1] = 0;
+                continue;
+            }
+
+            double t = (r - inner) / (outer - inner);
+            t        = t < 1 ? t : 1;
+
+            // Radius to report, along the direction the stick points in
+            double shaped = (anti + (1 - anti) * pow(t, config->curve)) *
+                            STICK_RANGE;
+            table->pos[x][y][0] = lround(x * shaped / r);
+            table->pos[x][y][1] = lround(y * shaped / r);
+        }
+    }
+
+    free((void *) stick_tables[id]);
+    stick_tables[id] = table;
+    return 0;
+}
+
+void stick_free(void)
+{
+    for (unsigned i = 0; i < STICKS_COUNT; i++) {
+        free((void *) stick_tables[i]);
+        stick_tables[i] = NULL;
+    }
+}
@@ -0,0 +1,260 @@
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned entries, unsigned cq_entries)
+{
+    struct io_uring_params p = {};
+
+    if (cq_entries > 0) {
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL,
+                         ring->sq_ring_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto failure_close;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL,
+                             ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto failure_unmap_sq;
+        }
+    }
+
+    ring->sqes = mmap(NULL,
+                      ring->sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto failure_unmap_cq;
+    }
+
+    unsigned char *sq = ring->sq_ring;
+    ring->sq_head     = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail     = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask     = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array    = (unsigned *) (sq + p.sq_off.array);
+    ring->sq_flags    = (unsigned *) (sq + p.sq_off.flags);
+    ring->sq_entries  = p.sq_entries;
+    ring->sqe_tail    = *ring->sq_tail;
+
+    unsigned char *cq = ring->cq_ring;
+    ring->cq_head     = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail     = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask     = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes        = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+failure_unmap_cq:
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+failure_unmap_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+failure_close:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+void uring_exit(struct uring *ring)
+{
+    if (ring->fd < 0) {
+        return;
+    }
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+int uring_probe(struct uring *ring, unsigned opcode)
+{
+    const unsigned ops = IORING_OP_LAST;
+    struct io_uring_probe *probe =
+        calloc(1, sizeof(*probe) + ops * sizeof(probe->ops[0]));
+    if (probe == NULL) {
+        return 0;
+    }
+
+    int supported = 0;
+    if (uring_register(ring->fd, IORING_REGISTER_PROBE, probe, ops) == 0 &&
+        opcode <= probe->last_op) {
+        supported = (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    free(probe);
+    return supported;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+
+    unsigned index           = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index]    = index;
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_enter(struct uring *ring, unsigned wait_nr)
+{
+    unsigned submit = ring->sqe_tail - *ring->sq_tail;
+    unsigned flags  = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    return syscall(
+        __NR_io_uring_enter, ring->fd, submit, wait_nr, flags, NULL, 0);
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        // The ring fd stays readable while the kernel holds completions back,
+        // so leaving them there would spin whoever polls it
+        if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+              IORING_SQ_CQ_OVERFLOW)) {
+            return NULL;
+        }
+        syscall(__NR_io_uring_enter,
+                ring->fd,
+                0,
+                0,
+                IORING_ENTER_GETEVENTS,
+                NULL,
+                0);
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(struct uring_buf_ring *buf_ring,
+                        struct uring *ring,
+                        unsigned entries,
+                        uint16_t bgid)
+{
+    buf_ring->entries = entries;
+    buf_ring->bgid    = bgid;
+    buf_ring->tail    = 0;
+    buf_ring->size    = entries * sizeof(struct io_uring_buf);
+    buf_ring->br      = mmap(NULL,
+                             buf_ring->size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                             -1,
+                             0);
+    if (buf_ring->br == MAP_FAILED) {
+        buf_ring->br = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr    = (uintptr_t) buf_ring->br,
+        .ring_entries = entries,
+        .bgid         = bgid,
+    };
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(buf_ring->br, buf_ring->size);
+        buf_ring->br = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void uring_buf_ring_exit(struct uring_buf_ring *buf_ring, struct uring *ring)
+{
+    if (buf_ring->br == NULL) {
+        return;
+    }
+
+    struct io_uring_buf_reg reg = {.bgid = buf_ring->bgid};
+    uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(buf_ring->br, buf_ring->size);
+    buf_ring->br = NULL;
+}
+
+void uring_buf_ring_add(struct uring_buf_ring *buf_ring,
+                        void *addr,
+                        unsigned len,
+                        uint16_t bid)
+{
+    struct io_uring_buf *buf =
+        &buf_ring->br->bufs[buf_ring->tail & (buf_ring->entries - 1)];
+
+    buf->addr = (uintptr_t) addr;
+    buf->len  = len;
+    buf->bid  = bid;
+
+    buf_ring->tail++;
+    __atomic_store_n(&buf_ring->br->tail, buf_ring->tail, __ATOMIC_RELEASE);
+}
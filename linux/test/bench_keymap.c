@@ -0,0 +1,288 @@
+/* Measures how long the gamepad takes to translate a key mask into the
+ * values of its events: the loop over a key table and if/else chains for the
+ * hat that did so before keymaps were compiled, against the compiled default
+ * keymap, looked up directly and evaluated, and one with chords and layers.
+ *
+ * Usage: bench_keymap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hid.h"
+#include "keymap.h"
+
+#define arrsize(a) (sizeof(a) / sizeof(a[0]))
+
+#define BENCH_ITERATIONS (1 << 22)
+#define BENCH_MASKS 4096
+#define BENCH_ROUNDS 20
+
+struct bench_event {
+    uint16_t code;
+    int32_t value;
+};
+
+static const char bench_layered[] =
+    "A = BTN_SOUTH\nB = BTN_EAST\nX = BTN_NORTH\nY = BTN_WEST\n"
+    "START = BTN_START\nSELECT = BTN_SELECT\nL = BTN_TL\nR = BTN_TR\n"
+    "ZL = BTN_TL2\nZR = BTN_TR2\n"
+    "DLEFT = ABS_HAT0X:-1\nDRIGHT = ABS_HAT0X:1\n"
+    "DUP = ABS_HAT0Y:-1\nDDOWN = ABS_HAT0Y:1\n"
+    "CSTICK_LEFT = ABS_HAT2X:-1\nCSTICK_RIGHT = ABS_HAT2X:1\n"
+    "L+R = KEY_ESC\nSTART+SELECT = KEY_HOME\nA+B+X = KEY_ENTER\n"
+    "layer 1 = TOUCH\nlayer 2 = CSTICK_UP\nlayer 3 = CSTICK_DOWN\n"
+    "[layer 1]\nA = KEY_1\nB = KEY_2\nX = KEY_3\nY = KEY_4\n"
+    "DLEFT = KEY_LEFT\nDRIGHT = KEY_RIGHT\nDUP = KEY_UP\nDDOWN = KEY_DOWN\n"
+    "[layer 2]\nA = KEY_F1\nB = KEY_F2\nX = KEY_F3\nY = KEY_F4\n"
+    "L+R = KEY_TAB\n"
+    "[layer 3]\nA = KEY_A\nB = KEY_B\nX = KEY_X\nY = KEY_Y\n"
+    "L = KEY_LEFTSHIFT\nR = KEY_LEFTCTRL\n";
+
+/* The key table of the gamepad before keymaps were compiled */
+static const uint16_t bench_keys[] = {
+    BTN_SOUTH,
+    BTN_EAST,
+    BTN_NORTH,
+    BTN_WEST,
+    BTN_START,
+    BTN_SELECT,
+    BTN_TL,
+    BTN_TR,
+    BTN_TL2,
+    BTN_TR2,
+};
+static const uint32_t bench_keymasks[] = {
+    HID_KEY_A,
+    HID_KEY_B,
+    HID_KEY_X,
+    HID_KEY_Y,
+    HID_KEY_START,
+    HID_KEY_SELECT,
+    HID_KEY_L,
+    HID_KEY_R,
+    HID_KEY_ZL,
+    HID_KEY_ZR,
+};
+
+static struct bench_event events[KEYMAP_CHANNELS_MAX];
+static uint32_t masks[BENCH_MASKS];
+static uint32_t typical[BENCH_MASKS];
+static const struct keymap *bench_map;
+
+__attribute__((noinline)) static void bench_table(uint32_t pressed)
+{
+    size_t i = 0;
+    int hat;
+
+    for (; i < arrsize(bench_keys); i++) {
+        events[i].code  = bench_keys[i];
+        events[i].value = HID_HAS_KEY(pressed, bench_keymasks[i]);
+    }
+
+    if (HID_HAS_KEY(pressed, HID_KEY_DLEFT)) {
+        hat = -1;
+    } else if (HID_HAS_KEY(pressed, HID_KEY_DRIGHT)) {
+        hat = 1;
+    } else {
+        hat = 0;
+    }
+    events[i].code    = ABS_HAT0X;
+    events[i++].value = hat;
+
+    if (HID_HAS_KEY(pressed, HID_KEY_DUP)) {
+        hat = -1;
+    } else if (HID_HAS_KEY(pressed, HID_KEY_DDOWN)) {
+        hat = 1;
+    } else {
+        hat = 0;
+    }
+    events[i].code  = ABS_HAT0Y;
+    events[i].value = hat;
+}
+
+/* As gamepad_emit() does it */
+__attribute__((noinline)) static void bench_compiled(uint32_t pressed)
+{
+    if (bench_map->direct) {
+        unsigned i = 0;
+        for (; i < bench_map->direct_buttons; i++) {
+            events[i].code  = bench_map->direct_codes[i];
+            events[i].value = (pressed & bench_map->direct_keys[i]) != 0;
+        }
+        for (unsigned k = 0; k < bench_map->direct_lookup_count; k++, i++) {
+            const struct keymap_lookup *lookup = &bench_map->direct_lookups[k];
+            uint32_t state                     = pressed >> lookup->shift;
+
+            events[i].code  = lookup->code;
+            events[i].value = lookup->values[state & KEYMAP_DIRECT_MASK];
+        }
+        return;
+    }
+
+    uint64_t active = keymap_eval(bench_map, pressed);
+    for (unsigned i = 0; i < bench_map->channel_count; i++) {
+        const struct keymap_channel *channel = &bench_map->channels[i];
+        events[i].code  = channel->code;
+        events[i].value = keymap_value(bench_map, channel, active);
+    }
+}
+
+/* As gamepad_emit() does it for keymaps that are not direct */
+__attribute__((noinline)) static void bench_evaluated(uint32_t pressed)
+{
+    uint64_t active = keymap_eval(bench_map, pressed);
+    for (unsigned i = 0; i < bench_map->channel_count; i++) {
+        const struct keymap_channel *channel = &bench_map->channels[i];
+        events[i].code  = channel->code;
+        events[i].value = keymap_value(bench_map, channel, active);
+    }
+}
+
+static double bench_time(void (*translate)(uint32_t), const uint32_t *set)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned n = 0; n < BENCH_ITERATIONS; n++) {
+        translate(set[n % BENCH_MASKS]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec)) /
+           BENCH_ITERATIONS;
+}
+
+/* The compiled default keymap has to agree with the table it replaced, both
+ * looked up directly and evaluated
+ */
+static int bench_check(void (*translate)(uint32_t))
+{
+    for (unsigned m = 0; m < BENCH_MASKS; m++) {
+        struct bench_event expected[arrsize(bench_keys) + 2];
+        bench_table(masks[m]);
+        for (size_t i = 0; i < arrsize(expected); i++) {
+            expected[i] = events[i];
+        }
+
+        translate(masks[m]);
+        for (size_t i = 0; i < arrsize(expected); i++) {
+            unsigned c = 0;
+            while (c < bench_map->channel_count &&
+                   events[c].code != expected[i].code) {
+                c++;
+            }
+            if (c == bench_map->channel_count ||
+                events[c].value != expected[i].value) {
+                fprintf(stderr,
+                        "Key mask %08x: code %u is %d instead of %d\n",
+                        masks[m],
+                        expected[i].code,
+                        c < bench_map->channel_count ? events[c].value : 0,
+                        expected[i].value);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static struct keymap *bench_load(const char *text)
+{
+    char path[] = "/tmp/bench_keymap.XXXXXX";
+    int fd      = mkstemp(path);
+    if (fd < 0) {
+        perror("Error creating keymap file");
+        return NULL;
+    }
+
+    struct keymap *map = NULL;
+    FILE *file         = fdopen(fd, "w");
+    if (file != NULL && fputs(text, file) >= 0 && fclose(file) == 0) {
+        map = keymap_load(path);
+    } else {
+        perror("Error writing keymap file");
+    }
+    unlink(path);
+    return map;
+}
+
+static uint32_t bench_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int main(void)
+{
+    // Any keys at all, and up to three of the buttons and D-pad, as players
+    // hold them
+    uint32_t random = 0x3d5c;
+    for (unsigned m = 0; m < BENCH_MASKS; m++) {
+        masks[m]   = bench_random(&random);
+        typical[m] = 0;
+        for (unsigned k = bench_random(&random) % 4; k > 0; k--) {
+            unsigned bit = bench_random(&random) % 12;
+            typical[m] |= 1u << (bit < 10 ? bit : bit + 4);
+        }
+    }
+
+    struct keymap *defaults = keymap_default();
+    struct keymap *layered  = bench_load(bench_layered);
+    if (defaults == NULL || layered == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    bench_map = defaults;
+    if (!defaults->direct || bench_check(bench_compiled) < 0 ||
+        bench_check(bench_evaluated) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    const struct {
+        const char *name;
+        void (*translate)(uint32_t);
+        const struct keymap *map;
+    } runs[] = {
+        {"key table", bench_table, NULL},
+        {"compiled default", bench_compiled, defaults},
+        {"default evaluated", bench_evaluated, defaults},
+        {"compiled layered", bench_compiled, layered},
+    };
+
+    // Rounds take turns between the runs, so that all see the same load
+    double best[arrsize(runs)][2];
+    for (unsigned round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < arrsize(runs); i++) {
+            bench_map = runs[i].map;
+            for (unsigned k = 0; k < 2; k++) {
+                double ns =
+                    bench_time(runs[i].translate, k == 0 ? masks : typical);
+                if (round == 0 || ns < best[i][k]) {
+                    best[i][k] = ns;
+                }
+            }
+        }
+    }
+
+    printf("Per key mask, best of %d rounds of %d:\n",
+           BENCH_ROUNDS,
+           BENCH_ITERATIONS);
+    printf("  %-18s %6s %10s %10s\n", "", "events", "random", "typical");
+    for (size_t i = 0; i < arrsize(runs); i++) {
+        printf("  %-18s %6u %7.2f ns %7.2f ns\n",
+               runs[i].name,
+               runs[i].map ? runs[i].map->channel_count
+                           : (unsigned) arrsize(bench_keys) + 2,
+               best[i][0],
+               best[i][1]);
+    }
+
+    keymap_free(defaults);
+    keymap_free(layered);
+    return EXIT_SUCCESS;
+}
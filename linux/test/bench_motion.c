@@ -0,0 +1,214 @@
+/* Compares motion_smooth() with a One Euro filter in double precision, as
+ * written in the paper, on a trace of the gyroscope: how much noise each
+ * takes out at rest, how closely each follows a fast swing, and what each
+ * costs per packet.
+ *
+ * Usage: bench_motion [<fc> <beta>]
+ *
+ * The trace is 20 s at 60 Hz: at rest with noise of a standard deviation of
+ * 6 units, with a swing of 3000 units at 1.5 Hz from 5 s to 15 s. All six
+ * axes get the same values, and have to come out the same.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "motion.h"
+#include "predict.h"
+
+#define BENCH_FRAMES (60 * 20)
+#define BENCH_NOISE 6.0
+#define BENCH_SWING 3000.0
+#define BENCH_SWING_HZ 1.5
+#define BENCH_ITERATIONS (1 << 22)
+
+#define BENCH_CUTOFF_DEFAULT 1.0
+#define BENCH_BETA_DEFAULT 0.007
+
+#define BENCH_DT (PREDICT_FRAME_US / 1e6)
+
+struct bench_euro {
+    double value;
+    double speed;
+    int valid;
+};
+
+static double bench_alpha(double cutoff)
+{
+    return 1 / (1 + 1 / (2 * M_PI * cutoff * BENCH_DT));
+}
+
+static double
+bench_euro(struct bench_euro *euro, double value, double cutoff, double beta)
+{
+    if (!euro->valid) {
+        euro->value = value;
+        euro->speed = 0;
+        euro->valid = 1;
+        return value;
+    }
+
+    double speed = (value - euro->value) / BENCH_DT;
+    euro->speed += bench_alpha(MOTION_SPEED_CUTOFF) * (speed - euro->speed);
+    euro->value +=
+        bench_alpha(cutoff + beta * fabs(euro->speed)) * (value - euro->value);
+    return euro->value;
+}
+
+static double bench_gauss(void)
+{
+    return sqrt(-2 * log(1 - drand48())) * cos(2 * M_PI * drand48());
+}
+
+static double bench_truth(double t)
+{
+    if (t < 5 || t > 15) {
+        return 0;
+    }
+    return BENCH_SWING * sin(2 * M_PI * BENCH_SWING_HZ * (t - 5));
+}
+
+static double bench_elapsed(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start->tv_sec) * 1e9 +
+            (end.tv_nsec - start->tv_nsec)) /
+           BENCH_ITERATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+    double cutoff = BENCH_CUTOFF_DEFAULT;
+    double beta   = BENCH_BETA_DEFAULT;
+    if (argc == 3) {
+        cutoff = atof(argv[1]);
+        beta   = atof(argv[2]);
+    }
+    if ((argc != 1 && argc != 3) || !(cutoff > 0) || !(beta >= 0)) {
+        fprintf(stderr, "Usage: %s [<fc> <beta>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned i = 0; i < 3; i++) {
+        motion_config[DEVICE_GYROSCOPE].cutoff[i]     = cutoff;
+        motion_config[DEVICE_GYROSCOPE].beta[i]       = beta;
+        motion_config[DEVICE_ACCELEROMETER].cutoff[i] = cutoff;
+        motion_config[DEVICE_ACCELEROMETER].beta[i]   = beta;
+    }
+    motion_smooth_init();
+    srand48(5);
+
+    struct motion_smooth smooth = {};
+    struct bench_euro euro      = {};
+    struct bench_euro lowpass   = {};
+
+    // Squared errors at rest and during the swing, of the raw values, the
+    // fixed point filter, the reference and a low-pass at the same cutoff
+    double rest[4]  = {};
+    double swing[4] = {};
+    unsigned rests  = 0;
+    unsigned swings = 0;
+    double apart    = 0;
+
+    for (unsigned i = 1; i <= BENCH_FRAMES; i++) {
+        double t     = i * BENCH_DT;
+        double truth = bench_truth(t);
+        int16_t raw  = lrint(truth + BENCH_NOISE * bench_gauss());
+
+        struct hidinfo hid = {
+            .sequence = i,
+            .gyro     = {raw, raw, raw},
+            .accel    = {raw, raw, raw},
+        };
+        motion_smooth(&smooth, &hid);
+
+        const int16_t gyro[3]  = {hid.gyro.x, hid.gyro.y, hid.gyro.z};
+        const int16_t accel[3] = {hid.accel.x, hid.accel.y, hid.accel.z};
+        for (unsigned a = 0; a < 3; a++) {
+            if (gyro[a] != gyro[0] || accel[a] != gyro[0]) {
+                fprintf(stderr, "Axes differ at frame %u\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        double out[4] = {
+            raw,
+            hid.gyro.x,
+            bench_euro(&euro, raw, cutoff, beta),
+            bench_euro(&lowpass, raw, cutoff, 0),
+        };
+        apart = fmax(apart, fabs(out[1] - out[2]));
+
+        // Leave the filters half a second to catch up with the swing
+        double *errors = NULL;
+        if (t > 1 && t < 5) {
+            errors = rest;
+            rests++;
+        } else if (t > 5.5 && t < 15) {
+            errors = swing;
+            swings++;
+        }
+        for (unsigned k = 0; errors != NULL && k < 4; k++) {
+            errors[k] += (out[k] - truth) * (out[k] - truth);
+        }
+    }
+
+    printf("fc %g Hz, beta %g; RMS error in raw units:\n", cutoff, beta);
+    printf("  %-8s %8s %8s %8s %8s\n",
+           "",
+           "raw",
+           "fixed",
+           "double",
+           "low-pass");
+    printf("  %-8s %8.2f %8.2f %8.2f %8.2f\n",
+           "rest",
+           sqrt(rest[0] / rests),
+           sqrt(rest[1] / rests),
+           sqrt(rest[2] / rests),
+           sqrt(rest[3] / rests));
+    printf("  %-8s %8.1f %8.1f %8.1f %8.1f\n",
+           "swing",
+           sqrt(swing[0] / swings),
+           sqrt(swing[1] / swings),
+           sqrt(swing[2] / swings),
+           sqrt(swing[3] / swings));
+    printf("Largest difference between fixed point and double: %.1f\n", apart);
+
+    struct timespec start;
+    struct hidinfo hid = {};
+    volatile double sink;
+
+    smooth = (struct motion_smooth){};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 1; i <= BENCH_ITERATIONS; i++) {
+        hid.sequence = i;
+        hid.gyro.x   = (i * 37) & 1023;
+        hid.gyro.y   = (i * 11) & 511;
+        hid.accel.z  = (i * 7) & 255;
+        motion_smooth(&smooth, &hid);
+        sink = hid.gyro.x;
+    }
+    double fixed = bench_elapsed(&start);
+
+    struct bench_euro euros[6] = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 1; i <= BENCH_ITERATIONS; i++) {
+        double values[6] = {(i * 37) & 1023, (i * 11) & 511, 0, 0, 0,
+                            (i * 7) & 255};
+        for (unsigned a = 0; a < 6; a++) {
+            values[a] = bench_euro(&euros[a], values[a], cutoff, beta);
+        }
+        sink = values[0];
+    }
+    double reference = bench_elapsed(&start);
+    (void) sink;
+
+    printf("Cost for six axes: fixed point %.1f ns, double %.1f ns per "
+           "packet\n",
+           fixed,
+           reference);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+/* Replays a stick trace through the predictor and scores its output against
+ * the trace, along with holding the last value as the server does without
+ * prediction, then measures what an update and an apply cost.
+ *
+ * Usage: bench_predict [<seed>]
+ *
+ * The trace is two minutes of slow sweeps with a quick flick every two
+ * seconds. The client samples it once per frame, with a unit of sensor noise,
+ * and its packets arrive after 4 ms plus an exponentially distributed delay
+ * averaging 3 ms; 2.5% of them start a burst of one to three lost packets,
+ * and packets overtaken by a later one are dropped as the sequence window
+ * does. The output is scored every ms against where the stick is by the time
+ * the output takes effect, some ms downstream; the prediction looks ahead by
+ * that much.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "predict.h"
+
+#define arrsize(a) (sizeof(a) / sizeof(a[0]))
+
+#define MS 1000000ull
+
+#define BENCH_FRAMES (60 * 120)
+#define BENCH_DELAY_MS 4
+#define BENCH_JITTER_MS 3
+#define BENCH_LOSS 0.025
+
+/* Scoring starts after the predictor had time to settle */
+#define BENCH_SETTLE_MS 2000
+
+/* Time since the last packet after which an output counts as in a gap */
+#define BENCH_GAP_MS 25
+
+#define BENCH_ITERATIONS (1 << 22)
+
+static const unsigned bench_downstream[] = {0, 8, 16};
+
+static struct {
+    uint64_t arrival;
+    int value;
+    int lost;
+} frames[BENCH_FRAMES];
+
+static double bench_truth(double t)
+{
+    double value =
+        120 * sin(2 * M_PI * 0.7 * t) + 30 * sin(2 * M_PI * 2.3 * t + 1);
+
+    double phase = fmod(t, 2.0);
+    if (phase > 1.2 && phase < 1.35) {
+        value += 100 * sin(M_PI * (phase - 1.2) / 0.15);
+    }
+    return value > 156 ? 156 : value < -156 ? -156 : value;
+}
+
+static void bench_record(void)
+{
+    for (unsigned i = 0; i < BENCH_FRAMES; i++) {
+        double sampled = i * (PREDICT_FRAME_US / 1e6);
+        double delay =
+            BENCH_DELAY_MS / 1e3 - BENCH_JITTER_MS / 1e3 * log(1 - drand48());
+
+        frames[i].value   = lrint(bench_truth(sampled)) + lrand48() % 3 - 1;
+        frames[i].arrival = (sampled + delay) * 1e9 + MS;
+        frames[i].lost    = 0;
+    }
+
+    for (unsigned i = 0; i < BENCH_FRAMES; i++) {
+        if (drand48() < BENCH_LOSS) {
+            for (unsigned k = 1 + lrand48() % 3; k > 0 && i < BENCH_FRAMES;
+                 k--) {
+                frames[i++].lost = 1;
+            }
+        }
+    }
+
+    uint64_t last = 0;
+    for (unsigned i = 0; i < BENCH_FRAMES; i++) {
+        if (frames[i].arrival < last) {
+            frames[i].lost = 1;
+        } else if (!frames[i].lost) {
+            last = frames[i].arrival;
+        }
+    }
+}
+
+struct bench_score {
+    double rms;
+    double rms_gaps;
+};
+
+/* Play the packets as they arrive and score the output every ms */
+static struct bench_score bench_replay(int predicting, unsigned downstream)
+{
+    struct predict predict = {};
+    struct hidinfo hid     = {};
+    uint64_t last          = 0;
+    unsigned next          = 0;
+    double error           = 0;
+    double error_gaps      = 0;
+    unsigned long count    = 0;
+    unsigned long gaps     = 0;
+
+    for (uint64_t now = MS; now < frames[BENCH_FRAMES - 1].arrival;
+         now += MS) {
+        for (; next < BENCH_FRAMES && frames[next].arrival <= now; next++) {
+            if (frames[next].lost) {
+                continue;
+            }
+            hid.circlepad.dx = frames[next].value;
+            hid.sequence     = next + 1;
+            last             = frames[next].arrival;
+            if (predicting) {
+                predict_update(&predict, &hid, last);
+            }
+        }
+        if (now < BENCH_SETTLE_MS * MS) {
+            continue;
+        }
+
+        struct hidinfo out = hid;
+        if (predicting) {
+            predict_apply(&predict, &out, now + downstream * MS);
+        }
+
+        double e =
+            out.circlepad.dx - bench_truth((now + downstream * MS) / 1e9);
+        error += e * e;
+        count++;
+        if (now - last > BENCH_GAP_MS * MS) {
+            error_gaps += e * e;
+            gaps++;
+        }
+    }
+
+    return (struct bench_score){
+        .rms      = sqrt(error / count),
+        .rms_gaps = gaps ? sqrt(error_gaps / gaps) : 0,
+    };
+}
+
+static double bench_elapsed(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start->tv_sec) * 1e9 +
+            (end.tv_nsec - start->tv_nsec)) /
+           BENCH_ITERATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+    srand48(argc > 1 ? atol(argv[1]) : 3);
+    bench_record();
+
+    printf("RMS error in stick units (in gaps of over %d ms):\n",
+           BENCH_GAP_MS);
+    printf("  %-10s %16s %16s\n", "downstream", "hold", "predict");
+    for (size_t i = 0; i < arrsize(bench_downstream); i++) {
+        struct bench_score hold    = bench_replay(0, bench_downstream[i]);
+        struct bench_score predict = bench_replay(1, bench_downstream[i]);
+        printf("  %7u ms %7.2f (%6.2f) %7.2f (%6.2f)\n",
+               bench_downstream[i],
+               hold.rms,
+               hold.rms_gaps,
+               predict.rms,
+               predict.rms_gaps);
+    }
+
+    struct predict predict = {};
+    struct hidinfo hid     = {};
+    struct timespec start;
+    volatile int32_t sink;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < BENCH_ITERATIONS; i++) {
+        hid.sequence     = i + 1;
+        hid.circlepad.dx = i & 127;
+        hid.gyro.x       = i & 1023;
+        predict_update(&predict, &hid, (i + 1) * (PREDICT_FRAME_US * 1000ull));
+    }
+    double update = bench_elapsed(&start);
+
+    uint64_t at = predict.last;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < BENCH_ITERATIONS; i++) {
+        struct hidinfo out = hid;
+        predict_apply(&predict, &out, at + (i & 15) * MS);
+        sink = out.circlepad.dx;
+    }
+    double apply = bench_elapsed(&start);
+    (void) sink;
+
+    printf("Cost for all %d axes: %.1f ns per update, %.1f ns per apply\n",
+           PREDICT_AXES,
+           update,
+           apply);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,261 @@
+/* Measures the CPU time each receiver spends per packet, with a 3DS sending
+ * at its frame rate and at the rate of a 1 kHz client.
+ *
+ * Usage: bench_recv [<seconds>]
+ *
+ * Every receiver runs in a thread of its own, bound to BENCH_PORT on the
+ * loopback interface without any devices, so that only receiving, decoding
+ * and acknowledging the packets is counted.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ctroller.h"
+#include "protocol.h"
+
+#define BENCH_PORT "15790"
+#define BENCH_SECONDS_DEFAULT 3
+
+static const unsigned bench_rates[] = {60, 1000};
+
+static const struct bench_receiver {
+    const char *name;
+    ctroller_call_poll *poll;
+    int (*init)(void);
+} bench_receivers[] = {
+    {"recvfrom", ctroller_poll_hid_info, NULL},
+    {"recvmmsg", ctroller_poll_hid_batch, NULL},
+    {"io_uring", ctroller_poll_hid_uring, ctroller_uring_init},
+};
+
+struct bench_run {
+    const struct bench_receiver *receiver;
+    int ready;
+    unsigned long packets;
+    unsigned long recv_calls;
+    uint64_t cpu_ns;
+    int failed;
+};
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond  = PTHREAD_COND_INITIALIZER;
+
+static uint64_t bench_clock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_ready(struct bench_run *run, int failed)
+{
+    pthread_mutex_lock(&bench_lock);
+    run->ready  = 1;
+    run->failed = failed;
+    pthread_cond_signal(&bench_cond);
+    pthread_mutex_unlock(&bench_lock);
+}
+
+static void *bench_receive(void *arg)
+{
+    struct bench_run *run = arg;
+
+    if (ctroller_init("/dev/null", BENCH_PORT, 0, 0) < 0) {
+        perror("Error initializing ctroller");
+        bench_ready(run, 1);
+        return NULL;
+    }
+    if (run->receiver->init != NULL && run->receiver->init() < 0) {
+        perror("Error initializing the receiver");
+        ctroller_exit();
+        bench_ready(run, 1);
+        return NULL;
+    }
+    bench_ready(run, 0);
+
+    uint64_t start = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+    int res;
+    while ((res = run->receiver->poll()) >= 0) {
+    }
+    run->cpu_ns     = bench_clock(CLOCK_THREAD_CPUTIME_ID) - start;
+    run->packets    = ctroller_stats.packets;
+    run->recv_calls = ctroller_stats.recv_calls;
+    run->failed     = res != CTROLLER_POLL_EXIT;
+
+    ctroller_exit();
+    return NULL;
+}
+
+/* A state that moves the circle pad a little every frame, encoded against
+ * the all-zero one
+ */
+static size_t bench_pack(unsigned char *packet, uint32_t sequence)
+{
+    struct protocol_header header = {
+        .version  = CTROLLER_PACKET_VERSION,
+        .sequence = sequence,
+        .type     = PACKET_STATE,
+    };
+    int16_t dx      = (int16_t) (sequence % 64) - 32;
+    uint16_t bitmap = BIT(PROTOCOL_FIELD_CIRCLEPAD_X);
+
+    unsigned char *buf = packet + protocol_pack_header(packet, &header);
+    *buf++             = 0;
+    *buf++             = bitmap >> 8;
+    *buf++             = bitmap & 0xff;
+    *buf++             = (uint16_t) (dx << 1 ^ dx >> 15);
+    return buf - packet;
+}
+
+static int bench_send(int sock, unsigned rate, unsigned seconds)
+{
+    unsigned char packet[PACKET_SIZE];
+    struct protocol_header header = {
+        .version  = CTROLLER_PACKET_VERSION,
+        .sequence = 0,
+        .type     = PACKET_HELLO,
+    };
+    protocol_pack_header(packet, &header);
+    packet[PACKET_REV2_HEADER_SIZE] = PROTOCOL_SENSOR_CIRCLEPAD;
+    if (send(sock, packet, PACKET_REV2_HELLO_SIZE, 0) < 0) {
+        perror("Error sending hello");
+        return -1;
+    }
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint32_t sequence = 1; sequence <= rate * seconds; sequence++) {
+        next.tv_nsec += 1000000000 / rate;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+               EINTR) {
+        }
+
+        size_t len = bench_pack(packet, sequence);
+        if (send(sock, packet, len, 0) < 0) {
+            perror("Error sending state");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int bench_run(struct bench_run *run,
+                     int stop,
+                     unsigned rate,
+                     unsigned seconds)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bench_receive, run) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&bench_lock);
+    while (!run->ready) {
+        pthread_cond_wait(&bench_cond, &bench_lock);
+    }
+    pthread_mutex_unlock(&bench_lock);
+
+    // A sender of its own for every run, so that each starts a new session
+    int sock = -1;
+    if (!run->failed) {
+        struct sockaddr_in to = {
+            .sin_family      = AF_INET,
+            .sin_port        = htons(atoi(BENCH_PORT)),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0 ||
+            connect(sock, (struct sockaddr *) &to, sizeof(to)) < 0 ||
+            bench_send(sock, rate, seconds) < 0) {
+            run->failed = 1;
+        }
+
+        // Let the last packets get through before stopping the receiver
+        usleep(100000);
+        uint64_t one = 1;
+        if (write(stop, &one, sizeof(one)) < 0) {
+            perror("Error stopping the receiver");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_join(thread, NULL);
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    // The stop fd is shared by all runs; reset it for the next one
+    uint64_t count;
+    if (!run->failed && read(stop, &count, sizeof(count)) < 0) {
+        perror("Error resetting the stop fd");
+        exit(EXIT_FAILURE);
+    }
+    return run->failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned seconds = BENCH_SECONDS_DEFAULT;
+    if (argc > 1 && (seconds = atoi(argv[1])) == 0) {
+        fprintf(stderr, "Usage: %s [<seconds>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int stop = eventfd(0, 0);
+    if (stop < 0) {
+        perror("Error creating the stop fd");
+        return EXIT_FAILURE;
+    }
+    ctroller_set_signal_fd(stop);
+
+    struct bench_run runs[arrsize(bench_rates)][arrsize(bench_receivers)];
+    int failed = 0;
+    for (size_t r = 0; r < arrsize(bench_rates); r++) {
+        for (size_t i = 0; i < arrsize(bench_receivers); i++) {
+            runs[r][i] = (struct bench_run){.receiver = &bench_receivers[i]};
+            failed |= bench_run(&runs[r][i], stop, bench_rates[r], seconds) < 0;
+        }
+    }
+
+    printf("\n%-9s %6s %8s %8s %12s\n",
+           "receiver",
+           "rate",
+           "packets",
+           "calls",
+           "CPU/packet");
+    for (size_t r = 0; r < arrsize(bench_rates); r++) {
+        for (size_t i = 0; i < arrsize(bench_receivers); i++) {
+            const struct bench_run *run = &runs[r][i];
+            if (run->failed) {
+                printf("%-9s %4u Hz   failed\n",
+                       run->receiver->name,
+                       bench_rates[r]);
+                continue;
+            }
+            printf("%-9s %4u Hz %8lu %8lu %9.2f us\n",
+                   run->receiver->name,
+                   bench_rates[r],
+                   run->packets,
+                   run->recv_calls,
+                   run->packets ? run->cpu_ns / 1e3 / run->packets : 0);
+        }
+    }
+
+    close(stop);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
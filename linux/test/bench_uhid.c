@@ -0,0 +1,120 @@
+/* Measures what building and writing an update of the gamepad costs with
+ * each backend: input_event structs for uinput, one packed report for uhid.
+ * Both write to /dev/null, so that only the work of the server is counted,
+ * not that of the kernel on the other side.
+ *
+ * Usage: bench_uhid
+ *
+ * The states move both circle pad axes every time and toggle A every 16
+ * states, as a 3DS whose stick is held in motion does.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/uhid.h>
+
+#include "devices.h"
+#include "hid.h"
+#include "keymap.h"
+
+#define arrsize(a) (sizeof(a) / sizeof(a[0]))
+
+#define BENCH_STATES (1 << 20)
+#define BENCH_ROUNDS 5
+
+/* What uhid_write() writes for a report: the header of the event and the
+ * 11 bytes of the report
+ */
+#define BENCH_UHID_REPORT                                                      \
+    (offsetof(struct uhid_event, u.input2.data) + sizeof(uint16_t) +           \
+     sizeof(uint8_t) + 4 * sizeof(int16_t))
+
+struct bench_backend {
+    const char *name;
+    const struct device_context *template;
+    struct device_context dev;
+    double ns;
+    double bytes;
+};
+
+static void bench_state(struct hidinfo *hid, unsigned i)
+{
+    hid->circlepad.dx = (int) (i % 300) - 150;
+    hid->circlepad.dy = (int) (i * 7 % 300) - 150;
+    hid->keys.held    = (i >> 4) & 1 ? HID_KEY_A : 0;
+}
+
+static void bench_run(struct bench_backend *backend, int fd)
+{
+    struct hidinfo hid = {};
+
+    backend->dev    = *backend->template;
+    backend->dev.fd = fd;
+    if (backend->template == &device_gamepad) {
+        gamepad_part(&backend->dev);
+    }
+
+    for (unsigned round = 0; round < BENCH_ROUNDS; round++) {
+        struct device_stats before = device_stats;
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < BENCH_STATES; i++) {
+            bench_state(&hid, i);
+            backend->dev.write(&backend->dev, &hid);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+                     (end.tv_nsec - start.tv_nsec)) /
+                    BENCH_STATES;
+        if (round == 0 || ns < backend->ns) {
+            backend->ns = ns;
+        }
+
+        // The events include the SYN_REPORT closing each write
+        unsigned long events  = device_stats.events - before.events;
+        unsigned long reports = device_stats.reports - before.reports;
+
+        backend->bytes = (double) (events * sizeof(struct input_event) +
+                                   reports * BENCH_UHID_REPORT) /
+                         BENCH_STATES;
+    }
+}
+
+int main(void)
+{
+    struct keymap *map = keymap_default();
+    if (map == NULL || gamepad_set_keymap(map) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Error opening /dev/null");
+        return EXIT_FAILURE;
+    }
+
+    struct bench_backend backends[] = {
+        {.name = "uinput", .template = &device_gamepad},
+        {.name = "uhid", .template = &device_uhid},
+    };
+
+    printf("Per state, best of %d rounds of %d:\n", BENCH_ROUNDS, BENCH_STATES);
+    for (size_t i = 0; i < arrsize(backends); i++) {
+        bench_run(&backends[i], fd);
+        printf("  %-8s %7.1f ns %7.1f bytes\n",
+               backends[i].name,
+               backends[i].ns,
+               backends[i].bytes);
+    }
+
+    close(fd);
+    gamepad_free_keymaps();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,359 @@
+/* Replays a scripted series of button taps through the revision 2 ingest
+ * path, dropping and reordering packets by a loss pattern, and checks that
+ * every tap reaches the gamepad exactly once.
+ *
+ * Usage: replay [<pattern>...]
+ *
+ *   random:<percent>     lose each packet with the given probability
+ *   burst:<len>/<period> lose 'len' packets in a row out of every 'period'
+ *   late:<period>        deliver every 'period'th packet after the next one
+ *
+ * Without arguments, a set of patterns within the reach of the edge records
+ * the client sends (see CFG_EDGE_RECORDS) is run. Each pattern is run once
+ * with every packet written right away, and once coalesced into bursts as
+ * the batch receivers do.
+ */
+
+// The ingest path is internal to ctroller.c
+#include "../src/ctroller.c"
+
+#define REPLAY_FRAMES 4000
+
+/* Frames at the end that are neither tapped in nor lost, so that the last
+ * releases get through as they would with the client still sending
+ */
+#define REPLAY_TAIL 8
+
+/* Edge records the 3DS client keeps, as in its CFG_EDGE_RECORDS */
+#define REPLAY_EDGE_RECORDS 4
+
+/* Packets coalesced into one burst */
+#define REPLAY_BURST 4
+
+static const uint32_t replay_keys[] = {
+    HID_KEY_A, HID_KEY_B, HID_KEY_X, HID_KEY_Y, HID_KEY_L, HID_KEY_R,
+};
+
+struct replay_pattern {
+    enum { REPLAY_RANDOM, REPLAY_BURSTS, REPLAY_LATE } kind;
+    unsigned len;
+    unsigned period;
+};
+
+/* What the gamepad got to see */
+static struct {
+    uint32_t held;
+    unsigned presses[arrsize(replay_keys)];
+} seen;
+
+static uint32_t replay_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int replay_write(struct device_context *dev, struct hidinfo *hid)
+{
+    (void) dev;
+
+    uint32_t pressed = hid->keys.held & ~seen.held;
+    for (unsigned k = 0; k < arrsize(replay_keys); k++) {
+        if (pressed & replay_keys[k]) {
+            seen.presses[k]++;
+        }
+    }
+    seen.held = hid->keys.held;
+    return 0;
+}
+
+static unsigned char *replay_varint(unsigned char *buf, uint32_t value)
+{
+    while (value >= 0x80) {
+        *buf++ = value | 0x80;
+        value >>= 7;
+    }
+    *buf++ = value;
+    return buf;
+}
+
+/* Encode a state against the all-zero one, followed by the edge records of
+ * the packets before it, as the 3DS client does
+ */
+static size_t replay_pack(unsigned char *packet,
+                          const struct hidinfo *hid,
+                          const struct protocol_edges *edges)
+{
+    struct protocol_header header = {
+        .version  = CTROLLER_PACKET_VERSION,
+        .sequence = hid->sequence,
+        .type     = PACKET_STATE,
+    };
+
+    unsigned char *buf = packet + protocol_pack_header(packet, &header);
+    *buf++             = 0;
+
+    unsigned char *bitmap_at = buf;
+    uint16_t bitmap          = 0;
+    buf += sizeof(bitmap);
+
+    if (hid->keys.up) {
+        bitmap |= BIT(PROTOCOL_FIELD_KEYS_UP);
+        buf = replay_varint(buf, hid->keys.up);
+    }
+    if (hid->keys.down) {
+        bitmap |= BIT(PROTOCOL_FIELD_KEYS_DOWN);
+        buf = replay_varint(buf, hid->keys.down);
+    }
+    if (hid->keys.held) {
+        bitmap |= BIT(PROTOCOL_FIELD_KEYS_HELD);
+        buf = replay_varint(buf, hid->keys.held);
+    }
+
+    if (edges->count > 0) {
+        bitmap |= PROTOCOL_EDGE_RECORDS;
+        *buf++ = edges->count;
+        for (unsigned i = 0; i < edges->count; i++) {
+            *buf++ = edges->records[i].distance;
+            buf    = replay_varint(buf, edges->records[i].down);
+            buf    = replay_varint(buf, edges->records[i].up);
+        }
+    }
+
+    bitmap_at[0] = bitmap >> 8;
+    bitmap_at[1] = bitmap & 0xff;
+    return buf - packet;
+}
+
+static int replay_lost(const struct replay_pattern *pattern,
+                       unsigned frame,
+                       uint32_t *random)
+{
+    switch (pattern->kind) {
+    case REPLAY_RANDOM:
+        return replay_random(random) % 100 < pattern->len;
+    case REPLAY_BURSTS:
+        return frame % pattern->period < pattern->len;
+    default:
+        return 0;
+    }
+}
+
+static void replay_ingest(unsigned char *packet,
+                          size_t len,
+                          const struct sockaddr_in *from,
+                          int coalesce)
+{
+    ctroller.now = ctroller_clock();
+    ctroller_ingest(packet,
+                    len,
+                    (const struct sockaddr *) from,
+                    sizeof(*from),
+                    0,
+                    coalesce);
+}
+
+static int replay_run(const struct replay_pattern *pattern,
+                      const char *name,
+                      int coalesce)
+{
+    static unsigned port = 20000;
+
+    // A sender of its own for every run, so that each starts a new session
+    struct sockaddr_in from = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port++),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    unsigned char hello[PACKET_REV2_HELLO_SIZE];
+    struct protocol_header header = {
+        .version  = CTROLLER_PACKET_VERSION,
+        .sequence = 0,
+        .type     = PACKET_HELLO,
+    };
+    protocol_pack_header(hello, &header);
+    hello[PACKET_REV2_HEADER_SIZE] = PROTOCOL_SENSOR_ALL;
+    replay_ingest(hello, sizeof(hello), &from, 0);
+
+    struct session *session = session_lookup(
+        &ctroller.sessions, (const struct sockaddr *) &from, sizeof(from));
+    if (session == NULL) {
+        fprintf(stderr, "%s: no session after hello\n", name);
+        return -1;
+    }
+
+    // Only the gamepad, writing to replay_write() instead of uinput
+    session->devices_open = 1;
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        session->devices[i]    = device_gamepad;
+        session->devices[i].fd = -1;
+    }
+    session->devices[DEVICE_GAMEPAD].fd    = open("/dev/null", O_WRONLY);
+    session->devices[DEVICE_GAMEPAD].write = replay_write;
+    memset(&seen, 0, sizeof(seen));
+
+    struct {
+        uint32_t sequence, down, up;
+    } history[REPLAY_EDGE_RECORDS];
+    unsigned history_count = 0;
+
+    unsigned taps[arrsize(replay_keys)]    = {};
+    unsigned release[arrsize(replay_keys)] = {};
+    uint32_t random                        = 0x3d5c;
+    uint32_t held                          = 0;
+    unsigned next_tap                      = 4;
+
+    unsigned char late[PACKET_SIZE];
+    size_t late_len = 0;
+    unsigned queued = 0;
+
+    for (unsigned frame = 1; frame <= REPLAY_FRAMES + REPLAY_TAIL; frame++) {
+        int tail           = frame > REPLAY_FRAMES;
+        struct hidinfo hid = {.sequence = frame};
+
+        // Taps of one to three frames, a few frames apart
+        for (unsigned k = 0; k < arrsize(replay_keys); k++) {
+            if (release[k] == frame) {
+                hid.keys.up |= replay_keys[k];
+            }
+        }
+        if (frame == next_tap && !tail) {
+            unsigned k = replay_random(&random) % arrsize(replay_keys);
+            if (!(held & replay_keys[k])) {
+                hid.keys.down |= replay_keys[k];
+                release[k] = frame + 1 + replay_random(&random) % 3;
+                taps[k]++;
+            }
+            next_tap = frame + 4 + replay_random(&random) % 8;
+        }
+        held          = (held & ~hid.keys.up) | hid.keys.down;
+        hid.keys.held = held;
+
+        struct protocol_edges edges = {.count = history_count};
+        for (unsigned i = 0; i < history_count; i++) {
+            edges.records[i].distance = frame - history[i].sequence;
+            edges.records[i].down     = history[i].down;
+            edges.records[i].up       = history[i].up;
+        }
+
+        unsigned char packet[PACKET_SIZE];
+        size_t len = replay_pack(packet, &hid, &edges);
+
+        if (hid.keys.down || hid.keys.up) {
+            if (history_count == REPLAY_EDGE_RECORDS) {
+                memmove(&history[0],
+                        &history[1],
+                        (REPLAY_EDGE_RECORDS - 1) * sizeof(history[0]));
+                history_count--;
+            }
+            history[history_count].sequence = frame;
+            history[history_count].down     = hid.keys.down;
+            history[history_count].up       = hid.keys.up;
+            history_count++;
+        }
+
+        if (!tail && pattern->kind == REPLAY_LATE &&
+            frame % pattern->period == 0) {
+            memcpy(late, packet, len);
+            late_len = len;
+            continue;
+        }
+        if (!tail && replay_lost(pattern, frame, &random)) {
+            continue;
+        }
+
+        replay_ingest(packet, len, &from, coalesce);
+        if (late_len > 0) {
+            replay_ingest(late, late_len, &from, coalesce);
+            late_len = 0;
+        }
+        if (coalesce && ++queued % REPLAY_BURST == 0) {
+            ctroller_flush_burst();
+        }
+    }
+    if (coalesce) {
+        ctroller_flush_burst();
+    }
+
+    unsigned lost  = 0;
+    unsigned extra = 0;
+    unsigned total = 0;
+    for (unsigned k = 0; k < arrsize(replay_keys); k++) {
+        total += taps[k];
+        if (seen.presses[k] < taps[k]) {
+            lost += taps[k] - seen.presses[k];
+        } else {
+            extra += seen.presses[k] - taps[k];
+        }
+    }
+
+    int ok = lost == 0 && extra == 0 && seen.held == held;
+    printf("%-14s %-9s %4u taps, %u lost, %u extra%s: %s\n",
+           name,
+           coalesce ? "coalesced" : "direct",
+           total,
+           lost,
+           extra,
+           seen.held == held ? "" : ", keys left held",
+           ok ? "ok" : "FAILED");
+
+    session_close(&ctroller.sessions, session);
+    return ok ? 0 : -1;
+}
+
+static int replay_parse(const char *arg, struct replay_pattern *pattern)
+{
+    char tail;
+
+    if (sscanf(arg, "random:%u%c", &pattern->len, &tail) == 1) {
+        pattern->kind = REPLAY_RANDOM;
+        return pattern->len <= 100 ? 0 : -1;
+    }
+    if (sscanf(arg, "burst:%u/%u%c", &pattern->len, &pattern->period, &tail) ==
+        2) {
+        pattern->kind = REPLAY_BURSTS;
+        return pattern->period > 0 ? 0 : -1;
+    }
+    if (sscanf(arg, "late:%u%c", &pattern->period, &tail) == 1) {
+        pattern->kind = REPLAY_LATE;
+        return pattern->period > 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *defaults[] = {
+        "random:0", "random:10", "random:25", "burst:3/16", "burst:6/32",
+        "late:5",
+    };
+
+    const char **patterns = (const char **) argv + 1;
+    int count             = argc - 1;
+    if (count == 0) {
+        patterns = defaults;
+        count    = arrsize(defaults);
+    }
+
+    if (ctroller_init("/dev/null", "0", BIT(DEVICE_GAMEPAD), 0) < 0) {
+        perror("Error initializing ctroller");
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        struct replay_pattern pattern;
+        if (replay_parse(patterns[i], &pattern) < 0) {
+            fprintf(stderr, "Invalid loss pattern '%s'.\n", patterns[i]);
+            failed = 1;
+            continue;
+        }
+        failed |= replay_run(&pattern, patterns[i], 0) < 0;
+        failed |= replay_run(&pattern, patterns[i], 1) < 0;
+    }
+
+    ctroller_exit();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
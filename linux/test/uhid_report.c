@@ -0,0 +1,399 @@
+/* Checks the report descriptor of the HID gamepad against the reports it
+ * writes: the descriptor is parsed into the fields of a report, and reports
+ * written for a series of states are decoded by them and compared with what
+ * the key table of earlier versions would have reported.
+ *
+ * Usage: uhid_report
+ */
+
+// The descriptor and the report are internal to uhid.c
+#include "../src/devices/uhid.c"
+
+#include <stdlib.h>
+
+#define arrsize(a) (sizeof(a) / sizeof(a[0]))
+
+#define REPORT_STATES 4096
+#define REPORT_FIELDS 8
+
+/* A field of the report: the usages it covers, where its bits are and the
+ * range of its values
+ */
+struct report_field {
+    uint16_t page;
+    uint16_t usage_min;
+    uint16_t usage_max;
+    unsigned offset;
+    unsigned size;
+    unsigned count;
+    int32_t min;
+    int32_t max;
+    int null_state;
+};
+
+struct report_layout {
+    unsigned bits;
+    unsigned count;
+    struct report_field fields[REPORT_FIELDS];
+};
+
+/* The buttons of the key table and the HID button each one is, BTN_SOUTH
+ * being button 1
+ */
+static const struct {
+    uint32_t key;
+    uint16_t code;
+} report_keys[] = {
+    {HID_KEY_A, BTN_SOUTH},
+    {HID_KEY_B, BTN_EAST},
+    {HID_KEY_X, BTN_NORTH},
+    {HID_KEY_Y, BTN_WEST},
+    {HID_KEY_START, BTN_START},
+    {HID_KEY_SELECT, BTN_SELECT},
+    {HID_KEY_L, BTN_TL},
+    {HID_KEY_R, BTN_TR},
+    {HID_KEY_ZL, BTN_TL2},
+    {HID_KEY_ZR, BTN_TR2},
+};
+
+static int32_t report_item(const uint8_t *data, unsigned size, int is_signed)
+{
+    uint32_t value = 0;
+    for (unsigned i = 0; i < size; i++) {
+        value |= (uint32_t) data[i] << (8 * i);
+    }
+    if (is_signed && size > 0 && size < 4 &&
+        value & (1u << (8 * size - 1))) {
+        value |= ~0u << (8 * size);
+    }
+    return (int32_t) value;
+}
+
+/* Parses the short items of a descriptor with a single collection and no
+ * report IDs
+ *
+ * @returns -1 if it uses items this parser does not know, or has unbalanced
+ *          collections
+ */
+static int report_parse(const uint8_t *data,
+                        size_t len,
+                        struct report_layout *layout)
+{
+    uint16_t page = 0, usages[8], usage_min = 0, usage_max = 0;
+    unsigned usage_count = 0, size = 0, count = 0;
+    int32_t min = 0, max = 0;
+    int depth = 0;
+
+    memset(layout, 0, sizeof(*layout));
+    for (size_t i = 0; i < len;) {
+        uint8_t prefix = data[i++];
+        unsigned bytes = (prefix & 3) == 3 ? 4 : prefix & 3;
+        if (i + bytes > len) {
+            return -1;
+        }
+        int32_t value  = report_item(&data[i], bytes, 0);
+        int32_t svalue = report_item(&data[i], bytes, 1);
+        i += bytes;
+
+        switch (prefix & 0xfc) {
+        case 0x04: // Usage Page
+            page = value;
+            break;
+        case 0x14: // Logical Minimum
+            min = svalue;
+            break;
+        case 0x24: // Logical Maximum
+            max = svalue;
+            break;
+        case 0x34: // Physical Minimum
+        case 0x44: // Physical Maximum
+        case 0x64: // Unit
+            break;
+        case 0x74: // Report Size
+            size = value;
+            break;
+        case 0x94: // Report Count
+            count = value;
+            break;
+        case 0x08: // Usage
+            if (usage_count == arrsize(usages)) {
+                return -1;
+            }
+            usages[usage_count++] = value;
+            break;
+        case 0x18: // Usage Minimum
+            usage_min = value;
+            break;
+        case 0x28: // Usage Maximum
+            usage_max = value;
+            break;
+        case 0xa0: // Collection
+            depth++;
+            usage_count = 0;
+            break;
+        case 0xc0: // End Collection
+            if (--depth < 0) {
+                return -1;
+            }
+            break;
+        case 0x80: // Input
+            // Constant fields only pad; others take the usages listed before
+            // them in turn, or the range
+            if (!(value & 1)) {
+                if (layout->count + (usage_count ? count : 1) > REPORT_FIELDS) {
+                    return -1;
+                }
+                for (unsigned f = 0; f < count; f++) {
+                    struct report_field *field =
+                        &layout->fields[layout->count++];
+                    *field = (struct report_field){
+                        .page       = page,
+                        .usage_min  = usage_count ? usages[f] : usage_min,
+                        .usage_max  = usage_count ? usages[f] : usage_max,
+                        .offset     = layout->bits + f * size,
+                        .size       = size,
+                        .count      = usage_count ? 1 : count,
+                        .min        = min,
+                        .max        = max,
+                        .null_state = (value & 0x40) != 0,
+                    };
+                    if (!usage_count) {
+                        break;
+                    }
+                }
+            }
+            layout->bits += size * count;
+            usage_count = usage_min = usage_max = 0;
+            break;
+        default:
+            fprintf(stderr, "Unknown item %02x\n", prefix);
+            return -1;
+        }
+    }
+    return depth == 0 ? 0 : -1;
+}
+
+static int32_t report_get(const uint8_t *report,
+                          unsigned offset,
+                          unsigned size,
+                          int is_signed)
+{
+    uint32_t value = 0;
+    for (unsigned i = 0; i < size; i++) {
+        unsigned bit = offset + i;
+        value |= (uint32_t) ((report[bit / 8] >> (bit % 8)) & 1) << i;
+    }
+    if (is_signed && size < 32 && value & (1u << (size - 1))) {
+        value |= ~0u << size;
+    }
+    return (int32_t) value;
+}
+
+static const struct report_field *
+report_find(const struct report_layout *layout, uint16_t page, uint16_t usage)
+{
+    for (unsigned i = 0; i < layout->count; i++) {
+        const struct report_field *field = &layout->fields[i];
+        if (field->page == page && field->usage_min <= usage &&
+            usage <= field->usage_max) {
+            return field;
+        }
+    }
+    return NULL;
+}
+
+/* The fields the gamepad reports, with the ranges the uinput gamepad gives
+ * them
+ */
+static int report_check_layout(const struct report_layout *layout)
+{
+    static const uint16_t axes[] = {0x30, 0x31, 0x33, 0x34};
+
+    if (layout->bits != 8 * sizeof(struct uhid_report)) {
+        fprintf(stderr,
+                "Report has %u bits instead of %zu\n",
+                layout->bits,
+                8 * sizeof(struct uhid_report));
+        return -1;
+    }
+
+    const struct report_field *buttons = report_find(layout, 0x09, 1);
+    if (buttons == NULL || buttons->usage_max != UHID_BUTTONS ||
+        buttons->size != 1 || buttons->offset != 0) {
+        fprintf(stderr, "Buttons 1 to %d are not at the start\n", UHID_BUTTONS);
+        return -1;
+    }
+
+    const struct report_field *hat = report_find(layout, 0x01, 0x39);
+    if (hat == NULL || hat->min != 0 || hat->max != 7 || !hat->null_state ||
+        hat->offset != 8 * offsetof(struct uhid_report, hat)) {
+        fprintf(stderr, "Hat switch is not an 8-way one with a null state\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < arrsize(axes); i++) {
+        const struct report_field *axis = report_find(layout, 0x01, axes[i]);
+        if (axis == NULL || axis->min != -0x9c || axis->max != 0x9c ||
+            axis->offset != 8 * offsetof(struct uhid_report, axis[i])) {
+            fprintf(stderr,
+                    "Axis %02x is not where the report has it\n",
+                    axes[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void report_state(struct hidinfo *hid, uint32_t *random)
+{
+    *random ^= *random << 13;
+    *random ^= *random >> 17;
+    *random ^= *random << 5;
+
+    hid->keys.held    = *random;
+    hid->circlepad.dx = (int) (*random % 313) - 156;
+    hid->circlepad.dy = (int) (*random / 313 % 313) - 156;
+    hid->cstick.dx    = (int) (*random >> 8 & 0xff) - 128;
+    hid->cstick.dy    = (int) (*random >> 16 & 0xff) - 128;
+}
+
+/* Decodes a report by the layout and compares it with the state */
+static int report_check(const struct report_layout *layout,
+                        const uint8_t *report,
+                        const struct hidinfo *hid)
+{
+    uint32_t keys = hid->keys.held;
+
+    // Buttons the key table has no key for stay released
+    const struct report_field *buttons = report_find(layout, 0x09, 1);
+    for (unsigned button = 0; button < buttons->count; button++) {
+        int32_t expected = 0;
+        for (size_t i = 0; i < arrsize(report_keys); i++) {
+            if (report_keys[i].code == BTN_SOUTH + button) {
+                expected = HID_HAS_KEY(keys, report_keys[i].key);
+            }
+        }
+
+        int32_t value =
+            report_get(report, buttons->offset + button, buttons->size, 0);
+        if (value != expected) {
+            fprintf(stderr,
+                    "Keys %08x: button %u is %d instead of %d\n",
+                    keys,
+                    button + 1,
+                    value,
+                    expected);
+            return -1;
+        }
+    }
+
+    // Left and up win, as they did in the key table
+    int x = 0, y = 0;
+    if (HID_HAS_KEY(keys, HID_KEY_DLEFT)) {
+        x = -1;
+    } else if (HID_HAS_KEY(keys, HID_KEY_DRIGHT)) {
+        x = 1;
+    }
+    if (HID_HAS_KEY(keys, HID_KEY_DUP)) {
+        y = -1;
+    } else if (HID_HAS_KEY(keys, HID_KEY_DDOWN)) {
+        y = 1;
+    }
+
+    // Clockwise from north in eighths, and out of range when centered
+    static const int32_t hats[3][3] = {{7, 0, 1}, {6, -1, 2}, {5, 4, 3}};
+    const struct report_field *hat  = report_find(layout, 0x01, 0x39);
+    int32_t value    = report_get(report, hat->offset, hat->size, 0);
+    int32_t expected = hats[y + 1][x + 1];
+    if (expected < 0 ? value >= hat->min && value <= hat->max
+                     : value != expected) {
+        fprintf(stderr,
+                "Keys %08x: hat is %d instead of %d\n",
+                keys,
+                value,
+                expected);
+        return -1;
+    }
+
+    const int32_t axes[][2] = {
+        {0x30, hid->circlepad.dx},
+        {0x31, -hid->circlepad.dy},
+        {0x33, hid->cstick.dx},
+        {0x34, -hid->cstick.dy},
+    };
+    for (size_t i = 0; i < arrsize(axes); i++) {
+        const struct report_field *axis = report_find(layout, 0x01, axes[i][0]);
+        value = report_get(report, axis->offset, axis->size, 1);
+        if (value != axes[i][1]) {
+            fprintf(stderr,
+                    "Axis %02x is %d instead of %d\n",
+                    axes[i][0],
+                    value,
+                    axes[i][1]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    struct report_layout layout;
+    if (report_parse(descriptor, sizeof(descriptor), &layout) < 0 ||
+        report_check_layout(&layout) < 0) {
+        fprintf(stderr, "Report descriptor does not match the report\n");
+        return EXIT_FAILURE;
+    }
+
+    struct keymap *map = keymap_default();
+    if (map == NULL || gamepad_set_keymap(map) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("Error creating pipe");
+        return EXIT_FAILURE;
+    }
+
+    struct device_context dev = device_uhid;
+    dev.fd                    = fds[1];
+
+    struct hidinfo hid = {};
+    uint32_t random    = 0x3d5c;
+    int failed         = 0;
+    for (unsigned n = 0; n < REPORT_STATES && !failed; n++) {
+        report_state(&hid, &random);
+
+        // The same state again has nothing new to report
+        unsigned long reports = device_stats.reports;
+        if (uhid_write(&dev, &hid) < 0 || uhid_write(&dev, &hid) < 0 ||
+            device_stats.reports != reports + 1) {
+            fprintf(stderr, "State %u was not reported once\n", n);
+            failed = 1;
+            break;
+        }
+
+        struct uhid_event event;
+        size_t len = offsetof(struct uhid_event, u.input2.data) +
+                     sizeof(struct uhid_report);
+        if (read(fds[0], &event, len) != (ssize_t) len ||
+            event.type != UHID_INPUT2 ||
+            event.u.input2.size != sizeof(struct uhid_report)) {
+            fprintf(stderr, "State %u: malformed event\n", n);
+            failed = 1;
+            break;
+        }
+        failed = report_check(&layout, event.u.input2.data, &hid) < 0;
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    gamepad_free_keymaps();
+    if (failed) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%d reports match the descriptor\n", REPORT_STATES);
+    return EXIT_SUCCESS;
+}